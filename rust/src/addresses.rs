@@ -0,0 +1,230 @@
+//! Bulk allocation of diversified unified addresses.
+//!
+//! Addresses are stored in the `addresses` table in the same form as the upstream
+//! `get_next_available_address` stores them, so that the two can be used together.
+
+use anyhow::anyhow;
+use rayon::prelude::*;
+use rusqlite::{named_params, Connection, Transaction, TransactionBehavior};
+use zcash_client_backend::{
+    address::UnifiedAddress, encoding::AddressCodec, keys::UnifiedFullViewingKey,
+};
+use zcash_primitives::{
+    consensus::Network,
+    zip32::{AccountId, DiversifierIndex},
+};
+
+/// The number of candidate diversifier indices that are tried in parallel per requested
+/// address. About half of all indices yield a valid Sapling diversifier.
+const CANDIDATES_PER_ADDRESS: u64 = 2;
+
+/// The diversifier indices that can be used for transparent receivers, which are non-hardened
+/// BIP 32 child indices.
+const MAX_TRANSPARENT_INDEX: u64 = (1 << 31) - 1;
+
+/// The largest number of addresses that can be allocated in one call, which bounds the time
+/// for which the write lock on the data database is held.
+pub(crate) const MAX_ADDRESSES: usize = 1000;
+
+fn from_index_be(index_be: &[u8]) -> anyhow::Result<u64> {
+    match index_be.split_at(index_be.len().saturating_sub(8)) {
+        (high, low) if high.iter().all(|b| *b == 0) => {
+            let mut bytes = [0; 8];
+            bytes[8 - low.len()..].copy_from_slice(low);
+            Ok(u64::from_be_bytes(bytes))
+        }
+        _ => Err(anyhow!("Diversifier index out of range")),
+    }
+}
+
+fn diversifier_index(j: u64) -> DiversifierIndex {
+    let mut index = DiversifierIndex::new();
+    index.0[..8].copy_from_slice(&j.to_le_bytes());
+    index
+}
+
+/// Derives the next `count` unified addresses of `account` after its current address, stores
+/// them in a single transaction, and returns their encodings in order of diversifier index.
+///
+/// The transaction takes the write lock before reading the current address, so that
+/// concurrent allocations (including `get_next_available_address`) are serialised rather than
+/// choosing the same diversifier indices. Candidate diversifier indices are tried in parallel
+/// on the Rayon thread pool. At most [`MAX_ADDRESSES`] addresses can be allocated at once.
+pub(crate) fn allocate(
+    conn: &Connection,
+    network: &Network,
+    account: AccountId,
+    ufvk: &UnifiedFullViewingKey,
+    count: usize,
+) -> anyhow::Result<Vec<String>> {
+    if count > MAX_ADDRESSES {
+        return Err(anyhow!(
+            "Cannot allocate more than {} addresses at once",
+            MAX_ADDRESSES
+        ));
+    }
+
+    let tx = Transaction::new_unchecked(conn, TransactionBehavior::Immediate)?;
+
+    let current: Option<Vec<u8>> = tx.query_row(
+        "SELECT MAX(diversifier_index_be) FROM addresses WHERE account = :account",
+        named_params! {":account": u32::from(account)},
+        |row| row.get(0),
+    )?;
+    let mut next = match current {
+        Some(index_be) => from_index_be(&index_be)? + 1,
+        None => 0,
+    };
+
+    // Indices past the last non-hardened child index cannot be used by keys with a
+    // transparent component.
+    let limit = if ufvk.transparent().is_some() {
+        MAX_TRANSPARENT_INDEX + 1
+    } else {
+        u64::MAX
+    };
+
+    let mut addresses: Vec<(u64, UnifiedAddress)> = Vec::with_capacity(count);
+    while addresses.len() < count {
+        if next >= limit {
+            return Err(anyhow!(
+                "Diversifier indices exhausted for account {:?}",
+                account
+            ));
+        }
+        let remaining = (count - addresses.len()) as u64;
+        let end = next
+            .saturating_add(remaining * CANDIDATES_PER_ADDRESS)
+            .min(limit);
+
+        let found = (next..end)
+            .into_par_iter()
+            .filter_map(|j| ufvk.address(diversifier_index(j)).map(|ua| (j, ua)))
+            .collect::<Vec<_>>();
+        addresses.extend(found.into_iter().take(remaining as usize));
+        next = end;
+    }
+
+    let encoded = addresses
+        .par_iter()
+        .map(|(j, ua)| {
+            let mut index_be = diversifier_index(*j).0;
+            index_be.reverse();
+            (
+                index_be,
+                ua.encode(network),
+                ua.transparent().map(|taddr| taddr.encode(network)),
+            )
+        })
+        .collect::<Vec<_>>();
+
+    let mut stmt = tx.prepare(
+        "INSERT INTO addresses (
+            account, diversifier_index_be, address, cached_transparent_receiver_address
+        )
+        VALUES (:account, :diversifier_index_be, :address, :cached_transparent_receiver_address)",
+    )?;
+    for (index_be, address, transparent) in &encoded {
+        stmt.execute(named_params! {
+            ":account": u32::from(account),
+            ":diversifier_index_be": &index_be[..],
+            ":address": address,
+            ":cached_transparent_receiver_address": transparent,
+        })?;
+    }
+    drop(stmt);
+    tx.commit()?;
+
+    Ok(encoded.into_iter().map(|(_, address, _)| address).collect())
+}
+
+#[cfg(test)]
+mod tests {
+    use zcash_client_backend::keys::UnifiedSpendingKey;
+    use zcash_primitives::consensus::Network::TestNetwork;
+
+    use super::*;
+    use crate::wallet_ext::test_wallet;
+
+    fn ufvk() -> UnifiedFullViewingKey {
+        UnifiedSpendingKey::from_seed(&TestNetwork, &[1; 32], AccountId::from(0))
+            .unwrap()
+            .to_unified_full_viewing_key()
+    }
+
+    fn indices(conn: &Connection) -> Vec<u64> {
+        let mut stmt = conn
+            .prepare("SELECT diversifier_index_be FROM addresses ORDER BY diversifier_index_be")
+            .unwrap();
+        let rows = stmt
+            .query_map([], |row| row.get::<_, Vec<u8>>(0))
+            .unwrap()
+            .map(|index_be| from_index_be(&index_be.unwrap()).unwrap());
+        rows.collect()
+    }
+
+    /// Stores a placeholder address at diversifier index `j`.
+    fn insert_index(conn: &Connection, j: u64) {
+        let mut index_be = diversifier_index(j).0;
+        index_be.reverse();
+        conn.execute(
+            "INSERT INTO addresses (account, diversifier_index_be, address)
+            VALUES (0, ?, 'placeholder')",
+            [&index_be[..]],
+        )
+        .unwrap();
+    }
+
+    #[test]
+    fn allocate_continues_after_current_address() {
+        let conn = test_wallet();
+        let ufvk = ufvk();
+        insert_index(&conn, 5);
+
+        let allocated = allocate(&conn, &TestNetwork, AccountId::from(0), &ufvk, 10).unwrap();
+        assert_eq!(allocated.len(), 10);
+
+        let indices = indices(&conn);
+        assert_eq!(indices.len(), 11);
+        assert_eq!(indices[0], 5);
+        for (j, address) in indices[1..].iter().zip(&allocated) {
+            assert!(*j > 5);
+            let expected = ufvk.address(diversifier_index(*j)).unwrap();
+            assert_eq!(address, &expected.encode(&TestNetwork));
+        }
+        assert!(indices.windows(2).all(|pair| pair[0] < pair[1]));
+    }
+
+    #[test]
+    fn allocate_uses_the_last_transparent_indices() {
+        let conn = test_wallet();
+        let ufvk = ufvk();
+        let start = MAX_TRANSPARENT_INDEX - 20;
+        let valid = (start..=MAX_TRANSPARENT_INDEX)
+            .filter(|j| ufvk.address(diversifier_index(*j)).is_some())
+            .count();
+        assert!(valid > 0);
+        insert_index(&conn, start - 1);
+
+        let allocated = allocate(&conn, &TestNetwork, AccountId::from(0), &ufvk, valid).unwrap();
+        assert_eq!(allocated.len(), valid);
+        assert!(indices(&conn).iter().all(|j| *j <= MAX_TRANSPARENT_INDEX));
+
+        assert!(allocate(&conn, &TestNetwork, AccountId::from(0), &ufvk, 1).is_err());
+    }
+
+    #[test]
+    fn allocate_rejects_large_counts() {
+        let conn = test_wallet();
+        let ufvk = ufvk();
+        assert!(allocate(
+            &conn,
+            &TestNetwork,
+            AccountId::from(0),
+            &ufvk,
+            MAX_ADDRESSES + 1
+        )
+        .is_err());
+        assert!(indices(&conn).is_empty());
+    }
+}
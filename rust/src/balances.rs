@@ -0,0 +1,556 @@
+//! Materialised shielded balances.
+//!
+//! Computing a balance sums the unspent notes of an account, which gets slow for wallets
+//! that have received many notes and are polled often. Instead, the balances of every account
+//! at the confirmation depths in [`CACHED_CONFIRMATIONS`] are stored in the `account_balances`
+//! table together with the chain tip they were computed at, and [`refresh`] brings them up to
+//! date after every write to the data database. Reading one of these balances is then a
+//! single-row lookup; other balances are computed on demand. Reads never write to the database.
+//!
+//! A refresh only recomputes the accounts whose balances can have changed since the previous
+//! one: those named by the [`crate::events`] recorded in between, those that received notes in
+//! the transactions that were updated in place, and those with unspent notes that have crossed
+//! one of the cached confirmation depths because the tip has moved. Everything is recomputed
+//! after a rewind, or if events have been trimmed before they were seen.
+//!
+//! Transparent balances are not stored, but are computed for all of an account's
+//! addresses with a single aggregate query.
+
+use rusqlite::{named_params, Connection, OptionalExtension};
+
+use crate::events;
+
+/// The confirmation depths whose balances are stored: the total balance, and the verified
+/// balance at the SDK's default depth (upstream's `ANCHOR_OFFSET`).
+const CACHED_CONFIRMATIONS: [u32; 2] = [1, 10];
+
+/// The deepest of [`CACHED_CONFIRMATIONS`].
+const MAX_CACHED_CONFIRMATIONS: u32 = 10;
+
+/// Returns the balance of unspent notes received by `account` in transactions mined at or
+/// below the anchor height for `min_confirmations`, as computed by the upstream
+/// `get_target_and_anchor_heights` (`min_confirmations = 1` gives the total balance).
+///
+/// Returns `None` if no blocks have been scanned.
+pub(crate) fn get(
+    conn: &Connection,
+    account: u32,
+    min_confirmations: u32,
+) -> rusqlite::Result<Option<i64>> {
+    let (min_height, tip) = match scanned_range(conn)? {
+        Some(range) => range,
+        None => return Ok(None),
+    };
+
+    if CACHED_CONFIRMATIONS.contains(&min_confirmations) {
+        let cached: Option<i64> = conn
+            .query_row(
+                "SELECT balance FROM account_balances
+                WHERE account = :account AND min_confirmations = :min_confirmations
+                AND tip_height = :tip_height",
+                named_params! {
+                    ":account": account,
+                    ":min_confirmations": min_confirmations,
+                    ":tip_height": tip,
+                },
+                |row| row.get(0),
+            )
+            .optional()?;
+        if cached.is_some() {
+            return Ok(cached);
+        }
+    }
+
+    compute(
+        conn,
+        account,
+        anchor_height(min_height, tip, min_confirmations),
+    )
+    .map(Some)
+}
+
+/// Brings the stored balances up to date with the current state of the data database, given
+/// the transactions in `txids` that have been updated in place since the last refresh.
+pub(crate) fn refresh(conn: &Connection, txids: &[[u8; 32]]) -> rusqlite::Result<()> {
+    let tx = conn.unchecked_transaction()?;
+    let (last_seq, last_min_height, last_tip): (Option<i64>, Option<u32>, Option<u32>) = tx
+        .query_row(
+            "SELECT last_seq, min_height, tip_height FROM account_balances_state",
+            [],
+            |row| Ok((row.get(0)?, row.get(1)?, row.get(2)?)),
+        )?;
+    let seq: i64 = tx.query_row("SELECT IFNULL(MAX(seq), 0) FROM wallet_events", [], |row| {
+        row.get(0)
+    })?;
+    let range = scanned_range(&tx)?;
+
+    tx.execute_batch(
+        "CREATE TEMP TABLE IF NOT EXISTS account_balances_dirty (account INTEGER PRIMARY KEY);
+        DELETE FROM account_balances_dirty;",
+    )?;
+    let incremental = match (last_seq, last_min_height, last_tip, range) {
+        (Some(last_seq), Some(last_min_height), Some(last_tip), Some((min_height, tip)))
+            if last_min_height == min_height && last_tip <= tip =>
+        {
+            mark_dirty(
+                &tx,
+                last_seq,
+                anchor_height(min_height, last_tip, MAX_CACHED_CONFIRMATIONS),
+                tip,
+                txids,
+            )?
+        }
+        _ => false,
+    };
+    if !incremental {
+        tx.execute_batch(
+            "DELETE FROM account_balances;
+            INSERT INTO account_balances_dirty SELECT account FROM accounts;",
+        )?;
+    }
+
+    if let Some((min_height, tip)) = range {
+        tx.execute_batch(
+            "DELETE FROM account_balances
+            WHERE account IN (SELECT account FROM account_balances_dirty);",
+        )?;
+        let mut insert = tx.prepare(&format!(
+            "INSERT INTO account_balances (account, min_confirmations, tip_height, balance)
+            SELECT accounts.account, :min_confirmations, :tip_height, {}
+            FROM accounts
+            WHERE accounts.account IN (SELECT account FROM account_balances_dirty)",
+            SHIELDED_BALANCE
+        ))?;
+        for min_confirmations in CACHED_CONFIRMATIONS {
+            insert.execute(named_params! {
+                ":min_confirmations": min_confirmations,
+                ":tip_height": tip,
+                ":anchor_height": anchor_height(min_height, tip, min_confirmations),
+            })?;
+        }
+        drop(insert);
+        // The balances of the other accounts are unchanged at the new tip.
+        tx.execute(
+            "UPDATE account_balances SET tip_height = :tip_height",
+            named_params! {":tip_height": tip},
+        )?;
+    }
+
+    tx.execute(
+        "UPDATE account_balances_state
+        SET last_seq = :last_seq, min_height = :min_height, tip_height = :tip_height",
+        named_params! {
+            ":last_seq": seq,
+            ":min_height": range.map(|(min_height, _)| min_height),
+            ":tip_height": range.map(|(_, tip)| tip),
+        },
+    )?;
+    tx.execute("DELETE FROM account_balances_dirty", [])?;
+    tx.commit()
+}
+
+/// Marks the accounts whose stored balances can have changed since the refresh that saw the
+/// events up to `last_seq` and computed the deepest cached balance at `last_anchor_height`.
+///
+/// Returns `false` if the wallet has been rewound since, or if events have been trimmed before
+/// they were seen, in which case every account has to be recomputed.
+fn mark_dirty(
+    conn: &Connection,
+    last_seq: i64,
+    last_anchor_height: u32,
+    tip: u32,
+    txids: &[[u8; 32]],
+) -> rusqlite::Result<bool> {
+    let complete: bool = conn.query_row(
+        "SELECT
+            NOT EXISTS (SELECT 1 FROM wallet_events WHERE seq > :last_seq AND kind = :rewind)
+            AND (
+                NOT EXISTS (SELECT 1 FROM wallet_events WHERE seq > :last_seq)
+                OR EXISTS (SELECT 1 FROM wallet_events WHERE seq = :last_seq + 1)
+            )",
+        named_params! {":last_seq": last_seq, ":rewind": events::KIND_REWIND},
+        |row| row.get(0),
+    )?;
+    if !complete {
+        return Ok(false);
+    }
+
+    conn.execute(
+        "INSERT OR IGNORE INTO account_balances_dirty
+            SELECT account FROM wallet_events
+            WHERE seq > :last_seq AND account IS NOT NULL
+            UNION
+            SELECT received_notes.account FROM wallet_events
+            JOIN received_notes ON received_notes.tx = wallet_events.id_tx
+            WHERE wallet_events.seq > :last_seq AND wallet_events.kind = :tx_mined
+            UNION
+            SELECT received_notes.account FROM transactions
+            JOIN received_notes ON received_notes.tx = transactions.id_tx
+            WHERE transactions.block > :last_anchor_height AND transactions.block <= :tip
+            AND received_notes.spent IS NULL
+            UNION
+            SELECT account FROM accounts
+            WHERE account NOT IN (SELECT account FROM account_balances)",
+        named_params! {
+            ":last_seq": last_seq,
+            ":tx_mined": events::KIND_TX_MINED,
+            ":last_anchor_height": last_anchor_height,
+            ":tip": tip,
+        },
+    )?;
+    let mut mark_txid = conn.prepare(
+        "INSERT OR IGNORE INTO account_balances_dirty
+            SELECT received_notes.account FROM transactions
+            JOIN received_notes ON received_notes.tx = transactions.id_tx
+            WHERE transactions.txid = ?",
+    )?;
+    for txid in txids {
+        mark_txid.execute([&txid[..]])?;
+    }
+
+    Ok(true)
+}
+
+/// The sum of the unspent notes received by `accounts.account` in transactions mined at or
+/// below `:anchor_height`, which is answered from the `received_notes_account` index.
+const SHIELDED_BALANCE: &str = "IFNULL((
+    SELECT SUM(received_notes.value)
+    FROM received_notes
+    JOIN transactions ON transactions.id_tx = received_notes.tx
+    WHERE received_notes.account = accounts.account
+    AND received_notes.spent IS NULL
+    AND transactions.block <= :anchor_height
+), 0)";
+
+/// The sum of the transparent outputs received by `accounts.account` at or below
+/// `:anchor_height` that have not been spent by a mined transaction. This matches the
+/// upstream `get_transparent_balances`, and is answered from the `utxos_account_height`
+/// index.
+const TRANSPARENT_BALANCE: &str = "IFNULL((
+    SELECT SUM(utxos.value_zat)
+    FROM utxos
+    LEFT OUTER JOIN transactions ON transactions.id_tx = utxos.spent_in_tx
+    WHERE utxos.received_by_account = accounts.account
+    AND utxos.height <= :anchor_height
+    AND transactions.block IS NULL
+), 0)";
+
+/// Returns the transparent balance of `account` at the anchor height for
+/// `min_confirmations`, or `None` if no blocks have been scanned.
+pub(crate) fn get_transparent(
+    conn: &Connection,
+    account: u32,
+    min_confirmations: u32,
+) -> rusqlite::Result<Option<i64>> {
+    let (min_height, tip) = match scanned_range(conn)? {
+        Some(range) => range,
+        None => return Ok(None),
+    };
+    conn.query_row(
+        &format!(
+            "SELECT {} FROM accounts WHERE accounts.account = :account",
+            TRANSPARENT_BALANCE
+        ),
+        named_params! {
+            ":account": account,
+            ":anchor_height": anchor_height(min_height, tip, min_confirmations),
+        },
+        |row| row.get(0),
+    )
+    .optional()
+    .map(|balance| Some(balance.unwrap_or(0)))
+}
+
+/// Returns the transparent balance of every account at the anchor height for
+/// `min_confirmations`, ordered by account, or `None` if no blocks have been scanned.
+pub(crate) fn get_transparent_for_all_accounts(
+    conn: &Connection,
+    min_confirmations: u32,
+) -> rusqlite::Result<Option<Vec<(u32, i64)>>> {
+    let (min_height, tip) = match scanned_range(conn)? {
+        Some(range) => range,
+        None => return Ok(None),
+    };
+    conn.prepare(&format!(
+        "SELECT accounts.account, {} FROM accounts ORDER BY accounts.account",
+        TRANSPARENT_BALANCE
+    ))?
+    .query_map(
+        named_params! {":anchor_height": anchor_height(min_height, tip, min_confirmations)},
+        |row| Ok((row.get(0)?, row.get(1)?)),
+    )?
+    .collect::<rusqlite::Result<Vec<_>>>()
+    .map(Some)
+}
+
+/// The balances of an account, as returned by [`get_for_all_accounts`].
+pub(crate) struct AccountBalance {
+    pub(crate) account: u32,
+    /// The shielded balance of notes with at least one confirmation.
+    pub(crate) total: i64,
+    /// The shielded balance of notes with at least `min_confirmations` confirmations.
+    pub(crate) verified: i64,
+    /// The transparent balance of all known UTXOs.
+    pub(crate) transparent: i64,
+    /// The transparent balance of UTXOs with at least `min_confirmations` confirmations.
+    pub(crate) transparent_verified: i64,
+    /// The shielded balance of unspent notes received in transactions that are not mined yet,
+    /// such as the change of the account's own pending transactions.
+    pub(crate) pending: i64,
+}
+
+/// Returns all balances of every account, ordered by account, from a single read
+/// transaction. Returns `None` if no blocks have been scanned.
+pub(crate) fn get_for_all_accounts(
+    conn: &Connection,
+    min_confirmations: u32,
+) -> rusqlite::Result<Option<Vec<AccountBalance>>> {
+    let tx = conn.unchecked_transaction()?;
+    let transparent = match get_transparent_for_all_accounts(&tx, 0)? {
+        Some(transparent) => transparent,
+        None => return Ok(None),
+    };
+    let transparent_verified =
+        get_transparent_for_all_accounts(&tx, min_confirmations)?.unwrap_or_default();
+
+    let mut balances = Vec::with_capacity(transparent.len());
+    for ((account, transparent), (_, transparent_verified)) in
+        transparent.into_iter().zip(transparent_verified)
+    {
+        balances.push(AccountBalance {
+            account,
+            total: get(&tx, account, 1)?.unwrap_or(0),
+            verified: get(&tx, account, min_confirmations)?.unwrap_or(0),
+            transparent,
+            transparent_verified,
+            pending: tx.query_row(
+                "SELECT IFNULL(SUM(received_notes.value), 0)
+                FROM received_notes
+                JOIN transactions ON transactions.id_tx = received_notes.tx
+                WHERE received_notes.account = :account
+                AND received_notes.spent IS NULL
+                AND transactions.block IS NULL",
+                named_params! {":account": account},
+                |row| row.get(0),
+            )?,
+        });
+    }
+    tx.commit()?;
+
+    Ok(Some(balances))
+}
+
+pub(crate) fn scanned_range(conn: &Connection) -> rusqlite::Result<Option<(u32, u32)>> {
+    conn.query_row("SELECT MIN(height), MAX(height) FROM blocks", [], |row| {
+        Ok(row
+            .get::<_, Option<u32>>(0)?
+            .zip(row.get::<_, Option<u32>>(1)?))
+    })
+}
+
+pub(crate) fn anchor_height(min_height: u32, tip: u32, min_confirmations: u32) -> u32 {
+    (tip + 1).saturating_sub(min_confirmations).max(min_height)
+}
+
+fn compute(conn: &Connection, account: u32, anchor_height: u32) -> rusqlite::Result<i64> {
+    conn.query_row(
+        &format!(
+            "SELECT {} FROM accounts WHERE accounts.account = :account",
+            SHIELDED_BALANCE
+        ),
+        named_params! {":account": account, ":anchor_height": anchor_height},
+        |row| row.get(0),
+    )
+    .optional()
+    .map(|balance| balance.unwrap_or(0))
+}
+
+#[cfg(test)]
+mod tests {
+    use rusqlite::{named_params, Connection};
+
+    use super::*;
+    use crate::wallet_ext::test_wallet;
+
+    fn wallet() -> Connection {
+        let conn = test_wallet();
+        conn.execute("INSERT INTO accounts (account) VALUES (0), (1)", [])
+            .unwrap();
+        for height in 100..=120 {
+            conn.execute("INSERT INTO blocks (height) VALUES (?)", [height])
+                .unwrap();
+        }
+        conn
+    }
+
+    fn receive(conn: &Connection, account: u32, block: Option<u32>, value: i64) -> i64 {
+        conn.execute(
+            "INSERT INTO transactions (txid, block) VALUES (randomblob(32), :block)",
+            named_params! {":block": block},
+        )
+        .unwrap();
+        conn.execute(
+            "INSERT INTO received_notes (tx, account, value)
+            VALUES (last_insert_rowid(), :account, :value)",
+            named_params! {":account": account, ":value": value},
+        )
+        .unwrap();
+        conn.last_insert_rowid()
+    }
+
+    fn stored_rows(conn: &Connection) -> i64 {
+        conn.query_row("SELECT COUNT(*) FROM account_balances", [], |row| {
+            row.get(0)
+        })
+        .unwrap()
+    }
+
+    /// Overwrites the stored balances, so that a test can tell which ones a refresh recomputes.
+    fn poison(conn: &Connection) {
+        conn.execute("UPDATE account_balances SET balance = 42", [])
+            .unwrap();
+    }
+
+    #[test]
+    fn balances_at_confirmation_depths() {
+        let conn = wallet();
+        receive(&conn, 0, Some(105), 1000);
+        receive(&conn, 0, Some(120), 2000);
+        receive(&conn, 0, None, 4000);
+        receive(&conn, 1, Some(110), 8000);
+
+        assert_eq!(get(&conn, 0, 1).unwrap(), Some(3000));
+        assert_eq!(get(&conn, 0, 10).unwrap(), Some(1000));
+        assert_eq!(get(&conn, 0, 100).unwrap(), Some(0));
+        assert_eq!(get(&conn, 1, 10).unwrap(), Some(8000));
+        assert_eq!(get(&conn, 2, 1).unwrap(), Some(0));
+    }
+
+    #[test]
+    fn reads_do_not_write() {
+        let conn = wallet();
+        receive(&conn, 0, Some(105), 1000);
+        get(&conn, 0, 1).unwrap();
+        get(&conn, 0, 3).unwrap();
+        assert_eq!(stored_rows(&conn), 0);
+    }
+
+    #[test]
+    fn refresh_stores_cached_depths_only() {
+        let conn = wallet();
+        receive(&conn, 0, Some(105), 1000);
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(stored_rows(&conn), 4);
+
+        // A stored balance is returned as long as the tip has not moved.
+        poison(&conn);
+        assert_eq!(get(&conn, 0, 1).unwrap(), Some(42));
+
+        conn.execute("INSERT INTO blocks (height) VALUES (121)", [])
+            .unwrap();
+        assert_eq!(get(&conn, 0, 1).unwrap(), Some(1000));
+
+        conn.execute("DELETE FROM blocks", []).unwrap();
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(stored_rows(&conn), 0);
+        assert_eq!(get(&conn, 0, 1).unwrap(), None);
+    }
+
+    #[test]
+    fn refresh_recomputes_affected_accounts_only() {
+        let conn = wallet();
+        receive(&conn, 0, Some(105), 1000);
+        receive(&conn, 1, Some(105), 8000);
+        refresh(&conn, &[]).unwrap();
+        poison(&conn);
+
+        // A note received by account 1 leaves the balances of account 0 alone.
+        let note = receive(&conn, 1, Some(120), 2000);
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(get(&conn, 0, 1).unwrap(), Some(42));
+        assert_eq!(get(&conn, 1, 1).unwrap(), Some(10000));
+        assert_eq!(get(&conn, 1, 10).unwrap(), Some(8000));
+
+        // So does spending it.
+        poison(&conn);
+        conn.execute(
+            "UPDATE received_notes SET spent = 1 WHERE id_note = ?",
+            [note],
+        )
+        .unwrap();
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(get(&conn, 0, 1).unwrap(), Some(42));
+        assert_eq!(get(&conn, 1, 1).unwrap(), Some(8000));
+
+        // Moving the tip recomputes the accounts whose unspent notes have crossed a cached
+        // depth, and keeps the other balances at the new tip.
+        receive(&conn, 0, Some(112), 500);
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(get(&conn, 0, 10).unwrap(), Some(1000));
+        poison(&conn);
+        for height in 121..=122 {
+            conn.execute("INSERT INTO blocks (height) VALUES (?)", [height])
+                .unwrap();
+        }
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(get(&conn, 0, 10).unwrap(), Some(1500));
+        assert_eq!(get(&conn, 1, 1).unwrap(), Some(42));
+
+        // A transaction updated in place recomputes the accounts that received notes in it.
+        let txid: Vec<u8> = conn
+            .query_row(
+                "SELECT txid FROM transactions
+                JOIN received_notes ON received_notes.tx = transactions.id_tx
+                WHERE received_notes.account = 1 LIMIT 1",
+                [],
+                |row| row.get(0),
+            )
+            .unwrap();
+        refresh(&conn, &[txid.try_into().unwrap()]).unwrap();
+        assert_eq!(get(&conn, 1, 1).unwrap(), Some(8000));
+    }
+
+    #[test]
+    fn rewind_recomputes_every_account() {
+        let conn = wallet();
+        receive(&conn, 0, Some(105), 1000);
+        receive(&conn, 1, Some(120), 8000);
+        refresh(&conn, &[]).unwrap();
+        poison(&conn);
+
+        conn.execute_batch(
+            "UPDATE transactions SET block = NULL WHERE block > 110;
+            DELETE FROM blocks WHERE height > 110;",
+        )
+        .unwrap();
+        events::record_rewind(&conn, 110).unwrap();
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(get(&conn, 0, 1).unwrap(), Some(1000));
+        assert_eq!(get(&conn, 1, 1).unwrap(), Some(0));
+    }
+
+    #[test]
+    fn all_accounts_in_one_read() {
+        let conn = wallet();
+        receive(&conn, 0, Some(105), 1000);
+        receive(&conn, 0, None, 4000);
+        conn.execute(
+            "INSERT INTO utxos (received_by_account, height, value_zat)
+            VALUES (1, 100, 500), (1, 120, 700)",
+            [],
+        )
+        .unwrap();
+        refresh(&conn, &[]).unwrap();
+
+        let balances = get_for_all_accounts(&conn, 10).unwrap().unwrap();
+        assert_eq!(balances.len(), 2);
+        assert_eq!(
+            (balances[0].total, balances[0].verified, balances[0].pending),
+            (1000, 1000, 4000)
+        );
+        assert_eq!(
+            (balances[1].transparent, balances[1].transparent_verified),
+            (1200, 500)
+        );
+    }
+}
@@ -0,0 +1,52 @@
+//! A block source over compact blocks that have already been read into memory.
+
+use std::cell::RefCell;
+use std::convert::Infallible;
+
+use zcash_client_backend::{
+    data_api::chain::{error::Error, BlockSource},
+    proto::compact_formats::CompactBlock,
+};
+use zcash_primitives::consensus::BlockHeight;
+
+/// A [`BlockSource`] that hands out a set of blocks read ahead of time, so that they can
+/// be inspected before being scanned without reading them from the cache twice.
+///
+/// The blocks are moved out on the first call to [`BlockSource::with_blocks`]; later calls
+/// see an empty source.
+pub(crate) struct MemoryBlockSource {
+    blocks: RefCell<Vec<CompactBlock>>,
+}
+
+impl MemoryBlockSource {
+    /// Constructs a source over `blocks`, which must be sorted by height.
+    pub(crate) fn new(blocks: Vec<CompactBlock>) -> Self {
+        MemoryBlockSource {
+            blocks: RefCell::new(blocks),
+        }
+    }
+}
+
+impl BlockSource for MemoryBlockSource {
+    type Error = Infallible;
+
+    fn with_blocks<F, DbErrT, NoteRef>(
+        &self,
+        from_height: Option<BlockHeight>,
+        limit: Option<u32>,
+        mut with_row: F,
+    ) -> Result<(), Error<DbErrT, Self::Error, NoteRef>>
+    where
+        F: FnMut(CompactBlock) -> Result<(), Error<DbErrT, Self::Error, NoteRef>>,
+    {
+        let blocks = std::mem::take(&mut *self.blocks.borrow_mut());
+        for block in blocks
+            .into_iter()
+            .filter(|block| from_height.map_or(true, |h| block.height() > h))
+            .take(limit.map_or(usize::MAX, |limit| limit as usize))
+        {
+            with_row(block)?;
+        }
+        Ok(())
+    }
+}
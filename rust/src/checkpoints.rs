@@ -0,0 +1,331 @@
+//! Checkpoints of the wallet's witness state.
+//!
+//! `zcash_client_sqlite` only keeps witnesses for the most recent [`PRUNING_HEIGHT`]
+//! blocks, so a rewind below that window cannot resume scanning from the requested height
+//! and has to fall back to the height of the oldest unspent note. The checkpoints recorded
+//! here retain a complete copy of the witnesses at every [`CHECKPOINT_INTERVAL`]th height,
+//! which lets such rewinds restore the nearest checkpoint and rescan only the blocks above
+//! it.
+//!
+//! The upstream `truncate_to_height` refuses to rewind further than [`PRUNING_HEIGHT`] blocks
+//! below the tip unless the target is at or below the oldest unspent note, so rewinds to a
+//! checkpoint below that window are performed by [`rewind`] instead.
+
+use rusqlite::{named_params, Connection, OptionalExtension};
+use tracing::debug;
+
+/// The number of blocks between two consecutive checkpoints.
+const CHECKPOINT_INTERVAL: u32 = 50;
+
+/// The number of checkpoints that are retained. Together with [`CHECKPOINT_INTERVAL`]
+/// this determines how far back a rewind can go without a full rescan.
+const MAX_CHECKPOINTS: u32 = 20;
+
+/// The number of blocks below the chain tip for which `zcash_client_sqlite` retains
+/// witnesses while scanning.
+pub(crate) const PRUNING_HEIGHT: u32 = 100;
+
+/// Returns true if `height` has been scanned and `sapling_witnesses` contains a witness at
+/// `height` for every note that was unspent as of that height, i.e. if scanning can resume
+/// from `height`.
+fn has_complete_witnesses(conn: &Connection, height: u32) -> rusqlite::Result<bool> {
+    let scanned = conn
+        .query_row(
+            "SELECT 1 FROM blocks WHERE height = :height",
+            named_params! {":height": height},
+            |_| Ok(()),
+        )
+        .optional()?
+        .is_some();
+    if !scanned {
+        return Ok(false);
+    }
+
+    let missing: i64 = conn.query_row(
+        "SELECT COUNT(*)
+        FROM received_notes
+        JOIN transactions ON transactions.id_tx = received_notes.tx
+        LEFT JOIN transactions spends ON spends.id_tx = received_notes.spent
+        WHERE transactions.block <= :height
+        AND (spends.block IS NULL OR spends.block > :height)
+        AND received_notes.id_note NOT IN (
+            SELECT note FROM sapling_witnesses WHERE block = :height
+        )",
+        named_params! {":height": height},
+        |row| row.get(0),
+    )?;
+    Ok(missing == 0)
+}
+
+/// Records a checkpoint at every checkpoint height within the witness window of the
+/// current chain tip that does not have one yet, and drops the checkpoints that fall
+/// outside of the retained range.
+pub(crate) fn record(conn: &Connection) -> rusqlite::Result<()> {
+    let tip: Option<u32> =
+        conn.query_row("SELECT MAX(height) FROM blocks", [], |row| row.get(0))?;
+    let tip = match tip {
+        Some(tip) => tip,
+        None => return Ok(()),
+    };
+
+    let tx = conn.unchecked_transaction()?;
+    let window_start = tip.saturating_sub(PRUNING_HEIGHT);
+    let mut height =
+        ((window_start + CHECKPOINT_INTERVAL - 1) / CHECKPOINT_INTERVAL) * CHECKPOINT_INTERVAL;
+    while height <= tip {
+        let exists = tx
+            .query_row(
+                "SELECT 1 FROM scan_checkpoints WHERE height = :height",
+                named_params! {":height": height},
+                |_| Ok(()),
+            )
+            .optional()?
+            .is_some();
+
+        if !exists && has_complete_witnesses(&tx, height)? {
+            tx.execute(
+                "INSERT INTO scan_checkpoints (height) VALUES (:height)",
+                named_params! {":height": height},
+            )?;
+            tx.execute(
+                "INSERT INTO scan_checkpoint_witnesses (height, note, witness)
+                SELECT block, note, witness FROM sapling_witnesses WHERE block = :height",
+                named_params! {":height": height},
+            )?;
+        }
+
+        height += CHECKPOINT_INTERVAL;
+    }
+
+    tx.execute(
+        "DELETE FROM scan_checkpoints
+        WHERE height NOT IN (
+            SELECT height FROM scan_checkpoints ORDER BY height DESC LIMIT :max_checkpoints
+        )",
+        named_params! {":max_checkpoints": MAX_CHECKPOINTS},
+    )?;
+    tx.execute(
+        "DELETE FROM scan_checkpoint_witnesses
+        WHERE height NOT IN (SELECT height FROM scan_checkpoints)",
+        [],
+    )?;
+
+    tx.commit()
+}
+
+/// Returns the greatest height less than or equal to `height` from which scanning can
+/// resume, without falling back to the oldest unspent note. This is the chain tip if `height`
+/// is at or above it, `height` itself if the wallet still has complete witnesses there, or
+/// otherwise the nearest checkpoint below it.
+///
+/// Returns `None` if none of these exists.
+pub(crate) fn nearest_rewind_height(
+    conn: &Connection,
+    height: u32,
+) -> rusqlite::Result<Option<u32>> {
+    let tip: Option<u32> =
+        conn.query_row("SELECT MAX(height) FROM blocks", [], |row| row.get(0))?;
+    if let Some(tip) = tip.filter(|tip| height >= *tip) {
+        return Ok(Some(tip));
+    }
+
+    if has_complete_witnesses(conn, height)? {
+        return Ok(Some(height));
+    }
+
+    conn.query_row(
+        "SELECT MAX(height) FROM scan_checkpoints WHERE height <= :height",
+        named_params! {":height": height},
+        |row| row.get(0),
+    )
+}
+
+/// Restores the witnesses stored in the checkpoint at `height` into `sapling_witnesses`,
+/// if the wallet does not have complete witnesses at that height any more.
+///
+/// Returns true if a checkpoint was restored.
+fn restore(conn: &Connection, height: u32) -> rusqlite::Result<bool> {
+    if has_complete_witnesses(conn, height)? {
+        return Ok(false);
+    }
+
+    let restored = conn.execute(
+        "INSERT OR IGNORE INTO sapling_witnesses (note, block, witness)
+        SELECT note, height, witness FROM scan_checkpoint_witnesses WHERE height = :height",
+        named_params! {":height": height},
+    )?;
+    Ok(restored > 0)
+}
+
+/// Rewinds the wallet to `height` if it is more than [`PRUNING_HEIGHT`] blocks below the chain
+/// tip and scanning can resume from it, restoring the checkpoint at `height` if needed.
+///
+/// This deletes the same data as the upstream `truncate_to_height`, which would reject such a
+/// height if it is above the oldest unspent note: the witnesses and blocks above `height`, the
+/// notes and UTXOs received above it, and the mined heights of the transactions above it.
+///
+/// Returns false, without changing the wallet, if `height` is within the window that the
+/// upstream truncation accepts or scanning cannot resume from it; the caller should then
+/// rewind with the upstream truncation.
+pub(crate) fn rewind(conn: &Connection, height: u32) -> rusqlite::Result<bool> {
+    let tip: Option<u32> =
+        conn.query_row("SELECT MAX(height) FROM blocks", [], |row| row.get(0))?;
+    match tip {
+        Some(tip) if height.saturating_add(PRUNING_HEIGHT) < tip => (),
+        _ => return Ok(false),
+    }
+
+    let tx = conn.unchecked_transaction()?;
+    if restore(&tx, height)? {
+        debug!("Restored scan checkpoint at height {}", height);
+    }
+    if !has_complete_witnesses(&tx, height)? {
+        return Ok(false);
+    }
+
+    tx.execute_batch(&format!(
+        "DELETE FROM sapling_witnesses WHERE block > {height};
+        DELETE FROM received_notes WHERE id_note IN (
+            SELECT received_notes.id_note
+            FROM received_notes
+            JOIN transactions ON transactions.id_tx = received_notes.tx
+            WHERE transactions.block > {height}
+        );
+        DELETE FROM utxos WHERE height > {height};
+        UPDATE transactions SET block = NULL, tx_index = NULL WHERE block > {height};
+        DELETE FROM blocks WHERE height > {height};",
+        height = height
+    ))?;
+    tx.commit()?;
+    Ok(true)
+}
+
+/// Deletes the checkpoints above `height`, after the wallet has been rewound to it.
+pub(crate) fn truncate_to_height(conn: &Connection, height: u32) -> rusqlite::Result<()> {
+    conn.execute(
+        "DELETE FROM scan_checkpoint_witnesses WHERE height > :height",
+        named_params! {":height": height},
+    )?;
+    conn.execute(
+        "DELETE FROM scan_checkpoints WHERE height > :height",
+        named_params! {":height": height},
+    )?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use rusqlite::Connection;
+
+    use super::*;
+    use crate::wallet_ext::test_wallet;
+
+    /// Scans blocks `from..=to`, keeping a witness for note 1 at each of them.
+    fn scan(conn: &Connection, from: u32, to: u32) {
+        for height in from..=to {
+            conn.execute("INSERT INTO blocks (height) VALUES (?)", [height])
+                .unwrap();
+            conn.execute(
+                "INSERT INTO sapling_witnesses (note, block, witness) VALUES (1, ?, x'00')",
+                [height],
+            )
+            .unwrap();
+        }
+    }
+
+    fn wallet(tip: u32) -> Connection {
+        let conn = test_wallet();
+        conn.execute_batch(
+            "INSERT INTO transactions (id_tx, txid, block) VALUES (1, x'01', 10);
+            INSERT INTO received_notes (id_note, tx, account, value) VALUES (1, 1, 0, 1);",
+        )
+        .unwrap();
+        scan(&conn, 10, tip);
+        conn
+    }
+
+    fn checkpoints(conn: &Connection) -> Vec<u32> {
+        conn.prepare("SELECT height FROM scan_checkpoints ORDER BY height")
+            .unwrap()
+            .query_map([], |row| row.get(0))
+            .unwrap()
+            .collect::<rusqlite::Result<_>>()
+            .unwrap()
+    }
+
+    fn tip(conn: &Connection) -> u32 {
+        conn.query_row("SELECT MAX(height) FROM blocks", [], |row| row.get(0))
+            .unwrap()
+    }
+
+    #[test]
+    fn record_checkpoints_within_witness_window() {
+        let conn = wallet(260);
+        record(&conn).unwrap();
+        assert_eq!(checkpoints(&conn), vec![200, 250]);
+    }
+
+    #[test]
+    fn rewind_restores_checkpoint_below_pruning_window() {
+        let conn = wallet(260);
+        record(&conn).unwrap();
+        scan(&conn, 261, 400);
+        record(&conn).unwrap();
+        assert_eq!(checkpoints(&conn), vec![200, 250, 300, 350, 400]);
+        // A note received above the checkpoint, and upstream pruning at the new tip.
+        conn.execute_batch(
+            "INSERT INTO transactions (id_tx, txid, block) VALUES (2, x'02', 320);
+            INSERT INTO received_notes (id_note, tx, account, value) VALUES (2, 2, 0, 1);
+            DELETE FROM sapling_witnesses WHERE block < 300;",
+        )
+        .unwrap();
+
+        assert_eq!(nearest_rewind_height(&conn, 270).unwrap(), Some(250));
+        assert!(rewind(&conn, 250).unwrap());
+        truncate_to_height(&conn, 250).unwrap();
+
+        assert_eq!(tip(&conn), 250);
+        assert_eq!(checkpoints(&conn), vec![200, 250]);
+        assert!(has_complete_witnesses(&conn, 250).unwrap());
+        let (notes, mined): (i64, Option<u32>) = conn
+            .query_row(
+                "SELECT (SELECT COUNT(*) FROM received_notes),
+                    (SELECT block FROM transactions WHERE id_tx = 2)",
+                [],
+                |row| Ok((row.get(0)?, row.get(1)?)),
+            )
+            .unwrap();
+        assert_eq!((notes, mined), (1, None));
+    }
+
+    #[test]
+    fn rewind_within_pruning_window_is_left_to_upstream() {
+        let conn = wallet(260);
+        assert!(!rewind(&conn, 200).unwrap());
+        assert_eq!(tip(&conn), 260);
+    }
+
+    #[test]
+    fn rewind_requires_a_scanned_height() {
+        let conn = test_wallet();
+        for height in 100..=300 {
+            conn.execute("INSERT INTO blocks (height) VALUES (?)", [height])
+                .unwrap();
+        }
+        // Without notes, every scanned height is a valid rewind target.
+        assert_eq!(nearest_rewind_height(&conn, 150).unwrap(), Some(150));
+        assert_eq!(nearest_rewind_height(&conn, 50).unwrap(), None);
+        assert!(!rewind(&conn, 50).unwrap());
+        assert!(rewind(&conn, 150).unwrap());
+        assert_eq!(tip(&conn), 150);
+    }
+
+    #[test]
+    fn rewind_above_tip_returns_tip() {
+        let conn = wallet(260);
+        conn.execute("DELETE FROM sapling_witnesses WHERE block = 260", [])
+            .unwrap();
+        assert_eq!(nearest_rewind_height(&conn, 300).unwrap(), Some(260));
+        assert_eq!(nearest_rewind_height(&conn, 260).unwrap(), Some(260));
+    }
+}
@@ -0,0 +1,122 @@
+//! A feed of changes to the wallet, so that hosts can update their views incrementally
+//! instead of re-reading balances and history after every write.
+//!
+//! Events are appended to the `wallet_events` table with a sequence number that never
+//! decreases, even across deletions. Notes being received, spent or unspent again and
+//! transactions being mined are recorded by triggers on the `zcash_client_sqlite` tables
+//! (see [`crate::wallet_ext::init`]), so they cover every write path; rewinds are recorded by
+//! [`record_rewind`]. The triggers are recreated by [`crate::wallet_ext::open`] if an
+//! upstream migration has rebuilt the tables they are attached to.
+
+use rusqlite::{named_params, Connection};
+
+/// The number of most recent events that are retained by [`trim`].
+const MAX_EVENTS: i64 = 10_000;
+
+/// The value of `wallet_events.kind` for a mined transaction.
+pub(crate) const KIND_TX_MINED: u32 = 2;
+
+/// The value of `wallet_events.kind` for a rewind. The triggers record `0` for a received
+/// note, `1` for a spent note, [`KIND_TX_MINED`] for a mined transaction and `4` for a note
+/// whose spend was undone.
+pub(crate) const KIND_REWIND: u32 = 3;
+
+pub(crate) struct Event {
+    pub(crate) seq: i64,
+    pub(crate) kind: u32,
+    pub(crate) height: Option<u32>,
+    pub(crate) id_tx: Option<i64>,
+    pub(crate) id_note: Option<i64>,
+    pub(crate) account: Option<u32>,
+    pub(crate) value: Option<i64>,
+}
+
+/// Records that the wallet has been rewound to `height`.
+pub(crate) fn record_rewind(conn: &Connection, height: u32) -> rusqlite::Result<()> {
+    conn.execute(
+        "INSERT INTO wallet_events (kind, height) VALUES (:kind, :height)",
+        named_params! {":kind": KIND_REWIND, ":height": height},
+    )?;
+    Ok(())
+}
+
+/// Deletes all but the most recent events.
+pub(crate) fn trim(conn: &Connection) -> rusqlite::Result<()> {
+    conn.execute(
+        "DELETE FROM wallet_events
+        WHERE seq <= (SELECT MAX(seq) FROM wallet_events) - :max_events",
+        named_params! {":max_events": MAX_EVENTS},
+    )?;
+    Ok(())
+}
+
+/// Returns up to `limit` events with a sequence number greater than `after_seq`, in order.
+pub(crate) fn get_since(
+    conn: &Connection,
+    after_seq: i64,
+    limit: u32,
+) -> rusqlite::Result<Vec<Event>> {
+    conn.prepare(
+        "SELECT seq, kind, height, id_tx, id_note, account, value
+        FROM wallet_events
+        WHERE seq > :after_seq
+        ORDER BY seq
+        LIMIT :limit",
+    )?
+    .query_map(
+        named_params! {":after_seq": after_seq, ":limit": limit},
+        |row| {
+            Ok(Event {
+                seq: row.get(0)?,
+                kind: row.get(1)?,
+                height: row.get(2)?,
+                id_tx: row.get(3)?,
+                id_note: row.get(4)?,
+                account: row.get(5)?,
+                value: row.get(6)?,
+            })
+        },
+    )?
+    .collect()
+}
+
+#[cfg(test)]
+mod tests {
+    use rusqlite::Connection;
+
+    use super::*;
+    use crate::wallet_ext::test_wallet;
+
+    fn kinds(conn: &Connection, after_seq: i64) -> Vec<u32> {
+        get_since(conn, after_seq, 100)
+            .unwrap()
+            .into_iter()
+            .map(|event| event.kind)
+            .collect()
+    }
+
+    #[test]
+    fn triggers_record_note_lifecycle() {
+        let conn = test_wallet();
+        conn.execute_batch(
+            "INSERT INTO transactions (id_tx, txid, block) VALUES (1, x'01', 100);
+            INSERT INTO received_notes (id_note, tx, account, value) VALUES (1, 1, 0, 1000);
+            INSERT INTO transactions (id_tx, txid) VALUES (2, x'02');
+            UPDATE received_notes SET spent = 2 WHERE id_note = 1;
+            UPDATE transactions SET block = 101 WHERE id_tx = 2;
+            UPDATE received_notes SET spent = NULL WHERE id_note = 1;",
+        )
+        .unwrap();
+        record_rewind(&conn, 100).unwrap();
+
+        assert_eq!(kinds(&conn, 0), vec![2, 0, 1, 2, 4, KIND_REWIND]);
+
+        let events = get_since(&conn, 0, 100).unwrap();
+        let unspent = &events[4];
+        assert_eq!(
+            (unspent.id_tx, unspent.id_note, unspent.value),
+            (Some(2), Some(1), Some(1000))
+        );
+        assert_eq!(kinds(&conn, events[3].seq), vec![4, KIND_REWIND]);
+    }
+}
@@ -0,0 +1,219 @@
+//! An in-memory index of the hash chain formed by the blocks in the block cache.
+//!
+//! As block metadata is written to the cache, the hash of each block and the hash of its
+//! parent are recorded here, along with the heights at which the chain does not link up.
+//! Validating the cache against the wallet's chain tip is then a lookup of the block above
+//! the tip and of the lowest recorded mismatch, instead of a walk over the cached blocks.
+//! The index only lives for the lifetime of the process, and is discarded whenever the
+//! cache is initialized or rewound; when it does not cover the range that needs
+//! validating, callers fall back to reading the cached blocks.
+
+use std::collections::{BTreeMap, BTreeSet, HashMap};
+use std::path::{Path, PathBuf};
+use std::sync::Mutex;
+
+use once_cell::sync::Lazy;
+
+/// The hash chain of each block cache, keyed by the cache's root directory.
+static HASH_CHAINS: Lazy<Mutex<HashMap<PathBuf, HashChain>>> = Lazy::new(Default::default);
+
+/// The outcome of validating the block cache against the index.
+pub(crate) enum Validation {
+    /// The cached blocks above the wallet's tip form a valid chain on top of it.
+    Valid,
+    /// The block at the given height does not link to the block below it.
+    InvalidAt(u32),
+    /// The index does not cover the blocks that need to be validated.
+    Unknown,
+}
+
+#[derive(Default)]
+struct HashChain {
+    /// The hash and parent hash of each indexed block.
+    blocks: BTreeMap<u32, ([u8; 32], [u8; 32])>,
+    /// The heights of indexed blocks whose parent hash differs from the hash of the indexed
+    /// block below them.
+    mismatches: BTreeSet<u32>,
+    /// The heights of indexed blocks whose parent is not indexed.
+    gaps: BTreeSet<u32>,
+}
+
+impl HashChain {
+    fn insert(&mut self, height: u32, link: Option<([u8; 32], [u8; 32])>) {
+        match link {
+            Some(link) => self.blocks.insert(height, link),
+            None => self.blocks.remove(&height),
+        };
+        self.relink(height);
+        self.relink(height + 1);
+    }
+
+    fn relink(&mut self, height: u32) {
+        self.mismatches.remove(&height);
+        self.gaps.remove(&height);
+        if let Some((_, prev_hash)) = self.blocks.get(&height) {
+            match height.checked_sub(1).and_then(|h| self.blocks.get(&h)) {
+                Some((parent_hash, _)) if parent_hash != prev_hash => {
+                    self.mismatches.insert(height);
+                }
+                Some(_) => (),
+                None => {
+                    self.gaps.insert(height);
+                }
+            }
+        }
+    }
+
+    /// Removes the blocks below `height`.
+    fn retain_from(&mut self, height: u32) {
+        self.blocks = self.blocks.split_off(&height);
+        self.mismatches = self.mismatches.split_off(&height);
+        self.gaps = self.gaps.split_off(&height);
+        self.relink(height);
+    }
+}
+
+/// Indexes the given blocks, which have just been written to the cache at `fs_block_db_root`,
+/// as `(height, hash, parent hash)` triples.
+///
+/// Blocks whose parent hash is not known are removed from the index, so that validation of
+/// the range containing them falls back to reading the cache.
+pub(crate) fn record_blocks<I>(fs_block_db_root: &Path, blocks: I)
+where
+    I: IntoIterator<Item = (u32, [u8; 32], Option<[u8; 32]>)>,
+{
+    let mut chains = HASH_CHAINS.lock().unwrap();
+    let chain = chains.entry(fs_block_db_root.to_path_buf()).or_default();
+    for (height, hash, prev_hash) in blocks {
+        chain.insert(height, prev_hash.map(|prev_hash| (hash, prev_hash)));
+    }
+}
+
+/// Discards the index of the cache at `fs_block_db_root`, for example because the cache has
+/// been recreated or rewound.
+pub(crate) fn clear(fs_block_db_root: &Path) {
+    HASH_CHAINS.lock().unwrap().remove(fs_block_db_root);
+}
+
+/// Validates the blocks in the cache at `fs_block_db_root` above the wallet's chain tip,
+/// considering at most `limit` blocks.
+///
+/// `max_cached_height` is the height of the highest block in the cache; the index must
+/// cover every block up to it (or up to the limit) for a definite result to be returned.
+/// Indexed blocks at or below the wallet's tip are dropped, as they are never validated
+/// again.
+pub(crate) fn validate(
+    fs_block_db_root: &Path,
+    wallet_tip: Option<(u32, [u8; 32])>,
+    max_cached_height: Option<u32>,
+    limit: Option<u32>,
+) -> Validation {
+    let (tip_height, tip_hash) = match wallet_tip {
+        Some(tip) => tip,
+        None => return Validation::Unknown,
+    };
+    let end = match max_cached_height {
+        Some(h) if h > tip_height => match limit {
+            Some(limit) => std::cmp::min(h, tip_height.saturating_add(limit)),
+            None => h,
+        },
+        _ => return Validation::Valid,
+    };
+
+    let mut chains = HASH_CHAINS.lock().unwrap();
+    let chain = match chains.get_mut(fs_block_db_root) {
+        Some(chain) => chain,
+        None => return Validation::Unknown,
+    };
+    chain.retain_from(tip_height + 1);
+
+    let covered =
+        chain.blocks.contains_key(&end) && chain.gaps.range(tip_height + 2..=end).next().is_none();
+    match chain.blocks.get(&(tip_height + 1)) {
+        Some((_, prev_hash)) if covered => {
+            if prev_hash != &tip_hash {
+                Validation::InvalidAt(tip_height + 1)
+            } else if let Some(height) = chain.mismatches.range(tip_height + 2..=end).next() {
+                Validation::InvalidAt(*height)
+            } else {
+                Validation::Valid
+            }
+        }
+        _ => Validation::Unknown,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::path::Path;
+
+    use super::*;
+
+    fn hash(height: u32) -> [u8; 32] {
+        let mut hash = [0; 32];
+        hash[..4].copy_from_slice(&height.to_le_bytes());
+        hash
+    }
+
+    fn record_chain(root: &Path, heights: std::ops::RangeInclusive<u32>) {
+        record_blocks(
+            root,
+            heights.map(|height| (height, hash(height), Some(hash(height - 1)))),
+        );
+    }
+
+    #[test]
+    fn validates_linked_chain() {
+        let root = Path::new("/hash_chain/linked");
+        record_chain(root, 11..=20);
+
+        assert!(matches!(
+            validate(root, Some((10, hash(10))), Some(20), None),
+            Validation::Valid
+        ));
+        assert!(matches!(
+            validate(root, Some((10, [0xff; 32])), Some(20), None),
+            Validation::InvalidAt(11)
+        ));
+    }
+
+    #[test]
+    fn reports_lowest_mismatch() {
+        let root = Path::new("/hash_chain/mismatch");
+        record_chain(root, 11..=20);
+        record_blocks(root, Some((15, [0xff; 32], Some(hash(14)))));
+
+        assert!(matches!(
+            validate(root, Some((10, hash(10))), Some(20), None),
+            Validation::InvalidAt(16)
+        ));
+        assert!(matches!(
+            validate(root, Some((10, hash(10))), Some(20), Some(5)),
+            Validation::Valid
+        ));
+    }
+
+    #[test]
+    fn unknown_parent_is_not_indexed() {
+        let root = Path::new("/hash_chain/unknown");
+        record_chain(root, 11..=20);
+        record_blocks(root, Some((15, hash(15), None)));
+
+        assert!(matches!(
+            validate(root, Some((10, hash(10))), Some(20), None),
+            Validation::Unknown
+        ));
+    }
+
+    #[test]
+    fn clear_discards_index() {
+        let root = Path::new("/hash_chain/clear");
+        record_chain(root, 11..=20);
+        clear(root);
+
+        assert!(matches!(
+            validate(root, Some((10, hash(10))), Some(20), None),
+            Validation::Unknown
+        ));
+    }
+}
@@ -0,0 +1,363 @@
+//! The wallet's transaction history.
+//!
+//! The `v_transactions` view aggregates the sent and received notes of every transaction
+//! whenever it is read. Its rows are instead materialised into the `tx_history` table by
+//! [`refresh`], which is called after every write to the data database and only recomputes
+//! the rows that the write can have changed.
+//!
+//! A [`Cursor`] returns the rows of `tx_history` from the most recently added transaction to
+//! the oldest one. Each page continues from the key of the last row of the previous page
+//! (keyset pagination), which is a range search on the `tx_history_id_tx` index (or on the
+//! primary key, for a single account), so fetching a page costs the same regardless of how
+//! far into the history it is.
+
+use std::convert::TryInto;
+
+use rusqlite::{types::ToSql, Connection, Row};
+
+/// The columns of `tx_history`, which are those of `v_transactions`.
+const COLUMNS: &str = "account_id, id_tx, mined_height, tx_index, txid, expiry_height, raw,
+    account_balance_delta, fee_paid, has_change, sent_note_count, received_note_count,
+    memo_count, block_time, expired_unmined";
+
+/// Recomputes the rows of `tx_history` that may have changed since the last refresh:
+/// - the transactions added since then;
+/// - the transactions that are not mined and have not expired, whose expiry status depends
+///   on the chain tip;
+/// - the rows of transactions that were pending, were mined above the current chain tip (and
+///   so have been rewound), or were marked as expired but no longer are after a rewind, at
+///   the last refresh;
+/// - the transactions in `txids`, which have been updated in place.
+///
+/// A transaction that expired without being mined is recomputed once more to mark it as
+/// expired, and is then left alone unless the chain is rewound below its expiry height.
+pub(crate) fn refresh(conn: &Connection, txids: &[[u8; 32]]) -> rusqlite::Result<()> {
+    let tx = conn.unchecked_transaction()?;
+    // `expired` matches the `expired_unmined` column of `v_transactions`.
+    tx.execute_batch(
+        "CREATE TEMP TABLE IF NOT EXISTS tx_history_dirty (id_tx INTEGER PRIMARY KEY);
+        INSERT OR IGNORE INTO tx_history_dirty
+            SELECT id_tx FROM tx_history
+            WHERE (
+                mined_height IS NULL
+                AND NOT (
+                    IFNULL(expired_unmined, 0)
+                    AND expiry_height BETWEEN 1 AND (SELECT IFNULL(MAX(height), 0) FROM blocks)
+                )
+            )
+            OR mined_height > (SELECT IFNULL(MAX(height), 0) FROM blocks);
+        INSERT OR IGNORE INTO tx_history_dirty
+            SELECT id_tx FROM transactions
+            WHERE (
+                block IS NULL
+                AND NOT IFNULL(
+                    expiry_height BETWEEN 1 AND (SELECT IFNULL(MAX(height), 0) FROM blocks),
+                    0
+                )
+            )
+            OR id_tx > (SELECT last_id_tx FROM tx_history_state);",
+    )?;
+    let mut mark_txid = tx.prepare(
+        "INSERT OR IGNORE INTO tx_history_dirty SELECT id_tx FROM transactions WHERE txid = ?",
+    )?;
+    for txid in txids {
+        mark_txid.execute([&txid[..]])?;
+    }
+    drop(mark_txid);
+
+    tx.execute_batch(&format!(
+        "DELETE FROM tx_history WHERE id_tx IN (SELECT id_tx FROM tx_history_dirty);
+        INSERT INTO tx_history ({columns})
+            SELECT {columns} FROM v_transactions
+            WHERE id_tx IN (SELECT id_tx FROM tx_history_dirty);
+        DELETE FROM tx_history_dirty;
+        UPDATE tx_history_state
+            SET last_id_tx = (SELECT IFNULL(MAX(id_tx), 0) FROM transactions);",
+        columns = COLUMNS
+    ))?;
+    tx.commit()
+}
+
+/// Which transactions a [`Cursor`] returns, based on their effect on the account balance.
+#[derive(Clone, Copy)]
+pub(crate) enum Direction {
+    All,
+    Received,
+    Sent,
+}
+
+/// A row of the transaction history.
+pub(crate) struct Record {
+    pub(crate) account: u32,
+    pub(crate) id_tx: i64,
+    pub(crate) txid: [u8; 32],
+    pub(crate) mined_height: Option<u32>,
+    pub(crate) tx_index: Option<u32>,
+    pub(crate) block_time: Option<i64>,
+    pub(crate) expiry_height: Option<u32>,
+    pub(crate) account_balance_delta: i64,
+    pub(crate) fee_paid: Option<i64>,
+    pub(crate) has_change: bool,
+    pub(crate) sent_note_count: u32,
+    pub(crate) received_note_count: u32,
+    pub(crate) memo_count: u32,
+    pub(crate) expired_unmined: bool,
+}
+
+impl Record {
+    fn from_row(row: &Row) -> rusqlite::Result<Self> {
+        let txid: Vec<u8> = row.get("txid")?;
+        Ok(Record {
+            account: row.get("account_id")?,
+            id_tx: row.get("id_tx")?,
+            txid: txid.try_into().map_err(|_| {
+                rusqlite::Error::InvalidColumnType(
+                    2,
+                    "txid".to_string(),
+                    rusqlite::types::Type::Blob,
+                )
+            })?,
+            mined_height: row.get("mined_height")?,
+            tx_index: row.get("tx_index")?,
+            block_time: row.get("block_time")?,
+            expiry_height: row.get("expiry_height")?,
+            account_balance_delta: row.get("account_balance_delta")?,
+            fee_paid: row.get("fee_paid")?,
+            has_change: row.get("has_change")?,
+            sent_note_count: row.get("sent_note_count")?,
+            received_note_count: row.get("received_note_count")?,
+            memo_count: row.get("memo_count")?,
+            expired_unmined: row
+                .get::<_, Option<bool>>("expired_unmined")?
+                .unwrap_or(false),
+        })
+    }
+}
+
+/// A position in the transaction history of the data database, with the filters that it
+/// was opened with.
+pub(crate) struct Cursor {
+    conn: Connection,
+    account: Option<u32>,
+    direction: Direction,
+    include_expired: bool,
+    /// The `(id_tx, account_id)` key of the last row returned.
+    last: Option<(i64, u32)>,
+}
+
+impl Cursor {
+    pub(crate) fn new(
+        conn: Connection,
+        account: Option<u32>,
+        direction: Direction,
+        include_expired: bool,
+    ) -> Self {
+        Cursor {
+            conn,
+            account,
+            direction,
+            include_expired,
+            last: None,
+        }
+    }
+
+    /// Returns up to `limit` rows following the ones that have already been returned. An
+    /// empty result means that the end of the history has been reached.
+    pub(crate) fn next_page(&mut self, limit: u32) -> rusqlite::Result<Vec<Record>> {
+        let mut conditions = vec![];
+        let mut params: Vec<(&str, &dyn ToSql)> = vec![];
+        if let Some(account) = &self.account {
+            conditions.push("account_id = :account");
+            params.push((":account", account));
+        }
+        if let Some((id_tx, account)) = &self.last {
+            // The first term bounds the index range; the second skips the rows of the last
+            // transaction that have already been returned.
+            conditions.push(
+                "id_tx <= :last_id_tx AND (id_tx < :last_id_tx OR account_id > :last_account)",
+            );
+            params.push((":last_id_tx", id_tx));
+            params.push((":last_account", account));
+        }
+        match self.direction {
+            Direction::All => (),
+            Direction::Received => conditions.push("account_balance_delta > 0"),
+            Direction::Sent => conditions.push("account_balance_delta < 0"),
+        }
+        if !self.include_expired {
+            conditions.push("NOT IFNULL(expired_unmined, 0)");
+        }
+        params.push((":limit", &limit));
+
+        let where_clause = if conditions.is_empty() {
+            String::new()
+        } else {
+            format!("WHERE {}", conditions.join(" AND "))
+        };
+        let records = self
+            .conn
+            .prepare(&page_query(&where_clause))?
+            .query_map(&*params, Record::from_row)?
+            .collect::<rusqlite::Result<Vec<_>>>()?;
+
+        if let Some(record) = records.last() {
+            self.last = Some((record.id_tx, record.account));
+        }
+        Ok(records)
+    }
+}
+
+fn page_query(where_clause: &str) -> String {
+    format!(
+        "SELECT account_id, id_tx, txid, mined_height, tx_index, block_time,
+            expiry_height, account_balance_delta, fee_paid, has_change,
+            sent_note_count, received_note_count, memo_count, expired_unmined
+        FROM tx_history
+        {}
+        ORDER BY id_tx DESC, account_id
+        LIMIT :limit",
+        where_clause
+    )
+}
+
+#[cfg(test)]
+mod tests {
+    use rusqlite::{named_params, Connection};
+
+    use super::*;
+    use crate::wallet_ext::test_wallet;
+
+    /// Adds a transaction with a received note of `value` for each of `accounts`.
+    fn add_tx(conn: &Connection, id: u8, block: Option<u32>, expiry: u32, accounts: &[(u32, i64)]) {
+        conn.execute(
+            "INSERT INTO transactions (txid, block, expiry_height)
+            VALUES (:txid, :block, :expiry_height)",
+            named_params! {":txid": &[id; 32][..], ":block": block, ":expiry_height": expiry},
+        )
+        .unwrap();
+        let id_tx = conn.last_insert_rowid();
+        for (account, value) in accounts {
+            conn.execute(
+                "INSERT INTO received_notes (tx, account, value)
+                VALUES (:tx, :account, :value)",
+                named_params! {":tx": id_tx, ":account": account, ":value": value},
+            )
+            .unwrap();
+        }
+    }
+
+    fn keys(records: &[Record]) -> Vec<(i64, u32)> {
+        records.iter().map(|r| (r.id_tx, r.account)).collect()
+    }
+
+    fn history() -> Connection {
+        let conn = test_wallet();
+        conn.execute("INSERT INTO blocks (height, time) VALUES (100, 0)", [])
+            .unwrap();
+        add_tx(&conn, 1, Some(100), 0, &[(0, 1000), (1, 2000)]);
+        add_tx(&conn, 2, Some(100), 0, &[(0, -500)]);
+        add_tx(&conn, 3, None, 0, &[(0, 3000), (1, -700)]);
+        add_tx(&conn, 4, Some(100), 0, &[(1, 4000)]);
+        refresh(&conn, &[]).unwrap();
+        conn
+    }
+
+    #[test]
+    fn pages_continue_from_last_row() {
+        let mut cursor = Cursor::new(history(), None, Direction::All, true);
+        assert_eq!(keys(&cursor.next_page(2).unwrap()), vec![(4, 1), (3, 0)]);
+        assert_eq!(keys(&cursor.next_page(2).unwrap()), vec![(3, 1), (2, 0)]);
+        assert_eq!(keys(&cursor.next_page(2).unwrap()), vec![(1, 0), (1, 1)]);
+        assert!(cursor.next_page(2).unwrap().is_empty());
+    }
+
+    #[test]
+    fn pages_are_filtered() {
+        let mut cursor = Cursor::new(history(), Some(1), Direction::Received, true);
+        assert_eq!(keys(&cursor.next_page(10).unwrap()), vec![(4, 1), (1, 1)]);
+
+        let mut cursor = Cursor::new(history(), None, Direction::Sent, true);
+        assert_eq!(keys(&cursor.next_page(10).unwrap()), vec![(3, 1), (2, 0)]);
+    }
+
+    fn set_delta(conn: &Connection, id_tx: i64, delta: i64) {
+        conn.execute(
+            "UPDATE tx_history SET account_balance_delta = :delta WHERE id_tx = :id_tx",
+            named_params! {":delta": delta, ":id_tx": id_tx},
+        )
+        .unwrap();
+    }
+
+    fn delta(conn: &Connection, id_tx: i64) -> i64 {
+        conn.query_row(
+            "SELECT account_balance_delta FROM tx_history WHERE id_tx = ?",
+            [id_tx],
+            |row| row.get(0),
+        )
+        .unwrap()
+    }
+
+    #[test]
+    fn refresh_leaves_expired_transactions_alone() {
+        let conn = test_wallet();
+        conn.execute("INSERT INTO blocks (height) VALUES (100)", [])
+            .unwrap();
+        add_tx(&conn, 1, None, 101, &[(0, 1000)]);
+        add_tx(&conn, 2, Some(100), 0, &[(0, 2000)]);
+        refresh(&conn, &[]).unwrap();
+
+        // The pending transaction is recomputed, the mined one is not.
+        set_delta(&conn, 1, 0);
+        set_delta(&conn, 2, 0);
+        refresh(&conn, &[]).unwrap();
+        assert_eq!((delta(&conn, 1), delta(&conn, 2)), (1000, 0));
+
+        // Once the tip passes its expiry height, the pending transaction is marked as expired
+        // and then no longer recomputed.
+        conn.execute("INSERT INTO blocks (height) VALUES (101)", [])
+            .unwrap();
+        refresh(&conn, &[]).unwrap();
+        let mut cursor = Cursor::new(conn, None, Direction::All, false);
+        assert_eq!(keys(&cursor.next_page(10).unwrap()), vec![(2, 0)]);
+        let conn = cursor.conn;
+
+        set_delta(&conn, 1, 0);
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(delta(&conn, 1), 0);
+
+        // A rewind below the expiry height makes it pending again.
+        conn.execute("DELETE FROM blocks WHERE height = 101", [])
+            .unwrap();
+        refresh(&conn, &[]).unwrap();
+        assert_eq!(delta(&conn, 1), 1000);
+    }
+
+    #[test]
+    fn continuation_is_an_index_range() {
+        let conn = history();
+        for where_clause in [
+            "WHERE id_tx <= :last_id_tx AND (id_tx < :last_id_tx OR account_id > :last_account)",
+            "WHERE account_id = :account
+                AND id_tx <= :last_id_tx AND (id_tx < :last_id_tx OR account_id > :last_account)",
+        ] {
+            let plan: Vec<String> = conn
+                .prepare(&format!("EXPLAIN QUERY PLAN {}", page_query(where_clause)))
+                .unwrap()
+                .query_map(
+                    named_params! {
+                        ":account": 0,
+                        ":last_id_tx": 3,
+                        ":last_account": 0,
+                        ":limit": 10,
+                    },
+                    |row| row.get(3),
+                )
+                .unwrap()
+                .collect::<rusqlite::Result<_>>()
+                .unwrap();
+            let plan = plan.join("\n");
+            assert!(plan.contains("SEARCH"), "{}", plan);
+            assert!(!plan.contains("TEMP B-TREE"), "{}", plan);
+        }
+    }
+}
@@ -0,0 +1,110 @@
+//! Transaction builds that run in the background.
+//!
+//! Jobs are run one at a time, in the order in which they were submitted, on a single worker
+//! thread, so that transactions built by different jobs never select the same notes.
+
+use std::collections::HashMap;
+use std::panic::{self, AssertUnwindSafe};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::mpsc::{self, Sender};
+use std::sync::Mutex;
+use std::thread;
+
+use once_cell::sync::Lazy;
+
+/// A function that is called on the worker thread with the ID and final status of a job.
+pub(crate) type Completion = Box<dyn FnOnce(u64, &Status) + Send>;
+
+#[derive(Clone)]
+pub(crate) enum Status {
+    Queued,
+    Running,
+    Succeeded(i64),
+    Failed(String),
+}
+
+struct Job {
+    id: u64,
+    run: Box<dyn FnOnce() -> anyhow::Result<i64> + Send>,
+    on_complete: Option<Completion>,
+}
+
+static NEXT_JOB_ID: AtomicU64 = AtomicU64::new(1);
+
+/// The status of every job that has not completed yet, or that completed without a callback and
+/// has not been released.
+static STATUSES: Lazy<Mutex<HashMap<u64, Status>>> = Lazy::new(Default::default);
+
+static WORKER: Lazy<Mutex<Sender<Job>>> = Lazy::new(|| {
+    let (sender, receiver) = mpsc::channel::<Job>();
+    thread::Builder::new()
+        .name("piratelc-jobs".to_string())
+        .spawn(move || {
+            for job in receiver {
+                run(job);
+            }
+        })
+        .expect("should be able to spawn the job worker thread");
+    Mutex::new(sender)
+});
+
+fn set_status(id: u64, status: Status) {
+    STATUSES.lock().unwrap().insert(id, status);
+}
+
+fn run(job: Job) {
+    set_status(job.id, Status::Running);
+    let status = match panic::catch_unwind(AssertUnwindSafe(job.run)) {
+        Ok(Ok(result)) => Status::Succeeded(result),
+        Ok(Err(e)) => Status::Failed(e.to_string()),
+        Err(_) => Status::Failed("The job panicked".to_string()),
+    };
+
+    match job.on_complete {
+        Some(on_complete) => {
+            STATUSES.lock().unwrap().remove(&job.id);
+            on_complete(job.id, &status);
+        }
+        None => set_status(job.id, status),
+    }
+}
+
+/// Queues `run` to be run on the worker thread, and returns the ID of the job.
+///
+/// If `on_complete` is provided, it is called when the job completes and the job's status is
+/// discarded. Otherwise the status is kept until [`release`] is called.
+pub(crate) fn submit(
+    run: impl FnOnce() -> anyhow::Result<i64> + Send + 'static,
+    on_complete: Option<Completion>,
+) -> u64 {
+    let id = NEXT_JOB_ID.fetch_add(1, Ordering::Relaxed);
+    set_status(id, Status::Queued);
+    WORKER
+        .lock()
+        .unwrap()
+        .send(Job {
+            id,
+            run: Box::new(run),
+            on_complete,
+        })
+        .expect("the job worker thread should be running");
+    id
+}
+
+/// Returns the status of a job, or `None` if there is no such job or it has been released.
+pub(crate) fn status(id: u64) -> Option<Status> {
+    STATUSES.lock().unwrap().get(&id).cloned()
+}
+
+/// Discards the status of a completed job. Returns `false` if the job is still queued or
+/// running, or is unknown.
+pub(crate) fn release(id: u64) -> bool {
+    let mut statuses = STATUSES.lock().unwrap();
+    match statuses.get(&id) {
+        Some(Status::Succeeded(_)) | Some(Status::Failed(_)) => {
+            statuses.remove(&id);
+            true
+        }
+        _ => false,
+    }
+}
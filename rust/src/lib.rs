@@ -2,20 +2,26 @@
 
 use anyhow::anyhow;
 use ffi_helpers::panic::catch_panic;
+use once_cell::sync::OnceCell;
+use rayon::prelude::*;
 use schemer::MigratorError;
-use secrecy::Secret;
+use secrecy::{ExposeSecret, Secret, SecretVec};
 use std::collections::HashMap;
+use std::convert::Infallible;
 use std::convert::{TryFrom, TryInto};
-use std::ffi::{CStr, CString, OsStr};
+use std::ffi::{c_void, CStr, CString, OsStr};
 use std::mem::ManuallyDrop;
 use std::os::raw::c_char;
 use std::os::unix::ffi::OsStrExt;
-use std::path::Path;
+use std::path::{Path, PathBuf};
 use std::slice;
+use std::time::{Duration, Instant};
 use tracing::debug;
 use tracing_subscriber::prelude::*;
 use zcash_primitives::transaction::components::amount::NonNegativeAmount;
 
+use crate::block_source::MemoryBlockSource;
+
 use zcash_address::{
     self,
     unified::{self, Container, Encoding},
@@ -24,29 +30,31 @@ use zcash_address::{
 use zcash_client_backend::{
     address::{RecipientAddress, UnifiedAddress},
     data_api::{
-        chain::{self, scan_cached_blocks, validate_chain},
+        chain::{self, scan_cached_blocks, validate_chain, BlockSource},
         wallet::{
             decrypt_and_store_transaction, input_selection::GreedyInputSelector,
             shield_transparent_funds, spend,
         },
-        WalletRead, WalletWrite,
+        DecryptedTransaction, WalletRead, WalletWrite,
     },
+    decrypt_transaction,
     encoding::{decode_extended_full_viewing_key, decode_extended_spending_key, AddressCodec},
     fees::{fixed, zip317, DustOutputPolicy},
     keys::{DecodingError, Era, UnifiedFullViewingKey, UnifiedSpendingKey},
     wallet::{OvkPolicy, WalletTransparentOutput},
     zip321::{Payment, TransactionRequest},
+    TransferType,
 };
 
 use zcash_client_sqlite::{
     chain::{init::init_blockmeta_db, BlockMeta},
     wallet::init::{init_accounts_table, init_blocks_table, init_wallet_db, WalletMigrationError},
-    FsBlockDb, NoteId, WalletDb,
+    DataConnStmtCache, FsBlockDb, NoteId, WalletDb,
 };
 use zcash_primitives::consensus::Network::{MainNetwork, TestNetwork};
 use zcash_primitives::{
     block::BlockHash,
-    consensus::{BlockHeight, BranchId, Network, Parameters},
+    consensus::{BlockHeight, BranchId, Network, NetworkUpgrade, Parameters},
     legacy::{self, TransparentAddress},
     memo::{Memo, MemoBytes},
     transaction::{
@@ -60,8 +68,22 @@ use zcash_primitives::{
 };
 use zcash_proofs::prover::LocalTxProver;
 
+mod addresses;
+mod balances;
+mod block_source;
+mod checkpoints;
+mod events;
 mod ffi;
+mod hash_chain;
+mod history;
+mod jobs;
+mod maintenance;
+mod memos;
+mod mempool;
+mod note_index;
 mod os_log;
+mod proving;
+mod wallet_ext;
 
 fn unwrap_exc_or<T>(exc: Result<T, ()>, def: T) -> T {
     match exc {
@@ -102,6 +124,56 @@ unsafe fn wallet_db(
         .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))
 }
 
+/// Helper method for opening a direct connection to the data database from path data provided
+/// over the FFI. This is used for the bookkeeping that this library performs alongside the
+/// `zcash_client_sqlite` schema.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+unsafe fn wallet_conn(
+    db_data: *const u8,
+    db_data_len: usize,
+) -> anyhow::Result<rusqlite::Connection> {
+    let db_data = Path::new(OsStr::from_bytes(unsafe {
+        slice::from_raw_parts(db_data, db_data_len)
+    }));
+    wallet_ext::open(db_data)
+        .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))
+}
+
+/// Helper method for interpreting path data provided over the FFI as the path of the data
+/// database, for use as a key into the in-memory state that this library keeps per wallet.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated while the returned path is in use.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+unsafe fn wallet_path<'a>(db_data: *const u8, db_data_len: usize) -> &'a Path {
+    Path::new(OsStr::from_bytes(unsafe {
+        slice::from_raw_parts(db_data, db_data_len)
+    }))
+}
+
+/// Brings the tables that this library derives from the wallet's state up to date after a write
+/// to the data database. `txids` are the transactions that the write may have updated in place;
+/// new, mined and rewound transactions are detected without them.
+fn refresh_derived_tables(conn: &rusqlite::Connection, txids: &[[u8; 32]]) -> anyhow::Result<()> {
+    balances::refresh(conn, txids).map_err(|e| anyhow!("Error while updating balances: {}", e))?;
+    history::refresh(conn, txids)
+        .map_err(|e| anyhow!("Error while updating transaction history: {}", e))?;
+    events::trim(conn).map_err(|e| anyhow!("Error while trimming wallet events: {}", e))
+}
+
 /// Helper method for construcing a FsBlockDb value from path data provided over the FFI.
 ///
 /// # Safety
@@ -211,6 +283,7 @@ pub unsafe extern "C" fn piratelc_init_data_database(
 ) -> i32 {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
         let mut db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
 
         let seed = if seed.is_null() {
@@ -222,7 +295,12 @@ pub unsafe extern "C" fn piratelc_init_data_database(
         };
 
         match init_wallet_db(&mut db_data, seed) {
-            Ok(_) => Ok(0),
+            Ok(_) => {
+                wallet_ext::init(&conn)
+                    .map_err(|e| anyhow!("Error while initializing data DB: {}", e))?;
+                refresh_derived_tables(&conn, &[])?;
+                Ok(0)
+            }
             Err(MigratorError::Adapter(WalletMigrationError::SeedRequired)) => Ok(1),
             Err(e) => Err(anyhow!("Error while initializing data DB: {}", e)),
         }
@@ -270,6 +348,138 @@ pub unsafe extern "C" fn piratelc_free_binary_key(ptr: *mut FFIBinaryKey) {
     }
 }
 
+/// A struct that contains a pointer to, and length information for, a heap-allocated
+/// slice of [`FFIBinaryKey`] values.
+///
+/// # Safety
+///
+/// - `ptr` must be non-null and must be valid for reads for `len * mem::size_of::<FFIBinaryKey>()`
+///   many bytes, and it must be properly aligned. This means in particular:
+///   - The entire memory range pointed to by `ptr` must be contained within a single allocated
+///     object. Slices can never span across multiple allocated objects.
+///   - `ptr` must be non-null and aligned even for zero-length slices.
+///   - `ptr` must point to `len` consecutive properly initialized values of type
+///     [`FFIBinaryKey`].
+/// - The total size `len * mem::size_of::<FFIBinaryKey>()` of the slice pointed to
+///   by `ptr` must be no larger than isize::MAX. See the safety documentation of pointer::offset.
+/// - See the safety documentation of [`FFIBinaryKey`]
+#[repr(C)]
+pub struct FFIBinaryKeys {
+    ptr: *mut FFIBinaryKey,
+    len: usize,
+}
+
+impl FFIBinaryKeys {
+    fn ptr_from_vec(v: Vec<FFIBinaryKey>) -> *mut Self {
+        let boxed_slice: Box<[FFIBinaryKey]> = v.into_boxed_slice();
+        let len = boxed_slice.len();
+        let fat_ptr: *mut [FFIBinaryKey] = Box::into_raw(boxed_slice);
+        let slim_ptr: *mut FFIBinaryKey = fat_ptr as _;
+        Box::into_raw(Box::new(FFIBinaryKeys { ptr: slim_ptr, len }))
+    }
+}
+
+/// Frees an array of FFIBinaryKey values as allocated by `piratelc_create_accounts`
+///
+/// # Safety
+///
+/// - `ptr` must be non-null and must point to a struct having the layout of [`FFIBinaryKeys`].
+///   See the safety documentation of [`FFIBinaryKeys`].
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_free_binary_keys(ptr: *mut FFIBinaryKeys) {
+    if !ptr.is_null() {
+        let s: Box<FFIBinaryKeys> = unsafe { Box::from_raw(ptr) };
+
+        let keys: Box<[FFIBinaryKey]> =
+            unsafe { Box::from_raw(slice::from_raw_parts_mut(s.ptr, s.len)) };
+        for key in keys.iter() {
+            let key_slice: &mut [u8] =
+                unsafe { slice::from_raw_parts_mut(key.encoding, key.encoding_len) };
+            drop(unsafe { Box::from_raw(key_slice) });
+        }
+        drop(keys);
+        drop(s);
+    }
+}
+
+/// Adds the first `count` [ZIP 316] accounts derived from `seed` to a wallet database that
+/// does not have any accounts yet, and returns their identifiers along with the binary
+/// encodings of their [`UnifiedSpendingKey`]s. The caller should manage the memory of (and
+/// store) the returned spending keys in a secure fashion.
+///
+/// This is equivalent to calling [`piratelc_create_account`] `count` times, but the keys are
+/// derived in parallel on the Rayon thread pool and the accounts are inserted in a single
+/// transaction. Returns null if an error occurred, including if the wallet already has
+/// accounts.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `seed` must be non-null and valid for reads for `seed_len` bytes, and it must have an
+///   alignment of `1`.
+/// - The memory referenced by `seed` must not be mutated for the duration of the function call.
+/// - The total size `seed_len` must be no larger than `isize::MAX`. See the safety documentation
+///   of pointer::offset.
+/// - Call [`piratelc_free_binary_keys`] to free the memory associated with the returned pointer
+///   when you are finished using it.
+///
+/// [ZIP 316]: https://zips.z.cash/zip-0316
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_create_accounts(
+    db_data: *const u8,
+    db_data_len: usize,
+    seed: *const u8,
+    seed_len: usize,
+    count: u32,
+    network_id: u32,
+) -> *mut FFIBinaryKeys {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
+        let seed = unsafe { slice::from_raw_parts(seed, seed_len) };
+
+        let existing: u32 = conn
+            .query_row("SELECT COUNT(*) FROM accounts", [], |row| row.get(0))
+            .map_err(|e| anyhow!("Error while counting accounts: {}", e))?;
+        if existing > 0 {
+            return Err(anyhow!(
+                "The wallet already has accounts; use piratelc_create_account instead."
+            ));
+        }
+
+        let usks = (0..count)
+            .into_par_iter()
+            .map(|account| {
+                let account = AccountId::from(account);
+                UnifiedSpendingKey::from_seed(&network, seed, account).map(|usk| (account, usk))
+            })
+            .collect::<Result<Vec<_>, _>>()
+            .map_err(|e| anyhow!("error generating unified spending key from seed: {:?}", e))?;
+        let ufvks: HashMap<AccountId, UnifiedFullViewingKey> = usks
+            .par_iter()
+            .map(|(account, usk)| (*account, usk.to_unified_full_viewing_key()))
+            .collect();
+
+        init_accounts_table(&db_data, &ufvks)
+            .map_err(|e| anyhow!("Error while initializing accounts: {}", e))?;
+        mempool::invalidate_keys(db_path);
+
+        Ok(FFIBinaryKeys::ptr_from_vec(
+            usks.into_iter()
+                .map(|(account, usk)| FFIBinaryKey::new(account, usk.to_bytes(Era::Orchard)))
+                .collect(),
+        ))
+    });
+    unwrap_exc_or_null(res)
+}
+
 /// Adds the next available account-level spend authority, given the current set of [ZIP 316]
 /// account identifiers known, to the wallet database.
 ///
@@ -312,6 +522,7 @@ pub unsafe extern "C" fn piratelc_create_account(
 ) -> *mut FFIBinaryKey {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
         let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
         let seed = Secret::new((unsafe { slice::from_raw_parts(seed, seed_len) }).to_vec());
 
@@ -319,6 +530,7 @@ pub unsafe extern "C" fn piratelc_create_account(
         db_ops
             .create_account(&seed)
             .map(|(account, usk)| {
+                mempool::invalidate_keys(db_path);
                 let encoded = usk.to_bytes(Era::Orchard);
                 Box::into_raw(Box::new(FFIBinaryKey::new(account, encoded)))
             })
@@ -421,6 +633,7 @@ pub unsafe extern "C" fn piratelc_init_accounts_table_with_keys(
 ) -> bool {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
         let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
 
         let encoded_keys: &mut [FFIEncodedKey] =
@@ -436,7 +649,10 @@ pub unsafe extern "C" fn piratelc_init_accounts_table_with_keys(
             .map_err(|e| anyhow!("Error decoding unified full viewing keys: {:?}", e))?;
 
         init_accounts_table(&db_data, &ufvks)
-            .map(|()| true)
+            .map(|()| {
+                mempool::invalidate_keys(db_path);
+                true
+            })
             .map_err(|e| anyhow!("Error while initializing accounts: {}", e))
     });
     unwrap_exc_or(res, false)
@@ -688,6 +904,56 @@ pub unsafe extern "C" fn piratelc_get_next_available_address(
     unwrap_exc_or_null(res)
 }
 
+/// Returns `count` newly-generated unified payment addresses for the specified account, with the
+/// next available diversifiers, separated by newlines.
+///
+/// This is equivalent to calling [`piratelc_get_next_available_address`] `count` times, but the
+/// addresses are derived in parallel on the Rayon thread pool and stored in a single
+/// transaction. At most 1000 addresses can be allocated per call; larger values of `count`
+/// are rejected.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - Call [`piratelc_string_free`] to free the memory associated with the returned pointer
+///   when done using it.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_next_available_addresses(
+    db_data: *const u8,
+    db_data_len: usize,
+    account: i32,
+    count: u32,
+    network_id: u32,
+) -> *mut c_char {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
+        let account = if account >= 0 {
+            account as u32
+        } else {
+            return Err(anyhow!("Account id must be nonnegative."));
+        };
+
+        let account = AccountId::from(account);
+        let ufvk = db_data
+            .get_unified_full_viewing_keys()
+            .map_err(|e| anyhow!("Error while fetching unified full viewing keys: {}", e))?
+            .remove(&account)
+            .ok_or_else(|| anyhow!("Unknown account {:?}", account))?;
+
+        let addresses = addresses::allocate(&conn, &network, account, &ufvk, count as usize)
+            .map_err(|e| anyhow!("Error while allocating addresses: {}", e))?;
+        Ok(CString::new(addresses.join("\n")).unwrap().into_raw())
+    });
+    unwrap_exc_or_null(res)
+}
+
 /// Returns a list of the transparent receivers for the diversified unified addresses that have
 /// been allocated for the provided account.
 ///
@@ -1014,29 +1280,10 @@ pub unsafe extern "C" fn piratelc_get_address_metadata(
 ) -> bool {
     let res = catch_panic(|| {
         let addr = unsafe { CStr::from_ptr(address).to_str()? };
-        let zaddr = ZcashAddress::try_from_encoded(addr)?;
-
-        // The following .unwrap is safe because address type detection
-        // cannot fail for valid ZcashAddress values.
-        let addr_meta: AddressMetadata = zaddr.convert().unwrap();
+        let (network_id, addr_kind) = address_metadata(addr)?;
         unsafe {
-            *network_id_ret = match addr_meta.network {
-                zcash_address::Network::Main => 1,
-                zcash_address::Network::Test => 0,
-                zcash_address::Network::Regtest => {
-                    return Err(anyhow!("Regtest addresses are not supported."));
-                }
-            };
-
-            *addr_kind_ret = match addr_meta.addr_type {
-                AddressType::P2pkh => 0,
-                AddressType::P2sh => 1,
-                AddressType::Sapling => 2,
-                AddressType::Unified => 3,
-                AddressType::Sprout => {
-                    return Err(anyhow!("Sprout addresses are not supported."));
-                }
-            };
+            *network_id_ret = network_id;
+            *addr_kind_ret = addr_kind;
         }
 
         Ok(true)
@@ -1044,6 +1291,112 @@ pub unsafe extern "C" fn piratelc_get_address_metadata(
     unwrap_exc_or(res, false)
 }
 
+/// Returns the network ID and address kind code of `addr`, as described for
+/// [`piratelc_get_address_metadata`].
+fn address_metadata(addr: &str) -> anyhow::Result<(u32, u32)> {
+    let zaddr = ZcashAddress::try_from_encoded(addr)?;
+
+    // The following .unwrap is safe because address type detection
+    // cannot fail for valid ZcashAddress values.
+    let addr_meta: AddressMetadata = zaddr.convert().unwrap();
+    let network_id = match addr_meta.network {
+        zcash_address::Network::Main => 1,
+        zcash_address::Network::Test => 0,
+        zcash_address::Network::Regtest => {
+            return Err(anyhow!("Regtest addresses are not supported."));
+        }
+    };
+
+    let addr_kind = match addr_meta.addr_type {
+        AddressType::P2pkh => 0,
+        AddressType::P2sh => 1,
+        AddressType::Sapling => 2,
+        AddressType::Unified => 3,
+        AddressType::Sprout => {
+            return Err(anyhow!("Sprout addresses are not supported."));
+        }
+    };
+
+    Ok((network_id, addr_kind))
+}
+
+/// Reads the null-terminated UTF-8 strings of `strings`, mapping null pointers and invalid
+/// UTF-8 to `None`, so that they can be processed in parallel.
+///
+/// # Safety
+///
+/// - Each non-null pointer in `strings` must point to a null-terminated string, which must not
+///   be mutated for the lifetime `'a`.
+unsafe fn read_strings<'a>(strings: &[*const c_char]) -> Vec<Option<&'a str>> {
+    strings
+        .iter()
+        .map(|s| {
+            if s.is_null() {
+                None
+            } else {
+                unsafe { CStr::from_ptr(*s) }.to_str().ok()
+            }
+        })
+        .collect()
+}
+
+/// Returns the network ID and address kind code of each of the given addresses, as
+/// [`piratelc_get_address_metadata`] does for a single address. The addresses are decoded in
+/// parallel on the Rayon thread pool.
+///
+/// For each address, the network ID is written to `network_ids_ret` and the address kind code
+/// to `addr_kinds_ret`, or `u32::MAX` to both if the address is not a supported Zcash address.
+/// Returns the number of supported addresses, or -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `addresses` must be non-null and valid for reads for `addresses_len *
+///   mem::size_of::<*const c_char>()` bytes, and it must be properly aligned. Each entry must
+///   either be null or point to a null-terminated string.
+/// - The memory referenced by `addresses`, and the strings it points to, must not be mutated for
+///   the duration of the function call.
+/// - The total size `addresses_len * mem::size_of::<*const c_char>()` must be no larger than
+///   `isize::MAX`. See the safety documentation of pointer::offset.
+/// - `network_ids_ret` and `addr_kinds_ret` must be non-null and valid for writes for
+///   `addresses_len * mem::size_of::<u32>()` bytes, and they must be properly aligned.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_addresses_metadata(
+    addresses: *const *const c_char,
+    addresses_len: usize,
+    network_ids_ret: *mut u32,
+    addr_kinds_ret: *mut u32,
+) -> i64 {
+    let res = catch_panic(|| {
+        let addresses = unsafe { read_strings(slice::from_raw_parts(addresses, addresses_len)) };
+        let network_ids_ret = unsafe { slice::from_raw_parts_mut(network_ids_ret, addresses_len) };
+        let addr_kinds_ret = unsafe { slice::from_raw_parts_mut(addr_kinds_ret, addresses_len) };
+
+        let metadata = addresses
+            .par_iter()
+            .map(|addr| addr.and_then(|addr| address_metadata(addr).ok()))
+            .collect::<Vec<_>>();
+
+        let mut supported = 0;
+        for ((meta, network_id), addr_kind) in metadata
+            .into_iter()
+            .zip(network_ids_ret.iter_mut())
+            .zip(addr_kinds_ret.iter_mut())
+        {
+            let (id, kind) = match meta {
+                Some(meta) => {
+                    supported += 1;
+                    meta
+                }
+                None => (u32::MAX, u32::MAX),
+            };
+            *network_id = id;
+            *addr_kind = kind;
+        }
+        Ok(supported)
+    });
+    unwrap_exc_or(res, -1)
+}
+
 /// Returns true when the address is a valid transparent payment address for the specified network,
 /// false in any other case.
 ///
@@ -1174,6 +1527,90 @@ fn is_valid_unified_address(address: &str, network: &Network) -> bool {
     }
 }
 
+/// Returns the kind code of `encoding` for `network`, as described for
+/// [`piratelc_classify_encodings`].
+fn encoding_kind(encoding: &str, network: &Network) -> u32 {
+    // Sapling keys are only decoded if they carry the network's prefix, so that most strings
+    // are rejected without computing a Bech32 checksum for each decoder.
+    let has_hrp = |hrp: &str| {
+        encoding
+            .strip_prefix(hrp)
+            .map_or(false, |rest| rest.starts_with('1'))
+    };
+
+    if let Some(addr) = RecipientAddress::decode(network, encoding) {
+        match addr {
+            RecipientAddress::Shielded(_) => 1,
+            RecipientAddress::Transparent(_) => 2,
+            RecipientAddress::Unified(_) => 3,
+        }
+    } else if has_hrp(network.hrp_sapling_extended_spending_key()) {
+        match decode_extended_spending_key(network.hrp_sapling_extended_spending_key(), encoding) {
+            Ok(_) => 4,
+            Err(_) => 0,
+        }
+    } else if has_hrp(network.hrp_sapling_extended_full_viewing_key()) {
+        match decode_extended_full_viewing_key(
+            network.hrp_sapling_extended_full_viewing_key(),
+            encoding,
+        ) {
+            Ok(_) => 5,
+            Err(_) => 0,
+        }
+    } else if UnifiedFullViewingKey::decode(network, encoding).is_ok() {
+        6
+    } else {
+        0
+    }
+}
+
+/// Validates each of the given strings against all of the address and key encodings that the
+/// `piratelc_is_valid_*` functions check, for the specified network, and writes a kind code
+/// for each of them to `kinds_ret`:
+/// * invalid: 0
+/// * Sapling address: 1
+/// * transparent address: 2
+/// * unified address: 3
+/// * Sapling extended spending key: 4
+/// * Sapling extended full viewing key: 5
+/// * unified full viewing key: 6
+///
+/// The strings are decoded in parallel on the Rayon thread pool. Returns the number of valid
+/// strings, or -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `encodings` must be non-null and valid for reads for `encodings_len *
+///   mem::size_of::<*const c_char>()` bytes, and it must be properly aligned. Each entry must
+///   either be null or point to a null-terminated string.
+/// - The memory referenced by `encodings`, and the strings it points to, must not be mutated for
+///   the duration of the function call.
+/// - The total size `encodings_len * mem::size_of::<*const c_char>()` must be no larger than
+///   `isize::MAX`. See the safety documentation of pointer::offset.
+/// - `kinds_ret` must be non-null and valid for writes for `encodings_len *
+///   mem::size_of::<u32>()` bytes, and it must be properly aligned.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_classify_encodings(
+    encodings: *const *const c_char,
+    encodings_len: usize,
+    network_id: u32,
+    kinds_ret: *mut u32,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let encodings = unsafe { read_strings(slice::from_raw_parts(encodings, encodings_len)) };
+        let kinds_ret = unsafe { slice::from_raw_parts_mut(kinds_ret, encodings_len) };
+
+        let kinds = encodings
+            .par_iter()
+            .map(|encoding| encoding.map_or(0, |encoding| encoding_kind(encoding, &network)))
+            .collect::<Vec<_>>();
+        kinds_ret.copy_from_slice(&kinds);
+        Ok(kinds.iter().filter(|kind| **kind != 0).count() as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
 /// Returns the balance for the specified account, including all unspent notes that we know about.
 ///
 /// # Safety
@@ -1192,23 +1629,18 @@ pub unsafe extern "C" fn piratelc_get_balance(
     network_id: u32,
 ) -> i64 {
     let res = catch_panic(|| {
-        let network = parse_network(network_id)?;
-        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
+        parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
 
         if account >= 0 {
-            let (_, max_height) = db_data
-                .block_height_extrema()
-                .map_err(|e| anyhow!("Error while fetching max block height: {}", e))
+            // Notes mined in the latest scanned block have one confirmation.
+            balances::get(&conn, account as u32, 1)
+                .map_err(|e| anyhow!("Error while fetching balance: {}", e))
                 .and_then(|opt| {
                     opt.ok_or_else(|| {
                         anyhow!("No blockchain information available; scan required.")
                     })
-                })?;
-
-            db_data
-                .get_balance_at(AccountId::from(account as u32), max_height)
-                .map(|b| b.into())
-                .map_err(|e| anyhow!("Error while fetching balance: {}", e))
+                })
         } else {
             Err(anyhow!("account argument must be positive"))
         }
@@ -1236,23 +1668,14 @@ pub unsafe extern "C" fn piratelc_get_verified_balance(
     min_confirmations: u32,
 ) -> i64 {
     let res = catch_panic(|| {
-        let network = parse_network(network_id)?;
-        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
+        parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
         if account >= 0 {
-            db_data
-                .get_target_and_anchor_heights(min_confirmations)
-                .map_err(|e| anyhow!("Error while fetching anchor height: {}", e))
-                .and_then(|opt_anchor| {
-                    opt_anchor
-                        .map(|(_, a)| a)
-                        .ok_or_else(|| anyhow!("Anchor height not available; scan required."))
-                })
-                .and_then(|anchor| {
-                    db_data
-                        .get_balance_at(AccountId::from(account as u32), anchor)
-                        .map_err(|e| anyhow!("Error while fetching verified balance: {}", e))
+            balances::get(&conn, account as u32, min_confirmations)
+                .map_err(|e| anyhow!("Error while fetching verified balance: {}", e))
+                .and_then(|opt| {
+                    opt.ok_or_else(|| anyhow!("Anchor height not available; scan required."))
                 })
-                .map(|amount| amount.into())
         } else {
             Err(anyhow!("account argument must be positive"))
         }
@@ -1333,54 +1756,14 @@ pub unsafe extern "C" fn piratelc_get_verified_transparent_balance_for_account(
     min_confirmations: u32,
 ) -> i64 {
     let res = catch_panic(|| {
-        let network = parse_network(network_id)?;
-        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
-        let account = if account >= 0 {
-            AccountId::from(account as u32)
-        } else {
+        parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        if account < 0 {
             return Err(anyhow!("account argument must be positive"));
-        };
-        let amount = db_data
-            .get_target_and_anchor_heights(min_confirmations)
-            .map_err(|e| anyhow!("Error while fetching anchor height: {}", e))
-            .and_then(|opt_anchor| {
-                opt_anchor
-                    .map(|(_, a)| a)
-                    .ok_or_else(|| anyhow!("height not available; scan required."))
-            })
-            .and_then(|anchor| {
-                db_data
-                    .get_transparent_receivers(account)
-                    .map_err(|e| {
-                        anyhow!(
-                            "Error while fetching transparent receivers for {:?}: {}",
-                            account,
-                            e,
-                        )
-                    })
-                    .and_then(|receivers| {
-                        receivers
-                            .keys()
-                            .map(|taddr| {
-                                db_data
-                                    .get_unspent_transparent_outputs(taddr, anchor, &[])
-                                    .map_err(|e| {
-                                        anyhow!(
-                                            "Error while fetching verified transparent balance: {}",
-                                            e
-                                        )
-                                    })
-                            })
-                            .collect::<Result<Vec<_>, _>>()
-                    })
-            })?
-            .iter()
-            .flatten()
-            .map(|utxo| utxo.txout().value)
-            .sum::<Option<Amount>>()
-            .ok_or_else(|| anyhow!("Balance overflowed MAX_MONEY."))?;
-
-        Ok(amount.into())
+        }
+        balances::get_transparent(&conn, account as u32, min_confirmations)
+            .map_err(|e| anyhow!("Error while fetching verified transparent balance: {}", e))?
+            .ok_or_else(|| anyhow!("height not available; scan required."))
     });
     unwrap_exc_or(res, -1)
 }
@@ -1452,42 +1835,376 @@ pub unsafe extern "C" fn piratelc_get_total_transparent_balance_for_account(
     account: i32,
 ) -> i64 {
     let res = catch_panic(|| {
-        let network = parse_network(network_id)?;
-        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
-        let account = if account >= 0 {
-            AccountId::from(account as u32)
-        } else {
+        parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        if account < 0 {
             return Err(anyhow!("account argument must be positive"));
-        };
-        let amount = db_data
-            .get_target_and_anchor_heights(0u32)
-            .map_err(|e| anyhow!("Error while fetching anchor height: {}", e))
-            .and_then(|opt_anchor| {
-                opt_anchor
-                    .map(|(_, a)| a)
-                    .ok_or_else(|| anyhow!("height not available; scan required."))
-            })
-            .and_then(|anchor| {
-                db_data
-                    .get_transparent_balances(account, anchor)
-                    .map_err(|e| {
-                        anyhow!(
-                            "Error while fetching transparent balances for {:?}: {}",
-                            account,
-                            e,
-                        )
-                    })
-            })?
-            .values()
-            .sum::<Option<Amount>>()
-            .ok_or_else(|| anyhow!("Balance overflowed MAX_MONEY."))?;
-
-        Ok(amount.into())
+        }
+        balances::get_transparent(&conn, account as u32, 0)
+            .map_err(|e| anyhow!("Error while fetching total transparent balance: {}", e))?
+            .ok_or_else(|| anyhow!("height not available; scan required."))
     });
     unwrap_exc_or(res, -1)
 }
 
-/// Returns the memo for a received note, if it is known and a valid UTF-8 string.
+/// The transparent balance of an account, as returned by
+/// [`piratelc_get_transparent_balances_for_all_accounts`].
+#[repr(C)]
+pub struct FFIAccountTransparentBalance {
+    account_id: u32,
+    balance: i64,
+}
+
+/// Returns the transparent balance of every account, which ignores utxos that have been
+/// received too recently and are not yet deemed spendable according to `min_confirmations`.
+/// Passing `0` for `min_confirmations` includes all UTXOs that we know about.
+///
+/// The balances are copied into `balances` in order of account. Returns the number of
+/// accounts, which may be larger than `balances_len`; in that case only the first
+/// `balances_len` balances are copied. Returns -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `balances` must be non-null and valid for writes for `balances_len *
+///   mem::size_of::<FFIAccountTransparentBalance>()` bytes, and it must be properly aligned.
+/// - The total size `balances_len * mem::size_of::<FFIAccountTransparentBalance>()` must be no
+///   larger than `isize::MAX`. See the safety documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_transparent_balances_for_all_accounts(
+    db_data: *const u8,
+    db_data_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    balances: *mut FFIAccountTransparentBalance,
+    balances_len: usize,
+) -> i64 {
+    let res = catch_panic(|| {
+        parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let balances_ret = unsafe { slice::from_raw_parts_mut(balances, balances_len) };
+
+        let balances = balances::get_transparent_for_all_accounts(&conn, min_confirmations)
+            .map_err(|e| anyhow!("Error while fetching transparent balances: {}", e))?
+            .ok_or_else(|| anyhow!("height not available; scan required."))?;
+        for (slot, (account_id, balance)) in balances_ret.iter_mut().zip(balances.iter()) {
+            *slot = FFIAccountTransparentBalance {
+                account_id: *account_id,
+                balance: *balance,
+            };
+        }
+        Ok(balances.len() as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// The balances of an account, as returned by [`piratelc_get_balances_for_all_accounts`].
+///
+/// - `total` is the shielded balance, as returned by [`piratelc_get_balance`].
+/// - `verified` is the verified shielded balance, as returned by
+///   [`piratelc_get_verified_balance`].
+/// - `transparent` is the transparent balance, as returned by
+///   [`piratelc_get_total_transparent_balance_for_account`].
+/// - `transparent_verified` is the verified transparent balance, as returned by
+///   [`piratelc_get_verified_transparent_balance_for_account`].
+/// - `pending` is the value of the unspent notes received in transactions that have not been
+///   mined yet, such as the change of the account's own unmined transactions.
+#[repr(C)]
+pub struct FFIAccountBalance {
+    account_id: u32,
+    total: i64,
+    verified: i64,
+    transparent: i64,
+    transparent_verified: i64,
+    pending: i64,
+}
+
+/// Returns all balances of every account, as a consistent snapshot of the data database.
+/// `min_confirmations` applies to both the verified shielded and the verified transparent
+/// balances.
+///
+/// The balances are copied into `balances` in order of account. Returns the number of
+/// accounts, which may be larger than `balances_len`; in that case only the first
+/// `balances_len` balances are copied. Returns -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `balances` must be non-null and valid for writes for `balances_len *
+///   mem::size_of::<FFIAccountBalance>()` bytes, and it must be properly aligned.
+/// - The total size `balances_len * mem::size_of::<FFIAccountBalance>()` must be no larger
+///   than `isize::MAX`. See the safety documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_balances_for_all_accounts(
+    db_data: *const u8,
+    db_data_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    balances: *mut FFIAccountBalance,
+    balances_len: usize,
+) -> i64 {
+    let res = catch_panic(|| {
+        parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let balances_ret = unsafe { slice::from_raw_parts_mut(balances, balances_len) };
+
+        let balances = balances::get_for_all_accounts(&conn, min_confirmations)
+            .map_err(|e| anyhow!("Error while fetching balances: {}", e))?
+            .ok_or_else(|| anyhow!("No blockchain information available; scan required."))?;
+        for (slot, balance) in balances_ret.iter_mut().zip(balances.iter()) {
+            *slot = FFIAccountBalance {
+                account_id: balance.account,
+                total: balance.total,
+                verified: balance.verified,
+                transparent: balance.transparent,
+                transparent_verified: balance.transparent_verified,
+                pending: balance.pending,
+            };
+        }
+        Ok(balances.len() as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// An open transaction history cursor, as returned by [`piratelc_history_cursor_open`].
+pub struct FFIHistoryCursor(history::Cursor);
+
+/// A row of the transaction history, as returned by [`piratelc_history_cursor_next`]. The
+/// fields correspond to the columns of the `v_transactions` view.
+///
+/// - `mined_height` is `0` if the transaction has not been mined.
+/// - `tx_index` is `-1` if the transaction has not been mined.
+/// - `block_time` is `-1` if the transaction has not been mined.
+/// - `expiry_height` is `0` if the transaction does not expire or its expiry height is unknown.
+/// - `fee_paid` is `-1` if the fee is unknown.
+#[repr(C)]
+pub struct FFITransactionRecord {
+    account_id: u32,
+    id_tx: i64,
+    txid: [u8; 32],
+    mined_height: u32,
+    tx_index: i32,
+    block_time: i64,
+    expiry_height: u32,
+    account_balance_delta: i64,
+    fee_paid: i64,
+    has_change: bool,
+    sent_note_count: u32,
+    received_note_count: u32,
+    memo_count: u32,
+    expired_unmined: bool,
+}
+
+/// Opens a cursor over the transaction history of the data database, from the most recently
+/// added transaction to the oldest one.
+///
+/// - `account` restricts the history to the given account; pass `-1` for all accounts.
+/// - `direction` is `0` for all transactions, `1` for transactions that increased the
+///   account's balance, and `2` for transactions that decreased it.
+/// - `include_expired` controls whether transactions that expired without being mined are
+///   included.
+///
+/// The cursor keeps its own connection to the data database, and pages are read with
+/// [`piratelc_history_cursor_next`] in time independent of how far into the history they
+/// are. Returns null if an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - Call [`piratelc_history_cursor_close`] to free the memory associated with the returned
+///   pointer when you are finished using it.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_history_cursor_open(
+    db_data: *const u8,
+    db_data_len: usize,
+    account: i32,
+    direction: u32,
+    include_expired: bool,
+) -> *mut FFIHistoryCursor {
+    let res = catch_panic(|| {
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let account = if account >= 0 {
+            Some(account as u32)
+        } else if account == -1 {
+            None
+        } else {
+            return Err(anyhow!("account argument must be positive or -1"));
+        };
+        let direction = match direction {
+            0 => history::Direction::All,
+            1 => history::Direction::Received,
+            2 => history::Direction::Sent,
+            _ => return Err(anyhow!("Invalid history direction: {}", direction)),
+        };
+
+        let cursor = history::Cursor::new(conn, account, direction, include_expired);
+        Ok(Box::into_raw(Box::new(FFIHistoryCursor(cursor))))
+    });
+    unwrap_exc_or_null(res)
+}
+
+/// Reads the next page of up to `records_len` rows from a transaction history cursor into
+/// `records`.
+///
+/// Returns the number of rows read, which is `0` once the end of the history has been
+/// reached, or -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `cursor` must be non-null and must have been returned by [`piratelc_history_cursor_open`]
+///   and not yet closed. It must not be used concurrently from multiple threads.
+/// - `records` must be non-null and valid for writes for `records_len *
+///   mem::size_of::<FFITransactionRecord>()` bytes, and it must be properly aligned.
+/// - The total size `records_len * mem::size_of::<FFITransactionRecord>()` must be no larger
+///   than `isize::MAX`. See the safety documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_history_cursor_next(
+    cursor: *mut FFIHistoryCursor,
+    records: *mut FFITransactionRecord,
+    records_len: usize,
+) -> i64 {
+    let res = catch_panic(|| {
+        let cursor = unsafe { cursor.as_mut() }.ok_or_else(|| anyhow!("cursor is null"))?;
+        let records_ret = unsafe { slice::from_raw_parts_mut(records, records_len) };
+
+        let limit = u32::try_from(records_len).unwrap_or(u32::MAX);
+        let records = cursor
+            .0
+            .next_page(limit)
+            .map_err(|e| anyhow!("Error while reading transaction history: {}", e))?;
+        for (slot, record) in records_ret.iter_mut().zip(records.iter()) {
+            *slot = FFITransactionRecord {
+                account_id: record.account,
+                id_tx: record.id_tx,
+                txid: record.txid,
+                mined_height: record.mined_height.unwrap_or(0),
+                tx_index: record.tx_index.map_or(-1, |i| i as i32),
+                block_time: record.block_time.unwrap_or(-1),
+                expiry_height: record.expiry_height.unwrap_or(0),
+                account_balance_delta: record.account_balance_delta,
+                fee_paid: record.fee_paid.unwrap_or(-1),
+                has_change: record.has_change,
+                sent_note_count: record.sent_note_count,
+                received_note_count: record.received_note_count,
+                memo_count: record.memo_count,
+                expired_unmined: record.expired_unmined,
+            };
+        }
+        Ok(records.len() as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Closes a transaction history cursor and its connection to the data database.
+///
+/// # Safety
+///
+/// - `cursor` must either be null, or have been returned by [`piratelc_history_cursor_open`]
+///   and not yet closed.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_history_cursor_close(cursor: *mut FFIHistoryCursor) {
+    if !cursor.is_null() {
+        let cursor: Box<FFIHistoryCursor> = unsafe { Box::from_raw(cursor) };
+        drop(cursor);
+    }
+}
+
+/// A change to the wallet, as returned by [`piratelc_get_wallet_events`].
+///
+/// `kind` is one of:
+/// - `0`: a note was received. `id_tx` is the receiving transaction, and `height` is its
+///   mined height, or `0` if it was not mined yet.
+/// - `1`: a note was spent. `id_tx` is the spending transaction, and `height` is its mined
+///   height, or `0` if it was not mined yet.
+/// - `2`: a transaction was mined at `height`.
+/// - `3`: the wallet was rewound to `height`.
+/// - `4`: a note is unspent again, for example because its spending transaction was rewound
+///   or expired. `id_tx` is the transaction that had spent it, and `height` is `0`.
+///
+/// `id_note`, `account_id` and `value` describe the note for events of kind `0`, `1` and `4`,
+/// and are `-1` otherwise. `id_tx` is `-1` for events of kind `3`.
+#[repr(C)]
+pub struct FFIWalletEvent {
+    seq: i64,
+    kind: u32,
+    height: u32,
+    id_tx: i64,
+    id_note: i64,
+    account_id: i64,
+    value: i64,
+}
+
+/// Returns the changes made to the wallet after the event with sequence number `after_seq`,
+/// so that a host can update its views incrementally. Pass `0` to read from the oldest
+/// retained event.
+///
+/// The events are copied into `events` in the order in which they happened. Sequence numbers
+/// are consecutive, and only the 10000 most recent events are retained; if the first event
+/// returned does not have the sequence number `after_seq + 1`, events have been missed and
+/// the host should re-read the wallet state in full.
+///
+/// Returns the number of events copied, which is `0` if there are no newer events, or -1 if an
+/// error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `events` must be non-null and valid for writes for `events_len *
+///   mem::size_of::<FFIWalletEvent>()` bytes, and it must be properly aligned.
+/// - The total size `events_len * mem::size_of::<FFIWalletEvent>()` must be no larger than
+///   `isize::MAX`. See the safety documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_wallet_events(
+    db_data: *const u8,
+    db_data_len: usize,
+    after_seq: i64,
+    events: *mut FFIWalletEvent,
+    events_len: usize,
+) -> i64 {
+    let res = catch_panic(|| {
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let events_ret = unsafe { slice::from_raw_parts_mut(events, events_len) };
+
+        let limit = u32::try_from(events_len).unwrap_or(u32::MAX);
+        let events = events::get_since(&conn, after_seq, limit)
+            .map_err(|e| anyhow!("Error while reading wallet events: {}", e))?;
+        for (slot, event) in events_ret.iter_mut().zip(events.iter()) {
+            *slot = FFIWalletEvent {
+                seq: event.seq,
+                kind: event.kind,
+                height: event.height.unwrap_or(0),
+                id_tx: event.id_tx.unwrap_or(-1),
+                id_note: event.id_note.unwrap_or(-1),
+                account_id: event.account.map_or(-1, i64::from),
+                value: event.value.unwrap_or(-1),
+            };
+        }
+        Ok(events.len() as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Returns the memo for a received note, if it is known and a valid UTF-8 string.
 ///
 /// The note is identified by its row index in the `received_notes` table within the data
 /// database.
@@ -1669,6 +2386,114 @@ pub unsafe extern "C" fn piratelc_get_sent_memo(
     }
 }
 
+/// Returns the memos for a set of notes by copying them to `memos_ret`, 512 bytes per note in
+/// the order of `note_ids`.
+///
+/// The notes are identified by their row indices in the `sent_notes` table if `sent` is set,
+/// and in the `received_notes` table otherwise. All memos are read using a single connection
+/// to the data database.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `note_ids` must be non-null and valid for reads for `note_ids_len * mem::size_of::<i64>()`
+///   bytes, and it must be properly aligned.
+/// - The memory referenced by `note_ids` must not be mutated for the duration of the function
+///   call.
+/// - `memos_ret` must be non-null and must point to an allocated region of memory of
+///   `note_ids_len * 512` bytes.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_memos(
+    db_data: *const u8,
+    db_data_len: usize,
+    note_ids: *const i64,
+    note_ids_len: usize,
+    sent: bool,
+    memos_ret: *mut u8,
+) -> bool {
+    let res = catch_panic(|| {
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let note_ids = unsafe { slice::from_raw_parts(note_ids, note_ids_len) };
+        let memos_ret = unsafe { slice::from_raw_parts_mut(memos_ret, note_ids_len * 512) };
+
+        let memos = memos::get(&conn, note_ids, sent)
+            .map_err(|e| anyhow!("An error occurred retrieving the memos: {}", e))?;
+        for (memo_ret, memo) in memos_ret.chunks_exact_mut(512).zip(memos.iter()) {
+            memo_ret.copy_from_slice(memo.as_array());
+        }
+        Ok(true)
+    });
+    unwrap_exc_or(res, false)
+}
+
+/// Returns the memos for a set of notes as UTF-8 strings, packed into `arena`.
+///
+/// The notes are identified as in [`piratelc_get_memos`]. The text of the memo of
+/// `note_ids[i]` occupies bytes `offsets_ret[i]..offsets_ret[i + 1]` of `arena`, without a
+/// null terminator. Memos that are empty or do not contain UTF-8 text are returned as empty
+/// strings; use [`piratelc_get_memos`] to tell them apart.
+///
+/// Returns the number of bytes needed for the text of all memos, or -1 if an error occurred.
+/// If this is larger than `arena_len`, `offsets_ret` is still written but `arena` is left
+/// untouched, and the call can be repeated with a larger arena.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `note_ids` must be non-null and valid for reads for `note_ids_len * mem::size_of::<i64>()`
+///   bytes, and it must be properly aligned.
+/// - The memory referenced by `note_ids` must not be mutated for the duration of the function
+///   call.
+/// - `arena` must be non-null and must point to an allocated region of memory of `arena_len`
+///   bytes.
+/// - `offsets_ret` must be non-null and valid for writes for `(note_ids_len + 1) *
+///   mem::size_of::<usize>()` bytes, and it must be properly aligned.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_memos_as_utf8(
+    db_data: *const u8,
+    db_data_len: usize,
+    note_ids: *const i64,
+    note_ids_len: usize,
+    sent: bool,
+    arena: *mut u8,
+    arena_len: usize,
+    offsets_ret: *mut usize,
+) -> i64 {
+    let res = catch_panic(|| {
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let note_ids = unsafe { slice::from_raw_parts(note_ids, note_ids_len) };
+        let arena = unsafe { slice::from_raw_parts_mut(arena, arena_len) };
+        let offsets_ret = unsafe { slice::from_raw_parts_mut(offsets_ret, note_ids_len + 1) };
+
+        let texts = memos::texts(&conn, note_ids, sent)
+            .map_err(|e| anyhow!("An error occurred retrieving the memos: {}", e))?;
+
+        let mut offset = 0;
+        offsets_ret[0] = 0;
+        for (text, offset_ret) in texts.iter().zip(offsets_ret[1..].iter_mut()) {
+            offset += text.len();
+            *offset_ret = offset;
+        }
+        if offset <= arena_len {
+            for (text, start) in texts.iter().zip(offsets_ret.iter()) {
+                arena[*start..*start + text.len()].copy_from_slice(text.as_bytes());
+            }
+        }
+        Ok(offset as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
 #[no_mangle]
 /// Returns a ZIP-32 signature of the given seed bytes.
 ///
@@ -1721,6 +2546,10 @@ pub unsafe extern "C" fn piratelc_seed_fingerprint(
 ///   highest block in the block cache is correct).
 /// - `0` if there was an error during validation unrelated to chain validity.
 ///
+/// Blocks written with [`piratelc_write_block_metadata`] during the lifetime of the process are
+/// validated against an in-memory index of their hashes, without reading them from the cache.
+/// The cached blocks are only read when that index does not cover the range to validate.
+///
 /// This function does not mutate either of the databases.
 ///
 /// # Safety
@@ -1748,6 +2577,9 @@ pub unsafe extern "C" fn piratelc_validate_combined_chain(
 ) -> i32 {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
+        let fs_block_db_root_path = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(fs_block_db_root, fs_block_db_root_len)
+        }));
         let block_db = block_db(fs_block_db_root, fs_block_db_root_len)?;
         let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
 
@@ -1761,6 +2593,20 @@ pub unsafe extern "C" fn piratelc_validate_combined_chain(
             Some(validate_limit)
         };
 
+        let max_cached_height = block_db
+            .get_max_cached_height()
+            .map_err(|e| anyhow!("Error while validating chain: {:?}", e))?;
+        match hash_chain::validate(
+            fs_block_db_root_path,
+            validate_from.map(|(height, hash)| (u32::from(height), hash.0)),
+            max_cached_height.map(u32::from),
+            limit,
+        ) {
+            hash_chain::Validation::Valid => return Ok(-1),
+            hash_chain::Validation::InvalidAt(height) => return Ok(height as i32),
+            hash_chain::Validation::Unknown => (),
+        }
+
         let val_res = validate_chain(&block_db, validate_from, limit);
 
         if let Err(e) = val_res {
@@ -1782,6 +2628,10 @@ pub unsafe extern "C" fn piratelc_validate_combined_chain(
 /// Returns the most recent block height to which it is possible to reset the state
 /// of the data database.
 ///
+/// This is `height` itself if the wallet still holds the witnesses needed to resume scanning
+/// from there, or else the nearest scan checkpoint below `height`. If neither is available,
+/// the height of the oldest unspent note is used.
+///
 /// # Safety
 ///
 /// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
@@ -1803,9 +2653,17 @@ pub unsafe extern "C" fn piratelc_get_nearest_rewind_height(
             Ok(height)
         } else {
             let network = parse_network(network_id)?;
+            let conn = unsafe { wallet_conn(db_data, db_data_len)? };
             let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
             let height = BlockHeight::try_from(height)?;
 
+            if let Some(rewind_height) =
+                checkpoints::nearest_rewind_height(&conn, u32::from(height))
+                    .map_err(|e| anyhow!("Error while reading scan checkpoints: {}", e))?
+            {
+                return Ok(rewind_height as i32);
+            }
+
             match db_data.get_min_unspent_height() {
                 Ok(Some(best_height)) => {
                     let first_unspent_note_height = u32::from(best_height);
@@ -1835,6 +2693,13 @@ pub unsafe extern "C" fn piratelc_get_nearest_rewind_height(
 /// If the requested height is greater than or equal to the height of the last scanned
 /// block, this function does nothing.
 ///
+/// If the wallet no longer holds the witnesses at `height` but a scan checkpoint was recorded
+/// there, the checkpoint is restored so that scanning can resume from `height`. Rewinds to
+/// more than 100 blocks below the last scanned block, which the upstream truncation only
+/// accepts down to the oldest unspent note, are performed by this library when scanning can
+/// resume from `height`. Use [`piratelc_get_nearest_rewind_height`] to obtain a height for
+/// which this is the case.
+///
 /// # Safety
 ///
 /// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
@@ -1852,14 +2717,110 @@ pub unsafe extern "C" fn piratelc_rewind_to_height(
 ) -> bool {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
         let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
         let mut db_data = db_data.get_update_ops()?;
 
         let height = BlockHeight::try_from(height)?;
-        db_data
-            .truncate_to_height(height)
-            .map(|_| true)
-            .map_err(|e| anyhow!("Error while rewinding data DB to height {}: {}", height, e))
+        if !checkpoints::rewind(&conn, u32::from(height)).map_err(|e| {
+            anyhow!(
+                "Error while rewinding to scan checkpoint at {}: {}",
+                height,
+                e
+            )
+        })? {
+            db_data.truncate_to_height(height).map_err(|e| {
+                anyhow!("Error while rewinding data DB to height {}: {}", height, e)
+            })?;
+        }
+
+        checkpoints::truncate_to_height(&conn, u32::from(height)).map_err(|e| {
+            anyhow!(
+                "Error while rewinding scan checkpoints to {}: {}",
+                height,
+                e
+            )
+        })?;
+        events::record_rewind(&conn, u32::from(height))
+            .map_err(|e| anyhow!("Error while recording rewind to {}: {}", height, e))?;
+        refresh_derived_tables(&conn, &[])?;
+        Ok(true)
+    });
+    unwrap_exc_or(res, false)
+}
+
+/// Compacts the data database.
+///
+/// Deletes the witnesses that are more than `reorg_window` blocks below the chain tip. Free
+/// pages are then returned to the filesystem with SQLite's `incremental_vacuum` until none are
+/// left or `time_budget_ms` milliseconds have elapsed, so that this can be scheduled while the
+/// application is idle. Free pages are only returned once the database has been switched to
+/// incremental vacuuming with [`piratelc_enable_incremental_vacuum`].
+///
+/// `reorg_window` must be at least 100 blocks, the depth within which the wallet rewinds and
+/// selects anchors, and should not be smaller than the largest rewind the caller expects to
+/// perform. Scanning already prunes witnesses below that depth, so in practice the space is
+/// recovered by the vacuum. Spent notes are not pruned, as the transaction history is computed
+/// from them.
+///
+/// Returns the number of pages by which the database shrank, or -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_compact_data_database(
+    db_data: *const u8,
+    db_data_len: usize,
+    reorg_window: u32,
+    time_budget_ms: u32,
+) -> i64 {
+    let res = catch_panic(|| {
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+
+        let pruned = maintenance::prune_witnesses(&conn, reorg_window)
+            .map_err(|e| anyhow!("Error while pruning witnesses: {}", e))?;
+        debug!("Pruned {} witnesses from the data DB", pruned);
+
+        maintenance::incremental_vacuum(&conn, Duration::from_millis(time_budget_ms.into()))
+            .map_err(|e| anyhow!("Error while vacuuming data DB: {}", e))
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Switches the data database to incremental vacuuming, which lets
+/// [`piratelc_compact_data_database`] return free pages to the filesystem within its time
+/// budget.
+///
+/// Databases are created without incremental vacuuming, and converting one requires a full
+/// `VACUUM` that rewrites the whole file and is not time-bounded, so this should be called once,
+/// at a time when the wallet is not otherwise in use. Calling it again does nothing.
+///
+/// Returns true if the database was converted by this call, or false if it already used
+/// incremental vacuuming or an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_enable_incremental_vacuum(
+    db_data: *const u8,
+    db_data_len: usize,
+) -> bool {
+    let res = catch_panic(|| {
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        maintenance::enable_incremental_vacuum(&conn)
+            .map_err(|e| anyhow!("Error while enabling incremental vacuum: {}", e))
     });
     unwrap_exc_or(res, false)
 }
@@ -1879,6 +2840,10 @@ pub unsafe extern "C" fn piratelc_rewind_to_height(
 /// Scanned blocks are required to be height-sequential. If a block is missing from the
 /// cache, an error will be signalled.
 ///
+/// After scanning, a checkpoint of the wallet's witnesses is recorded at each checkpoint
+/// height that was reached, so that later rewinds can resume from there, and transactions
+/// that were mined are removed from the mempool cache (see [`piratelc_mempool_add_transaction`]).
+///
 /// # Safety
 ///
 /// - `fs_block_db_root` must be non-null and valid for reads for `fs_block_db_root_len` bytes, and it must have an
@@ -1905,6 +2870,8 @@ pub unsafe extern "C" fn piratelc_scan_blocks(
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
         let block_db = block_db(fs_block_cache_root, fs_block_cache_root_len)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
         let db_read = unsafe { wallet_db(db_data, db_data_len, network)? };
         let mut db_data = db_read.get_update_ops()?;
         let limit = if scan_limit == 0 {
@@ -1912,28 +2879,139 @@ pub unsafe extern "C" fn piratelc_scan_blocks(
         } else {
             Some(scan_limit)
         };
-        match scan_cached_blocks(&network, &block_db, &mut db_data, limit) {
-            Ok(()) => Ok(1),
-            Err(e) => Err(anyhow!("Error while scanning blocks: {}", e)),
-        }
+        scan_cached_blocks(&network, &block_db, &mut db_data, limit)
+            .map_err(|e| anyhow!("Error while scanning blocks: {}", e))?;
+
+        checkpoints::record(&conn)
+            .map_err(|e| anyhow!("Error while recording scan checkpoints: {}", e))?;
+        refresh_derived_tables(&conn, &[])?;
+        mempool::reconcile(&network, db_path, &db_read)?;
+        Ok(1)
     });
     unwrap_exc_or_null(res)
 }
 
-/// Inserts a UTXO into the wallet database.
+/// The largest number of blocks that [`piratelc_validate_and_scan_blocks`] holds in memory.
+/// Compact blocks are usually a few kilobytes, but can reach megabytes for blocks with many
+/// shielded outputs, so this bounds the memory used by a single call to tens of megabytes in
+/// the common case.
+const MAX_VALIDATE_AND_SCAN_BLOCKS: u32 = 1000;
+
+/// Validates the blocks in the cache above the wallet's chain tip and scans them, reading each
+/// block from the cache only once.
+///
+/// This is equivalent to calling [`piratelc_validate_combined_chain`] followed by
+/// [`piratelc_scan_blocks`] over the same range, except that at most `scan_limit` blocks are
+/// read into memory, checked for linkage to the wallet's tip and to each other, and then
+/// scanned from memory. If the linkage check fails, nothing is written to the data database.
+///
+/// As the blocks are held in memory, `scan_limit` is capped at 1000 blocks; a `scan_limit` of
+/// `0` also scans 1000 blocks. The caller should repeat the call until the wallet has caught
+/// up with the cache.
+///
+/// Returns:
+/// - `-1` if the blocks formed a valid chain and were scanned.
+/// - the height of the lowest invalid block, if the combined chain is invalid. In this case
+///   the data database has not been modified.
+/// - `0` if there was an error unrelated to chain validity.
 ///
 /// # Safety
 ///
+/// - `fs_block_cache_root` must be non-null and valid for reads for `fs_block_cache_root_len`
+///   bytes, and it must have an alignment of `1`. Its contents must be a string representing a
+///   valid system path in the operating system's preferred representation.
+/// - The memory referenced by `fs_block_cache_root` must not be mutated for the duration of the
+///   function call.
+/// - The total size `fs_block_cache_root_len` must be no larger than `isize::MAX`. See the
+///   safety documentation of pointer::offset.
 /// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
 ///   alignment of `1`. Its contents must be a string representing a valid system path in the
 ///   operating system's preferred representation.
 /// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
 /// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
 ///   documentation of pointer::offset.
-/// - `txid_bytes` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
-///   alignment of `1`.
-/// - The memory referenced by `txid_bytes_len` must not be mutated for the duration of the function call.
-/// - The total size `txid_bytes_len` must be no larger than `isize::MAX`. See the safety
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_validate_and_scan_blocks(
+    fs_block_cache_root: *const u8,
+    fs_block_cache_root_len: usize,
+    db_data: *const u8,
+    db_data_len: usize,
+    scan_limit: u32,
+    network_id: u32,
+) -> i32 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let block_db = block_db(fs_block_cache_root, fs_block_cache_root_len)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
+        let db_read = unsafe { wallet_db(db_data, db_data_len, network)? };
+        let mut db_data = db_read.get_update_ops()?;
+        let limit = if scan_limit == 0 {
+            MAX_VALIDATE_AND_SCAN_BLOCKS
+        } else {
+            scan_limit.min(MAX_VALIDATE_AND_SCAN_BLOCKS)
+        };
+
+        let validate_from = db_read
+            .get_max_height_hash()
+            .map_err(|e| anyhow!("Error while validating chain: {}", e))?;
+
+        let mut blocks = vec![];
+        let read_res: Result<(), chain::error::Error<Infallible, _, Infallible>> = block_db
+            .with_blocks(
+                validate_from.map(|(height, _)| height),
+                Some(limit),
+                |block| {
+                    blocks.push(block);
+                    Ok(())
+                },
+            );
+        read_res.map_err(|e| anyhow!("Error while reading cached blocks: {}", e))?;
+
+        let mut prev = validate_from;
+        for block in &blocks {
+            if let Some((prev_height, prev_hash)) = prev {
+                if block.height() != prev_height + 1 {
+                    return Ok(u32::from(prev_height + 1) as i32);
+                }
+                if block.prev_hash() != prev_hash {
+                    return Ok(u32::from(block.height()) as i32);
+                }
+            }
+            prev = Some((block.height(), block.hash()));
+        }
+
+        scan_cached_blocks(
+            &network,
+            &MemoryBlockSource::new(blocks),
+            &mut db_data,
+            None,
+        )
+        .map_err(|e| anyhow!("Error while scanning blocks: {}", e))?;
+
+        checkpoints::record(&conn)
+            .map_err(|e| anyhow!("Error while recording scan checkpoints: {}", e))?;
+        refresh_derived_tables(&conn, &[])?;
+        mempool::reconcile(&network, db_path, &db_read)?;
+        Ok(-1)
+    });
+    unwrap_exc_or(res, 0)
+}
+
+/// Inserts a UTXO into the wallet database.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `txid_bytes` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`.
+/// - The memory referenced by `txid_bytes_len` must not be mutated for the duration of the function call.
+/// - The total size `txid_bytes_len` must be no larger than `isize::MAX`. See the safety
 ///   documentation of pointer::offset.
 /// - `script_bytes` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
 ///   alignment of `1`.
@@ -1963,22 +3041,8 @@ pub unsafe extern "C" fn piratelc_put_utxo(
         txid.copy_from_slice(txid_bytes);
 
         let script_bytes = unsafe { slice::from_raw_parts(script_bytes, script_bytes_len) };
-        let script_pubkey = legacy::Script(script_bytes.to_vec());
 
-        let output = WalletTransparentOutput::from_parts(
-            OutPoint::new(txid, index as u32),
-            TxOut {
-                value: Amount::from_i64(value).unwrap(),
-                script_pubkey,
-            },
-            BlockHeight::from(height as u32),
-        )
-        .ok_or_else(|| {
-            anyhow!(
-                "{:?} is not a valid P2PKH or P2SH script_pubkey",
-                script_bytes
-            )
-        })?;
+        let output = transparent_output(txid, index as u32, script_bytes, value, height as u32)?;
         match db_data.put_received_transparent_utxo(&output) {
             Ok(_) => Ok(true),
             Err(e) => Err(anyhow!("Error while inserting UTXO: {}", e)),
@@ -1987,6 +3051,100 @@ pub unsafe extern "C" fn piratelc_put_utxo(
     unwrap_exc_or(res, false)
 }
 
+fn transparent_output(
+    txid: [u8; 32],
+    index: u32,
+    script_bytes: &[u8],
+    value: i64,
+    height: u32,
+) -> anyhow::Result<WalletTransparentOutput> {
+    WalletTransparentOutput::from_parts(
+        OutPoint::new(txid, index),
+        TxOut {
+            value: Amount::from_i64(value).map_err(|()| anyhow!("Invalid amount, out of range"))?,
+            script_pubkey: legacy::Script(script_bytes.to_vec()),
+        },
+        BlockHeight::from(height),
+    )
+    .ok_or_else(|| {
+        anyhow!(
+            "{:?} is not a valid P2PKH or P2SH script_pubkey",
+            script_bytes
+        )
+    })
+}
+
+/// A transparent output received by the wallet, as passed to [`piratelc_put_utxos`].
+///
+/// # Safety
+///
+/// - `script_bytes` must be non-null and valid for reads for `script_bytes_len` bytes, and it
+///   must have an alignment of `1`.
+#[repr(C)]
+pub struct FFIUtxo {
+    txid: [u8; 32],
+    index: u32,
+    script_bytes: *const u8,
+    script_bytes_len: usize,
+    value: i64,
+    height: u32,
+}
+
+/// Inserts a batch of UTXOs into the wallet database, in a single database transaction.
+///
+/// UTXOs whose outpoint is already known to the wallet are updated in place. If any of the
+/// UTXOs is invalid, none of them are inserted.
+///
+/// Returns the number of UTXOs that were inserted or updated, or -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `utxos` must be non-null and valid for reads for `utxos_len * sizeof(FFIUtxo)` bytes. It
+///   must point to an array of `FFIUtxo` values. See the safety documentation of [`FFIUtxo`].
+/// - The memory referenced by `utxos` must not be mutated for the duration of the function call.
+/// - The total size `utxos_len * sizeof(FFIUtxo)` must be no larger than `isize::MAX`. See the
+///   safety documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_put_utxos(
+    db_data: *const u8,
+    db_data_len: usize,
+    utxos: *const FFIUtxo,
+    utxos_len: usize,
+    network_id: u32,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
+        let mut db_data = db_data.get_update_ops()?;
+
+        let utxos = unsafe { slice::from_raw_parts(utxos, utxos_len) };
+        let outputs = utxos
+            .iter()
+            .map(|utxo| {
+                let script_bytes =
+                    unsafe { slice::from_raw_parts(utxo.script_bytes, utxo.script_bytes_len) };
+                transparent_output(utxo.txid, utxo.index, script_bytes, utxo.value, utxo.height)
+            })
+            .collect::<anyhow::Result<Vec<_>>>()?;
+
+        db_data
+            .transactionally(|up| {
+                for output in &outputs {
+                    up.put_received_transparent_utxo(output)?;
+                }
+                Ok(outputs.len() as i64)
+            })
+            .map_err(|e| anyhow!("Error while inserting UTXOs: {}", e))
+    });
+    unwrap_exc_or(res, -1)
+}
+
 //
 // FsBlock Interfaces
 //
@@ -2020,6 +3178,8 @@ pub struct FFIBlockMeta {
     block_time: u32,
     sapling_outputs_count: u32,
     orchard_actions_count: u32,
+    prev_hash_ptr: *mut u8,
+    prev_hash_ptr_len: usize,
 }
 
 /// # Safety
@@ -2039,8 +3199,12 @@ pub unsafe extern "C" fn piratelc_init_block_metadata_db(
     fs_block_db_root_len: usize,
 ) -> bool {
     let res = catch_panic(|| {
+        let fs_block_db_root_path = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(fs_block_db_root, fs_block_db_root_len)
+        }));
         let mut block_db = block_db(fs_block_db_root, fs_block_db_root_len)?;
 
+        hash_chain::clear(fs_block_db_root_path);
         match init_blockmeta_db(&mut block_db) {
             Ok(()) => Ok(true),
             Err(e) => Err(anyhow!("Error while initializing block metadata DB: {}", e)),
@@ -2051,6 +3215,10 @@ pub unsafe extern "C" fn piratelc_init_block_metadata_db(
 
 /// Writes the blocks provided in `blocks_meta` into the `BlockMeta` database
 ///
+/// The hashes of the written blocks and the parent hashes given in `prev_hash_ptr` are also
+/// recorded in the in-memory index used by [`piratelc_validate_combined_chain`]. Blocks whose
+/// `prev_hash_ptr` is null are left out of the index, and are validated by reading the cache.
+///
 /// Returns true if the `blocks_meta` could be stored into the `FsBlockDb`. False
 /// otherwise.
 ///
@@ -2067,6 +3235,8 @@ pub unsafe extern "C" fn piratelc_init_block_metadata_db(
 /// - Block metadata represented in `blocks_meta` must be non-null. Caller must guarantee that the
 /// memory reference by this pointer is not freed up, dereferenced or invalidated while this function
 /// is invoked.
+/// - The `prev_hash_ptr` of each block must either be null, or be valid for reads for
+///   `prev_hash_ptr_len` bytes.
 #[no_mangle]
 pub unsafe extern "C" fn piratelc_write_block_metadata(
     fs_block_db_root: *const u8,
@@ -2074,6 +3244,9 @@ pub unsafe extern "C" fn piratelc_write_block_metadata(
     blocks_meta: *mut FFIBlocksMeta,
 ) -> bool {
     let res = catch_panic(|| {
+        let fs_block_db_root_path = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(fs_block_db_root, fs_block_db_root_len)
+        }));
         let block_db = block_db(fs_block_db_root, fs_block_db_root_len)?;
 
         let blocks_meta: Box<FFIBlocksMeta> = unsafe { Box::from_raw(blocks_meta) };
@@ -2082,6 +3255,7 @@ pub unsafe extern "C" fn piratelc_write_block_metadata(
             unsafe { slice::from_raw_parts_mut(blocks_meta.ptr, blocks_meta.len) };
 
         let mut blocks = Vec::with_capacity(blocks_metadata_slice.len());
+        let mut links = Vec::with_capacity(blocks_metadata_slice.len());
 
         for b in blocks_metadata_slice {
             let block_hash_bytes =
@@ -2089,6 +3263,16 @@ pub unsafe extern "C" fn piratelc_write_block_metadata(
             let mut hash = [0u8; 32];
             hash.copy_from_slice(block_hash_bytes);
 
+            let prev_hash = if b.prev_hash_ptr.is_null() {
+                None
+            } else {
+                <[u8; 32]>::try_from(unsafe {
+                    slice::from_raw_parts(b.prev_hash_ptr, b.prev_hash_ptr_len)
+                })
+                .ok()
+            };
+            links.push((b.height, hash, prev_hash));
+
             blocks.push(BlockMeta {
                 height: BlockHeight::from_u32(b.height),
                 block_hash: BlockHash(hash),
@@ -2099,7 +3283,10 @@ pub unsafe extern "C" fn piratelc_write_block_metadata(
         }
 
         match block_db.write_block_metadata(&blocks) {
-            Ok(()) => Ok(true),
+            Ok(()) => {
+                hash_chain::record_blocks(fs_block_db_root_path, links);
+                Ok(true)
+            }
             Err(e) => Err(anyhow!(
                 "Failed to write block metadata to FsBlockDb: {:?}",
                 e
@@ -2129,8 +3316,12 @@ pub unsafe extern "C" fn piratelc_rewind_fs_block_cache_to_height(
     height: i32,
 ) -> bool {
     let res = catch_panic(|| {
+        let fs_block_db_root_path = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(fs_block_db_root, fs_block_db_root_len)
+        }));
         let block_db = block_db(fs_block_db_root, fs_block_db_root_len)?;
         let height = BlockHeight::try_from(height)?;
+        hash_chain::clear(fs_block_db_root_path);
         block_db
             .truncate_to_height(height)
             .map(|_| true)
@@ -2203,6 +3394,7 @@ pub unsafe extern "C" fn piratelc_decrypt_and_store_transaction(
 ) -> i32 {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
         let db_read = unsafe { wallet_db(db_data, db_data_len, network)? };
         let mut db_data = db_read.get_update_ops()?;
         let tx_bytes = unsafe { slice::from_raw_parts(tx, tx_len) };
@@ -2215,22 +3407,28 @@ pub unsafe extern "C" fn piratelc_decrypt_and_store_transaction(
         //   from their encoding.
         let tx = Transaction::read(tx_bytes, BranchId::Sapling)?;
 
-        match decrypt_and_store_transaction(&network, &mut db_data, &tx) {
-            Ok(()) => Ok(1),
-            Err(e) => Err(anyhow!("Error while decrypting transaction: {}", e)),
-        }
+        decrypt_and_store_transaction(&network, &mut db_data, &tx)
+            .map_err(|e| anyhow!("Error while decrypting transaction: {}", e))?;
+        refresh_derived_tables(&conn, &[*tx.txid().as_ref()])?;
+        Ok(1)
     });
     unwrap_exc_or(res, -1)
 }
 
-/// Creates a transaction paying the specified address from the given account.
+/// Decrypts whatever parts of the specified transactions it can and stores them in db_data.
 ///
-/// Returns the row index of the newly-created transaction in the `transactions` table
-/// within the data database. The caller can read the raw transaction bytes from the `raw`
-/// column in order to broadcast the transaction to the network.
+/// `txs` holds the raw transactions back to back, each preceded by its length in bytes as a
+/// little-endian `u32`. The transactions are parsed and trial-decrypted in parallel on the
+/// Rayon thread pool, and the results are then stored using a single wallet connection. If
+/// any transaction fails to parse, nothing is stored.
 ///
-/// Do not call this multiple times in parallel, or you will generate transactions that
-/// double-spend the same notes.
+/// The upstream `store_decrypted_tx` commits each transaction in its own database
+/// transaction, and cannot be nested in an outer one, so the results are not stored
+/// atomically: if storing a transaction fails, the transactions before it in `txs` remain
+/// stored (and the derived tables are refreshed for them), and -1 is returned. Storing a
+/// transaction again updates it in place, so the call can simply be repeated.
+///
+/// Returns the number of transactions stored, or -1 if an error occurred.
 ///
 /// # Safety
 ///
@@ -2240,163 +3438,161 @@ pub unsafe extern "C" fn piratelc_decrypt_and_store_transaction(
 /// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
 /// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
 ///   documentation of pointer::offset.
-/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
-///   spending key encoded as returned from the `piratelc_create_account` or
-///   `piratelc_derive_spending_key` functions.
-/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
-/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
-///   of pointer::offset.
-/// - `to` must be non-null and must point to a null-terminated UTF-8 string.
-/// - `memo` must either be null (indicating an empty memo or a transparent recipient) or point to a
-///    512-byte array.
-/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
-///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
-/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
-/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
-///   documentation of pointer::offset.
-/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
-///   alignment of `1`. Its contents must be the Sapling output proving parameters.
-/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
-/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+/// - `txs` must be non-null and valid for reads for `txs_len` bytes, and it must have an
+///   alignment of `1`.
+/// - The memory referenced by `txs` must not be mutated for the duration of the function call.
+/// - The total size `txs_len` must be no larger than `isize::MAX`. See the safety
 ///   documentation of pointer::offset.
 #[no_mangle]
-pub unsafe extern "C" fn piratelc_create_to_address(
+pub unsafe extern "C" fn piratelc_decrypt_and_store_transactions(
     db_data: *const u8,
     db_data_len: usize,
-    usk_ptr: *const u8,
-    usk_len: usize,
-    to: *const c_char,
-    value: i64,
-    memo: *const u8,
-    spend_params: *const u8,
-    spend_params_len: usize,
-    output_params: *const u8,
-    output_params_len: usize,
+    txs: *const u8,
+    txs_len: usize,
     network_id: u32,
-    min_confirmations: u32,
-    use_zip317_fees: bool,
-) -> i64 {
+) -> i32 {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
+        let conn = unsafe { wallet_conn(db_data, db_data_len)? };
         let db_read = unsafe { wallet_db(db_data, db_data_len, network)? };
         let mut db_data = db_read.get_update_ops()?;
+        let txs_bytes = unsafe { slice::from_raw_parts(txs, txs_len) };
+
+        // See `piratelc_decrypt_and_store_transaction` regarding the consensus branch ID.
+        let txs = split_length_prefixed(txs_bytes)?
+            .into_par_iter()
+            .map(|tx_bytes| Transaction::read(tx_bytes, BranchId::Sapling))
+            .collect::<Result<Vec<_>, _>>()?;
+
+        let ufvks = db_read
+            .get_unified_full_viewing_keys()
+            .map_err(|e| anyhow!("Error while fetching unified full viewing keys: {}", e))?;
+
+        // Unmined transactions are decrypted at the height of the next block, as in
+        // `decrypt_and_store_transaction`.
+        let mempool_height = db_read
+            .block_height_extrema()
+            .map_err(|e| anyhow!("Error while fetching max block height: {}", e))?
+            .map(|(_, max_height)| max_height + 1)
+            .or_else(|| network.activation_height(NetworkUpgrade::Sapling))
+            .ok_or_else(|| anyhow!("Sapling activation height must be known."))?;
+        let heights = txs
+            .iter()
+            .map(|tx| {
+                db_read
+                    .get_tx_height(tx.txid())
+                    .map(|height| height.unwrap_or(mempool_height))
+                    .map_err(|e| anyhow!("Error while fetching transaction height: {}", e))
+            })
+            .collect::<anyhow::Result<Vec<_>>>()?;
 
-        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
-        let to = unsafe { CStr::from_ptr(to) }.to_str()?;
-        let value =
-            Amount::from_i64(value).map_err(|()| anyhow!("Invalid amount, out of range"))?;
-        if value.is_negative() {
-            return Err(anyhow!("Amount is negative"));
-        }
-        let spend_params = Path::new(OsStr::from_bytes(unsafe {
-            slice::from_raw_parts(spend_params, spend_params_len)
-        }));
-        let output_params = Path::new(OsStr::from_bytes(unsafe {
-            slice::from_raw_parts(output_params, output_params_len)
-        }));
+        let sapling_outputs: Vec<_> = txs
+            .par_iter()
+            .zip(heights.par_iter())
+            .map(|(tx, height)| decrypt_transaction(&network, *height, tx, &ufvks))
+            .collect();
 
-        let to = RecipientAddress::decode(&network, to)
-            .ok_or_else(|| anyhow!("PaymentAddress is for the wrong network"))?;
-
-        let memo = match to {
-            RecipientAddress::Shielded(_) | RecipientAddress::Unified(_) => {
-                if memo.is_null() {
-                    Ok(None)
-                } else {
-                    MemoBytes::from_bytes(unsafe { slice::from_raw_parts(memo, 512) })
-                        .map(Some)
-                        .map_err(|e| anyhow!("Invalid MemoBytes: {}", e))
+        let mut txids: Vec<[u8; 32]> = Vec::with_capacity(txs.len());
+        let mut failure = None;
+        for (tx, sapling_outputs) in txs.iter().zip(sapling_outputs.iter()) {
+            match db_data.store_decrypted_tx(&DecryptedTransaction {
+                tx,
+                sapling_outputs,
+            }) {
+                Ok(_) => txids.push(*tx.txid().as_ref()),
+                Err(e) => {
+                    failure = Some(anyhow!(
+                        "Error while storing decrypted transaction {}: {}",
+                        tx.txid(),
+                        e
+                    ));
+                    break;
                 }
             }
-            RecipientAddress::Transparent(_) => {
-                if memo.is_null() {
-                    Ok(None)
-                } else {
-                    Err(anyhow!(
-                        "Memos are not permitted when sending to transparent recipients."
-                    ))
-                }
-            }
-        }?;
-
-        let prover = LocalTxProver::new(spend_params, output_params);
-
-        let req = TransactionRequest::new(vec![Payment {
-            recipient_address: to,
-            amount: value,
-            memo,
-            label: None,
-            message: None,
-            other_params: vec![],
-        }])
-        .map_err(|e| anyhow!("Error creating transaction request: {:?}", e))?;
-
-        if use_zip317_fees {
-            let input_selector = GreedyInputSelector::new(
-                zip317::SingleOutputChangeStrategy::new(Zip317FeeRule::standard()),
-                DustOutputPolicy::default(),
-            );
-
-            spend(
-                &mut db_data,
-                &network,
-                prover,
-                &input_selector,
-                &usk,
-                req,
-                OvkPolicy::Sender,
-                min_confirmations,
-            )
-            .map_err(|e| anyhow!("Error while sending funds: {}", e))
-        } else {
-            let input_selector = GreedyInputSelector::new(
-                fixed::SingleOutputChangeStrategy::new(FixedFeeRule::standard()),
-                DustOutputPolicy::default(),
-            );
+        }
+        refresh_derived_tables(&conn, &txids)?;
 
-            spend(
-                &mut db_data,
-                &network,
-                prover,
-                &input_selector,
-                &usk,
-                req,
-                OvkPolicy::Sender,
-                min_confirmations,
-            )
-            .map_err(|e| anyhow!("Error while sending funds: {}", e))
+        match failure {
+            Some(e) => Err(e),
+            None => Ok(txids.len() as i32),
         }
     });
     unwrap_exc_or(res, -1)
 }
 
+/// Trial-decrypts a transaction from the mempool with the viewing keys of the wallet's
+/// accounts, without writing to the data database.
+///
+/// If any of the transaction's outputs can be decrypted, they are kept in an in-memory cache
+/// that can be read with [`piratelc_mempool_get_outputs`], until the transaction is mined
+/// and scanned by [`piratelc_scan_blocks`] or [`piratelc_validate_and_scan_blocks`], or until
+/// the scanned chain passes its expiry height. At most 256 pending transactions are kept per
+/// wallet; beyond that, the oldest are dropped.
+/// Adding a transaction that is already cached does not decrypt it again.
+///
+/// Returns the number of outputs that could be decrypted, or -1 if an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `tx` must be non-null and valid for reads for `tx_len` bytes, and it must have an
+///   alignment of `1`.
+/// - The memory referenced by `tx` must not be mutated for the duration of the function call.
+/// - The total size `tx_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
 #[no_mangle]
-pub extern "C" fn piratelc_branch_id_for_height(height: i32, network_id: u32) -> i32 {
+pub unsafe extern "C" fn piratelc_mempool_add_transaction(
+    db_data: *const u8,
+    db_data_len: usize,
+    tx: *const u8,
+    tx_len: usize,
+    network_id: u32,
+) -> i32 {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
-        let branch: BranchId = BranchId::for_height(&network, BlockHeight::from(height as u32));
-        let branch_id: u32 = u32::from(branch);
-        Ok(branch_id as i32)
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let tx_bytes = unsafe { slice::from_raw_parts(tx, tx_len) };
+
+        // See `piratelc_decrypt_and_store_transaction` regarding the consensus branch ID.
+        let tx = Transaction::read(tx_bytes, BranchId::Sapling)?;
+
+        let decrypted = mempool::ingest(
+            &network,
+            db_path,
+            || unsafe { wallet_db(db_data, db_data_len, network) },
+            &tx,
+        )?;
+        Ok(decrypted as i32)
     });
     unwrap_exc_or(res, -1)
 }
 
-/// Frees strings returned by other piratelc functions.
-///
-/// # Safety
+/// A wallet output of an unmined transaction, as returned by [`piratelc_mempool_get_outputs`].
 ///
-/// - `s` should be a non-null pointer returned as a string by another piratelc function.
-#[no_mangle]
-#[allow(clippy::not_unsafe_ptr_arg_deref)]
-pub unsafe extern "C" fn piratelc_string_free(s: *mut c_char) {
-    if !s.is_null() {
-        let s = unsafe { CString::from_raw(s) };
-        drop(s);
-    }
+/// `transfer_type` is `0` for a payment received from outside the wallet, `1` for a transfer
+/// between the wallet's own addresses (including change), and `2` for a payment sent by the
+/// wallet to an external recipient.
+#[repr(C)]
+pub struct FFIPendingOutput {
+    txid: [u8; 32],
+    account_id: u32,
+    output_index: u32,
+    value: i64,
+    transfer_type: u32,
+    memo: [u8; 512],
 }
 
-/// Shield transparent UTXOs by sending them to an address associated with the specified Sapling
-/// spending key.
+/// Copies the wallet outputs of the cached mempool transactions (see
+/// [`piratelc_mempool_add_transaction`]) into `outputs`, in the order in which the
+/// transactions were added.
+///
+/// Returns the total number of cached outputs, which may be larger than `outputs_len`; in
+/// that case only the first `outputs_len` outputs are copied. Returns -1 if an error occurred.
 ///
 /// # Safety
 ///
@@ -2406,29 +3602,1311 @@ pub unsafe extern "C" fn piratelc_string_free(s: *mut c_char) {
 /// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
 /// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
 ///   documentation of pointer::offset.
-/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
-///   spending key encoded as returned from the `piratelc_create_account` or
-///   `piratelc_derive_spending_key` functions.
-/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
-/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
-/// - `memo` must either be null (indicating an empty memo) or point to a 512-byte array.
-/// - `shielding_threshold` a non-negative shielding threshold amount in zatoshi
-/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
-///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
-/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
-/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
-///   documentation of pointer::offset.
-/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+/// - `outputs` must be non-null and valid for writes for `outputs_len *
+///   mem::size_of::<FFIPendingOutput>()` bytes, and it must be properly aligned.
+/// - The total size `outputs_len * mem::size_of::<FFIPendingOutput>()` must be no larger than
+///   `isize::MAX`. See the safety documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_mempool_get_outputs(
+    db_data: *const u8,
+    db_data_len: usize,
+    outputs: *mut FFIPendingOutput,
+    outputs_len: usize,
+) -> i64 {
+    let res = catch_panic(|| {
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let outputs = unsafe { slice::from_raw_parts_mut(outputs, outputs_len) };
+
+        let mut count = 0;
+        mempool::with_pending_outputs(db_path, |output| {
+            if let Some(slot) = outputs.get_mut(count) {
+                *slot = FFIPendingOutput {
+                    txid: *output.txid.as_ref(),
+                    account_id: u32::from(output.account),
+                    output_index: output.output_index as u32,
+                    value: output.value as i64,
+                    transfer_type: match output.transfer_type {
+                        TransferType::Incoming => 0,
+                        TransferType::WalletInternal => 1,
+                        TransferType::Outgoing => 2,
+                    },
+                    memo: output.memo,
+                };
+            }
+            count += 1;
+        });
+        Ok(count as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Splits a buffer of items that are each preceded by their length as a little-endian `u32`.
+fn split_length_prefixed(mut buf: &[u8]) -> anyhow::Result<Vec<&[u8]>> {
+    let mut items = vec![];
+    while !buf.is_empty() {
+        if buf.len() < 4 {
+            return Err(anyhow!("Buffer ends within a length prefix"));
+        }
+        let (len, rest) = buf.split_at(4);
+        let len = u32::from_le_bytes(len.try_into().unwrap()) as usize;
+        if rest.len() < len {
+            return Err(anyhow!("Buffer ends within an item of length {}", len));
+        }
+        let (item, rest) = rest.split_at(len);
+        items.push(item);
+        buf = rest;
+    }
+    Ok(items)
+}
+
+/// Decodes a note selection strategy passed over the FFI, as documented on
+/// [`piratelc_select_notes`].
+fn parse_strategy(strategy: u32) -> anyhow::Result<note_index::Strategy> {
+    match strategy {
+        0 => Ok(note_index::Strategy::LargestFirst),
+        1 => Ok(note_index::Strategy::SmallestFirst { min_value: 0 }),
+        2 => Ok(note_index::Strategy::OldestFirst),
+        _ => Err(anyhow!("Invalid note selection strategy: {}", strategy)),
+    }
+}
+
+/// Plans which notes of `account` would fund a payment of `value` zatoshis to `outputs`
+/// Sapling recipients, using an in-memory index of the wallet's spendable notes that is kept
+/// up to date from the wallet events.
+///
+/// `strategy` selects the order in which notes are considered:
+///
+/// - `0`: largest notes first, which minimises the number of inputs, and therefore both the
+///   fee under ZIP 317 and the proving time.
+/// - `1`: smallest notes first, which consolidates small notes.
+/// - `2`: notes in the order they were received.
+///
+/// The fee is computed under the ZIP 317 fee rule if `use_zip317_fees` is set, and under the
+/// fixed fee rule otherwise, counting a change output when one is needed. Only notes mined at
+/// or below the anchor height for `min_confirmations`, and with a witness at that height, are
+/// considered.
+///
+/// The row indices of the selected notes in the `received_notes` table are copied into
+/// `note_ids`, and the fee and change are written to `fee_ret` and `change_ret`. Returns the
+/// number of selected notes, which may be larger than `note_ids_len`; in that case only the
+/// first `note_ids_len` note IDs are copied. Returns -1 if the account's spendable notes are
+/// insufficient or an error occurred.
+///
+/// The create calls take a strategy with the same values, and select their inputs from the
+/// same index in that order, through the upstream greedy input selector. The shield calls take
+/// it as well, but as shielding transactions spend only transparent outputs, it does not
+/// change them.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `note_ids` must be non-null and valid for writes for `note_ids_len * mem::size_of::<i64>()`
+///   bytes, and it must be properly aligned.
+/// - The total size `note_ids_len * mem::size_of::<i64>()` must be no larger than `isize::MAX`.
+///   See the safety documentation of pointer::offset.
+/// - `fee_ret` and `change_ret` must be non-null and valid for writes of an `i64`.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_select_notes(
+    db_data: *const u8,
+    db_data_len: usize,
+    account: i32,
+    network_id: u32,
+    value: i64,
+    outputs: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+    note_ids: *mut i64,
+    note_ids_len: usize,
+    fee_ret: *mut i64,
+    change_ret: *mut i64,
+) -> i64 {
+    let res = catch_panic(|| {
+        parse_network(network_id)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let conn =
+            wallet_ext::open(db_path).map_err(|e| anyhow!("Error while opening data DB: {}", e))?;
+        let note_ids_ret = unsafe { slice::from_raw_parts_mut(note_ids, note_ids_len) };
+
+        let account =
+            u32::try_from(account).map_err(|_| anyhow!("account argument must be positive"))?;
+        let value = u64::try_from(value).map_err(|_| anyhow!("value must be non-negative"))?;
+        let strategy = parse_strategy(strategy)?;
+
+        let index = note_index::get(&conn, db_path)
+            .map_err(|e| anyhow!("Error while indexing spendable notes: {}", e))?;
+        let anchor_height = index
+            .anchor_height(min_confirmations)
+            .ok_or_else(|| anyhow!("Anchor height not available; scan required."))?;
+        let selection = note_index::select(
+            index.spendable_notes(account, anchor_height),
+            value,
+            note_index::Outputs {
+                sapling: outputs as usize,
+                transparent: 0,
+            },
+            note_index::FeeModel::standard(use_zip317_fees),
+            strategy,
+        )
+        .ok_or_else(|| anyhow!("Insufficient spendable notes for account {}", account))?;
+
+        for (slot, id_note) in note_ids_ret.iter_mut().zip(selection.note_ids.iter()) {
+            *slot = *id_note;
+        }
+        unsafe {
+            *fee_ret = selection.fee as i64;
+            *change_ret = selection.change as i64;
+        }
+        Ok(selection.note_ids.len() as i64)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// The outcome of planning a transaction, as returned by [`piratelc_estimate_transfer`].
+///
+/// - `fee` is the fee in zatoshis.
+/// - `selected_notes` is the number of notes that fund the transaction.
+/// - `change` is the value of the change output in zatoshis, or `0` if there is none.
+/// - `proving_time_ms` is a rough estimate of how long proving the transaction takes, in
+///   milliseconds.
+#[repr(C)]
+pub struct FFITransferEstimate {
+    fee: i64,
+    selected_notes: u32,
+    change: i64,
+    proving_time_ms: u64,
+}
+
+/// Plans a transaction paying each of the specified payments from the given account, without
+/// creating proofs or writing to the data database, and writes the outcome to `estimate_ret`.
+///
+/// Notes are selected in the order that [`piratelc_create_to_addresses`] considers them for
+/// `strategy` (see [`piratelc_select_notes`]), from an in-memory index of the wallet's spendable notes (see [`piratelc_select_notes`]), and the
+/// fee is computed under the ZIP 317 fee rule if `use_zip317_fees` is set, and under the fixed
+/// fee rule otherwise. This is cheap enough to call whenever the payments are edited.
+///
+/// The estimate is approximate. The create calls run the upstream greedy input selector,
+/// which may settle on a different number of notes when adding a note changes the fee, and
+/// which applies its own dust policy to the change. The proving time is derived from the
+/// per-proof times set with [`piratelc_set_proof_times`].
+///
+/// Returns `false` if the account's spendable notes are insufficient or an error occurred.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `payments` must be non-null and valid for reads for `payments_len *
+///   mem::size_of::<FFIPayment>()` bytes, and it must be properly aligned. Each entry must
+///   satisfy the safety requirements of [`FFIPayment`].
+/// - The memory referenced by `payments` must not be mutated for the duration of the function
+///   call.
+/// - The total size `payments_len * mem::size_of::<FFIPayment>()` must be no larger than
+///   `isize::MAX`. See the safety documentation of pointer::offset.
+/// - `estimate_ret` must be non-null and valid for writes of an `FFITransferEstimate`.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_estimate_transfer(
+    db_data: *const u8,
+    db_data_len: usize,
+    account: i32,
+    network_id: u32,
+    payments: *const FFIPayment,
+    payments_len: usize,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+    estimate_ret: *mut FFITransferEstimate,
+) -> bool {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let strategy = parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let conn =
+            wallet_ext::open(db_path).map_err(|e| anyhow!("Error while opening data DB: {}", e))?;
+        let payments = unsafe { slice::from_raw_parts(payments, payments_len) };
+
+        let account =
+            u32::try_from(account).map_err(|_| anyhow!("account argument must be positive"))?;
+
+        let mut amount = 0u64;
+        let mut outputs = note_index::Outputs {
+            sapling: 0,
+            transparent: 0,
+        };
+        for payment in payments {
+            let payment =
+                unsafe { decode_payment(&network, payment.to, payment.value, payment.memo)? };
+            amount = amount
+                .checked_add(i64::from(payment.amount) as u64)
+                .ok_or_else(|| anyhow!("Total payment amount overflows"))?;
+            match payment.recipient_address {
+                RecipientAddress::Transparent(_) => outputs.transparent += 1,
+                RecipientAddress::Shielded(_) | RecipientAddress::Unified(_) => {
+                    outputs.sapling += 1
+                }
+            }
+        }
+
+        let index = note_index::get(&conn, db_path)
+            .map_err(|e| anyhow!("Error while indexing spendable notes: {}", e))?;
+        let anchor_height = index
+            .anchor_height(min_confirmations)
+            .ok_or_else(|| anyhow!("Anchor height not available; scan required."))?;
+        let selection = note_index::select(
+            index.spendable_notes(account, anchor_height),
+            amount,
+            outputs,
+            note_index::FeeModel::standard(use_zip317_fees),
+            strategy,
+        )
+        .ok_or_else(|| anyhow!("Insufficient spendable notes for account {}", account))?;
+
+        let change_outputs = usize::from(selection.change > 0);
+        let proving_time =
+            proving::estimate_time(selection.note_ids.len(), outputs.sapling + change_outputs);
+        unsafe {
+            *estimate_ret = FFITransferEstimate {
+                fee: selection.fee as i64,
+                selected_notes: selection.note_ids.len() as u32,
+                change: selection.change as i64,
+                proving_time_ms: proving_time.as_millis() as u64,
+            };
+        }
+        Ok(true)
+    });
+    unwrap_exc_or(res, false)
+}
+
+/// Creates a transaction paying the specified address from the given account.
+///
+/// Notes are selected from the note index used by [`piratelc_select_notes`], in the order given
+/// by `strategy`, which takes the same values as for that function.
+///
+/// Returns the row index of the newly-created transaction in the `transactions` table
+/// within the data database. The caller can read the raw transaction bytes from the `raw`
+/// column in order to broadcast the transaction to the network.
+///
+/// Do not call this multiple times in parallel, or you will generate transactions that
+/// double-spend the same notes.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
+///   spending key encoded as returned from the `piratelc_create_account` or
+///   `piratelc_derive_spending_key` functions.
+/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
+/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
+///   of pointer::offset.
+/// - `to` must be non-null and must point to a null-terminated UTF-8 string.
+/// - `memo` must either be null (indicating an empty memo or a transparent recipient) or point to a
+///    512-byte array.
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling output proving parameters.
+/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
+/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_create_to_address(
+    db_data: *const u8,
+    db_data_len: usize,
+    usk_ptr: *const u8,
+    usk_len: usize,
+    to: *const c_char,
+    value: i64,
+    memo: *const u8,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let strategy = parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+
+        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+        let payment = unsafe { decode_payment(&network, to, value, memo) }?;
+        let spend_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        let req = TransactionRequest::new(vec![payment])
+            .map_err(|e| anyhow!("Error creating transaction request: {:?}", e))?;
+
+        spend_request(
+            db_path,
+            network,
+            &usk,
+            req,
+            &LocalTxProver::new(spend_params, output_params),
+            min_confirmations,
+            use_zip317_fees,
+            strategy,
+            None,
+        )
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Decodes a payment of `value` zatoshis to the address `to`, with an optional memo, as passed
+/// to [`piratelc_create_to_address`].
+///
+/// # Safety
+///
+/// - `to` must be non-null and must point to a null-terminated UTF-8 string.
+/// - `memo` must either be null (indicating an empty memo or a transparent recipient) or point to a
+///    512-byte array.
+unsafe fn decode_payment(
+    network: &Network,
+    to: *const c_char,
+    value: i64,
+    memo: *const u8,
+) -> anyhow::Result<Payment> {
+    let to = unsafe { CStr::from_ptr(to) }.to_str()?;
+    let value = Amount::from_i64(value).map_err(|()| anyhow!("Invalid amount, out of range"))?;
+    if value.is_negative() {
+        return Err(anyhow!("Amount is negative"));
+    }
+
+    let to = RecipientAddress::decode(network, to)
+        .ok_or_else(|| anyhow!("PaymentAddress is for the wrong network"))?;
+
+    let memo = match to {
+        RecipientAddress::Shielded(_) | RecipientAddress::Unified(_) => {
+            if memo.is_null() {
+                Ok(None)
+            } else {
+                MemoBytes::from_bytes(unsafe { slice::from_raw_parts(memo, 512) })
+                    .map(Some)
+                    .map_err(|e| anyhow!("Invalid MemoBytes: {}", e))
+            }
+        }
+        RecipientAddress::Transparent(_) => {
+            if memo.is_null() {
+                Ok(None)
+            } else {
+                Err(anyhow!(
+                    "Memos are not permitted when sending to transparent recipients."
+                ))
+            }
+        }
+    }?;
+
+    Ok(Payment {
+        recipient_address: to,
+        amount: value,
+        memo,
+        label: None,
+        message: None,
+        other_params: vec![],
+    })
+}
+
+/// A payment, as passed to [`piratelc_create_to_addresses`].
+///
+/// # Safety
+///
+/// - `to` must be non-null and must point to a null-terminated UTF-8 string.
+/// - `memo` must either be null (indicating an empty memo or a transparent recipient) or point to a
+///    512-byte array.
+#[repr(C)]
+pub struct FFIPayment {
+    to: *const c_char,
+    value: i64,
+    memo: *const u8,
+}
+
+/// Creates a single transaction paying each of the specified addresses from the given account.
+///
+/// This behaves as [`piratelc_create_to_address`], except that all payments are made by one
+/// transaction, which is proven once and pays one fee.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
+///   spending key encoded as returned from the `piratelc_create_account` or
+///   `piratelc_derive_spending_key` functions.
+/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
+/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
+///   of pointer::offset.
+/// - `payments` must be non-null and valid for reads for `payments_len *
+///   mem::size_of::<FFIPayment>()` bytes, and it must be properly aligned. See the safety
+///   documentation of [`FFIPayment`].
+/// - The memory referenced by `payments` must not be mutated for the duration of the function
+///   call.
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling output proving parameters.
+/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
+/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_create_to_addresses(
+    db_data: *const u8,
+    db_data_len: usize,
+    usk_ptr: *const u8,
+    usk_len: usize,
+    payments: *const FFIPayment,
+    payments_len: usize,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let strategy = parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+
+        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+        let payments = unsafe { slice::from_raw_parts(payments, payments_len) }
+            .iter()
+            .map(|p| unsafe { decode_payment(&network, p.to, p.value, p.memo) })
+            .collect::<anyhow::Result<Vec<_>>>()?;
+        let spend_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        let req = TransactionRequest::new(payments)
+            .map_err(|e| anyhow!("Error creating transaction request: {:?}", e))?;
+
+        spend_request(
+            db_path,
+            network,
+            &usk,
+            req,
+            &LocalTxProver::new(spend_params, output_params),
+            min_confirmations,
+            use_zip317_fees,
+            strategy,
+            None,
+        )
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Creates a transaction paying the [ZIP 321] payment request `uri` from the given account.
+///
+/// This behaves as [`piratelc_create_to_address`], except that all payments of the request are
+/// made by one transaction.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
+///   spending key encoded as returned from the `piratelc_create_account` or
+///   `piratelc_derive_spending_key` functions.
+/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
+/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
+///   of pointer::offset.
+/// - `uri` must be non-null and must point to a null-terminated UTF-8 string.
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling output proving parameters.
+/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
+/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+///
+/// [ZIP 321]: https://zips.z.cash/zip-0321
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_create_from_zip321_uri(
+    db_data: *const u8,
+    db_data_len: usize,
+    usk_ptr: *const u8,
+    usk_len: usize,
+    uri: *const c_char,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let strategy = parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+
+        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+        let uri = unsafe { CStr::from_ptr(uri) }.to_str()?;
+        let spend_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        let req = TransactionRequest::from_uri(&network, uri)
+            .map_err(|e| anyhow!("Error parsing payment request: {:?}", e))?;
+
+        spend_request(
+            db_path,
+            network,
+            &usk,
+            req,
+            &LocalTxProver::new(spend_params, output_params),
+            min_confirmations,
+            use_zip317_fees,
+            strategy,
+            None,
+        )
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// A unified spending key, as returned by [`piratelc_open_spending_key`].
+///
+/// The handle holds the encoded key in a [`SecretVec`], which overwrites it with zeros when
+/// the handle is closed, and decodes it only to sign a transaction. The decoded key owns heap
+/// memory that is not erased when it is dropped (the chain code of its transparent key, among
+/// others), so it is not kept in the handle.
+///
+/// The parts of the key that cannot spend are derived or looked up once and kept: its unified
+/// full viewing key, which holds its Sapling incoming and outgoing viewing keys, when the
+/// handle is opened, and its account when the handle is first used with a data database.
+pub struct FFISpendingKey {
+    usk: SecretVec<u8>,
+    ufvk: UnifiedFullViewingKey,
+    /// The path of the data database in which the account of the key was looked up, and the
+    /// account.
+    account: OnceCell<(PathBuf, AccountId)>,
+}
+
+impl FFISpendingKey {
+    fn decode(&self) -> anyhow::Result<UnifiedSpendingKey> {
+        let usk = self.usk.expose_secret();
+        unsafe { decode_usk(usk.as_ptr(), usk.len()) }
+    }
+
+    /// Returns the account of the key in the data database at `db_path`, which is only looked
+    /// up the first time.
+    fn account(&self, db_path: &Path, network: Network) -> anyhow::Result<AccountId> {
+        if let Some((path, account)) = self.account.get() {
+            if path == db_path {
+                return Ok(*account);
+            }
+        }
+        let account = WalletDb::for_path(db_path, network)
+            .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?
+            .get_account_for_ufvk(&self.ufvk)?
+            .ok_or_else(|| anyhow!("Spending key not recognized."))?;
+        let _ = self.account.set((db_path.to_path_buf(), account));
+        Ok(account)
+    }
+}
+
+/// Checks that a unified spending key can be decoded, derives its viewing key, and copies both
+/// into a handle that can be passed to [`piratelc_create_to_address_with_key`] and
+/// [`piratelc_shield_funds_with_key`] instead of the encoded key.
+///
+/// Returns null if the key could not be decoded. The handle must be closed with
+/// [`piratelc_close_spending_key`].
+///
+/// # Safety
+///
+/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
+///   spending key encoded as returned from the `piratelc_create_account` or
+///   `piratelc_derive_spending_key` functions.
+/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
+/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
+///   of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_open_spending_key(
+    usk_ptr: *const u8,
+    usk_len: usize,
+) -> *mut FFISpendingKey {
+    let res = catch_panic(|| {
+        let ufvk = unsafe { decode_usk(usk_ptr, usk_len) }?.to_unified_full_viewing_key();
+        let usk = unsafe { slice::from_raw_parts(usk_ptr, usk_len) }.to_vec();
+        Ok(Box::into_raw(Box::new(FFISpendingKey {
+            usk: SecretVec::new(usk),
+            ufvk,
+            account: OnceCell::new(),
+        })))
+    });
+    unwrap_exc_or_null(res)
+}
+
+/// Closes a spending key handle, erasing the key that it holds from memory.
+///
+/// # Safety
+///
+/// - `key` must either be null, or have been returned by [`piratelc_open_spending_key`] and not
+///   yet closed.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_close_spending_key(key: *mut FFISpendingKey) {
+    if !key.is_null() {
+        let key: Box<FFISpendingKey> = unsafe { Box::from_raw(key) };
+        drop(key);
+    }
+}
+
+/// Creates a transaction paying the specified address from the account of the spending key
+/// handle `key`.
+///
+/// This behaves as [`piratelc_create_to_address`], with the key held by the handle.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `key` must be non-null, must have been returned by [`piratelc_open_spending_key`] and not
+///   yet closed, and must not be closed for the duration of the function call.
+/// - `to` must be non-null and must point to a null-terminated UTF-8 string.
+/// - `memo` must either be null (indicating an empty memo or a transparent recipient) or point to a
+///    512-byte array.
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling output proving parameters.
+/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
+/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_create_to_address_with_key(
+    db_data: *const u8,
+    db_data_len: usize,
+    key: *const FFISpendingKey,
+    to: *const c_char,
+    value: i64,
+    memo: *const u8,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let strategy = parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+
+        let key = unsafe { key.as_ref() }.ok_or_else(|| anyhow!("Spending key handle is null"))?;
+        let account = key.account(db_path, network)?;
+        let usk = key.decode()?;
+        let payment = unsafe { decode_payment(&network, to, value, memo) }?;
+        let spend_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        let req = TransactionRequest::new(vec![payment])
+            .map_err(|e| anyhow!("Error creating transaction request: {:?}", e))?;
+
+        spend_request(
+            db_path,
+            network,
+            &usk,
+            req,
+            &LocalTxProver::new(spend_params, output_params),
+            min_confirmations,
+            use_zip317_fees,
+            strategy,
+            Some((&key.ufvk, account)),
+        )
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Merges the smallest spendable notes of the account of `usk` into fewer, larger notes, by
+/// creating transactions that pay the account's default Sapling address, until `budget_ms`
+/// milliseconds have elapsed.
+///
+/// Each transaction spends at most `max_notes_per_tx` notes (at least two) and has no change
+/// output: it pays the account the value of the spent notes less the fee, which is computed
+/// under the ZIP 317 fee rule if `use_zip317_fees` is set, and under the fixed fee rule
+/// otherwise. Only notes that could be spent with `min_confirmations` are merged. No
+/// transaction is started unless its estimated proving time fits in the remaining budget, but
+/// a transaction that has been started is completed even if it overruns the budget.
+///
+/// Notes are merged smallest first. Under the ZIP 317 fee rule, notes worth no more than the
+/// marginal fee are left alone, as spending them would not pay for their own inputs. If the
+/// smallest notes are together worth no more than the fee of merging them, they are skipped
+/// and the next ones are merged instead. Each transaction's inputs are chosen by the upstream
+/// input selector from the note index in the same order (see [`note_index::IndexedWallet`]);
+/// as every merged note is worth more than what it adds to the fee, no smaller set of them
+/// covers the payment, so the transaction spends exactly the notes that it was planned for.
+/// The Sapling parameters are loaded once, for all of the transactions. Like [`piratelc_create_to_address`], this
+/// must not run in parallel with other calls that create transactions.
+///
+/// The row indices of the created transactions in the `transactions` table are copied into
+/// `id_txs`, in order of creation; the caller must broadcast each of them. Returns the number
+/// of created transactions, which is at most `id_txs_len`. If creating a transaction fails
+/// after others have been created, the ones created so far are returned. Returns -1 if an
+/// error occurred before any transaction was created.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
+///   spending key encoded as returned from the `piratelc_create_account` or
+///   `piratelc_derive_spending_key` functions.
+/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
+/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
+///   of pointer::offset.
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling output proving parameters.
+/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
+/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `id_txs` must be non-null and valid for writes for `id_txs_len * mem::size_of::<i64>()`
+///   bytes, and it must be properly aligned.
+/// - The total size `id_txs_len * mem::size_of::<i64>()` must be no larger than `isize::MAX`.
+///   See the safety documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_consolidate_notes(
+    db_data: *const u8,
+    db_data_len: usize,
+    usk_ptr: *const u8,
+    usk_len: usize,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    use_zip317_fees: bool,
+    max_notes_per_tx: u32,
+    budget_ms: u64,
+    id_txs: *mut i64,
+    id_txs_len: usize,
+) -> i64 {
+    let res = catch_panic(|| {
+        let start = Instant::now();
+        let budget = Duration::from_millis(budget_ms);
+
+        let network = parse_network(network_id)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let db_read = unsafe { wallet_db(db_data, db_data_len, network)? };
+        let conn = wallet_ext::open(db_path)
+            .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?;
+        let id_txs_ret = unsafe { slice::from_raw_parts_mut(id_txs, id_txs_len) };
+
+        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+        let spend_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        let ufvk = usk.to_unified_full_viewing_key();
+        let account = db_read
+            .get_account_for_ufvk(&ufvk)?
+            .ok_or_else(|| anyhow!("Spending key not recognized."))?;
+        let (_, address) = usk.sapling().default_address();
+        let max_notes_per_tx = (max_notes_per_tx as usize).max(2);
+        let fee_model = note_index::FeeModel::standard(use_zip317_fees);
+        let outputs = note_index::Outputs {
+            sapling: 1,
+            transparent: 0,
+        };
+        // The parameters are loaded once, when the first transaction is started.
+        let mut prover = None;
+
+        let mut created = 0;
+        for slot in id_txs_ret.iter_mut() {
+            let index = note_index::get(&conn, db_path)
+                .map_err(|e| anyhow!("Error while indexing spendable notes: {}", e))?;
+            let anchor_height = match index.anchor_height(min_confirmations) {
+                Some(anchor_height) => anchor_height,
+                None => break,
+            };
+
+            // Skip the smallest notes for as long as the group that starts with them cannot
+            // pay its own fee.
+            let mut min_value = fee_model.marginal_fee();
+            let (strategy, notes, total, fee) = loop {
+                let strategy = note_index::Strategy::SmallestFirst { min_value };
+                let notes = strategy
+                    .order(index.spendable_notes(u32::from(account), anchor_height))
+                    .take(max_notes_per_tx)
+                    .collect::<Vec<_>>();
+                let total: u64 = notes.iter().map(|note| note.value).sum();
+                let fee = fee_model.fee(notes.len(), outputs);
+                if notes.len() < 2 || total > fee {
+                    break (strategy, notes, total, fee);
+                }
+                debug!(
+                    "Skipping notes worth {} zatoshis or less, which cannot pay the fee of {}",
+                    notes[0].value, fee
+                );
+                min_value = notes[0].value;
+            };
+            if notes.len() < 2 {
+                debug!("Stopping note consolidation: fewer than two notes to merge");
+                break;
+            }
+            let remaining = budget.saturating_sub(start.elapsed());
+            if proving::estimate_time(notes.len(), outputs.sapling) > remaining {
+                break;
+            }
+
+            let request = TransactionRequest::new(vec![Payment {
+                recipient_address: RecipientAddress::Shielded(address.clone()),
+                amount: Amount::from_u64(total - fee)
+                    .map_err(|()| anyhow!("Invalid amount, out of range"))?,
+                memo: None,
+                label: None,
+                message: None,
+                other_params: vec![],
+            }])
+            .map_err(|e| anyhow!("Error creating transaction request: {:?}", e))?;
+
+            match spend_request(
+                db_path,
+                network,
+                &usk,
+                request,
+                prover.get_or_insert_with(|| LocalTxProver::new(spend_params, output_params)),
+                min_confirmations,
+                use_zip317_fees,
+                strategy,
+                Some((&ufvk, account)),
+            ) {
+                Ok(id_tx) => {
+                    *slot = id_tx;
+                    created += 1;
+                }
+                Err(e) if created > 0 => {
+                    debug!("Stopping note consolidation: {}", e);
+                    break;
+                }
+                Err(e) => return Err(e),
+            }
+        }
+        Ok(created)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Builds, proves with `prover` and stores a transaction that pays `request` from the account
+/// of `usk`, and returns its row index in the `transactions` table.
+///
+/// The input selector takes the account's notes from the note index in the order of
+/// `strategy` (see [`note_index::IndexedWallet`]). The transaction is built on the proving
+/// thread pool (see [`piratelc_set_proving_parallelism`]), using its own connections to the
+/// data database.
+#[allow(clippy::too_many_arguments)]
+fn spend_request(
+    db_path: &Path,
+    network: Network,
+    usk: &UnifiedSpendingKey,
+    request: TransactionRequest,
+    prover: &LocalTxProver,
+    min_confirmations: u32,
+    use_zip317_fees: bool,
+    strategy: note_index::Strategy,
+    known_account: Option<(&UnifiedFullViewingKey, AccountId)>,
+) -> anyhow::Result<i64> {
+    proving::install(|| -> anyhow::Result<i64> {
+        let conn = wallet_ext::open(db_path)
+            .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?;
+        let index = note_index::get(&conn, db_path)
+            .map_err(|e| anyhow!("Error while indexing spendable notes: {}", e))?;
+        let db_read = WalletDb::for_path(db_path, network)
+            .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?;
+        let mut update_ops = db_read.get_update_ops()?;
+        let mut db_data = note_index::IndexedWallet::new(&mut update_ops, &conn, index, strategy)
+            .with_account(known_account);
+
+        let id_tx = if use_zip317_fees {
+            let input_selector = GreedyInputSelector::new(
+                zip317::SingleOutputChangeStrategy::new(Zip317FeeRule::standard()),
+                DustOutputPolicy::default(),
+            );
+
+            spend(
+                &mut db_data,
+                &network,
+                proving::SharedTxProver(prover),
+                &input_selector,
+                usk,
+                request,
+                OvkPolicy::Sender,
+                min_confirmations,
+            )
+            .map_err(|e| anyhow!("Error while sending funds: {}", e))
+        } else {
+            let input_selector = GreedyInputSelector::new(
+                fixed::SingleOutputChangeStrategy::new(FixedFeeRule::standard()),
+                DustOutputPolicy::default(),
+            );
+
+            spend(
+                &mut db_data,
+                &network,
+                proving::SharedTxProver(prover),
+                &input_selector,
+                usk,
+                request,
+                OvkPolicy::Sender,
+                min_confirmations,
+            )
+            .map_err(|e| anyhow!("Error while sending funds: {}", e))
+        }?;
+        refresh_derived_tables(&conn, &[])?;
+        Ok(id_tx)
+    })
+    .map_err(|e| anyhow!("Error while creating the proving thread pool: {}", e))?
+}
+
+/// Sets the single-threaded time, in milliseconds, that [`piratelc_estimate_transfer`] and
+/// [`piratelc_consolidate_notes`] assume for one Sapling spend proof and for one Sapling
+/// output proof. Hosts can measure these on the device to make the estimates more accurate.
+/// Passing `0` for either restores its default, which is 1500 ms for a spend proof and 500 ms
+/// for an output proof.
+#[no_mangle]
+pub extern "C" fn piratelc_set_proof_times(spend_proof_ms: u64, output_proof_ms: u64) {
+    proving::set_proof_times(spend_proof_ms, output_proof_ms);
+}
+
+/// Sets the maximum number of threads used to build and prove transactions in
+/// [`piratelc_create_to_address`] and [`piratelc_shield_funds`]. Passing `0` uses one thread
+/// per CPU, which is also the default.
+///
+/// Proving runs on its own thread pool, separate from the one used to trial-decrypt
+/// transactions. Transactions that are already being built are not affected.
+#[no_mangle]
+pub extern "C" fn piratelc_set_proving_parallelism(max_threads: u32) -> bool {
+    let res = catch_panic(|| {
+        proving::set_max_threads(max_threads as usize)
+            .map(|()| true)
+            .map_err(|e| anyhow!("Error while creating the proving thread pool: {}", e))
+    });
+    unwrap_exc_or(res, false)
+}
+
+#[no_mangle]
+pub extern "C" fn piratelc_branch_id_for_height(height: i32, network_id: u32) -> i32 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let branch: BranchId = BranchId::for_height(&network, BlockHeight::from(height as u32));
+        let branch_id: u32 = u32::from(branch);
+        Ok(branch_id as i32)
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Frees strings returned by other piratelc functions.
+///
+/// # Safety
+///
+/// - `s` should be a non-null pointer returned as a string by another piratelc function.
+#[no_mangle]
+#[allow(clippy::not_unsafe_ptr_arg_deref)]
+pub unsafe extern "C" fn piratelc_string_free(s: *mut c_char) {
+    if !s.is_null() {
+        let s = unsafe { CString::from_raw(s) };
+        drop(s);
+    }
+}
+
+/// Shield transparent UTXOs by sending them to an address associated with the specified Sapling
+/// spending key.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `usk_ptr` must be non-null and must point to an array of `usk_len` bytes containing a unified
+///   spending key encoded as returned from the `piratelc_create_account` or
+///   `piratelc_derive_spending_key` functions.
+/// - The memory referenced by `usk_ptr` must not be mutated for the duration of the function call.
+/// - The total size `usk_len` must be no larger than `isize::MAX`. See the safety documentation
+/// - `memo` must either be null (indicating an empty memo) or point to a 512-byte array.
+/// - `shielding_threshold` a non-negative shielding threshold amount in zatoshi
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling output proving parameters.
+/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
+/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_shield_funds(
+    db_data: *const u8,
+    db_data_len: usize,
+    usk_ptr: *const u8,
+    usk_len: usize,
+    memo: *const u8,
+    shielding_threshold: u64,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        // Shielding spends only transparent outputs, so the strategy is only validated.
+        parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+
+        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+
+        let memo_bytes = if memo.is_null() {
+            MemoBytes::empty()
+        } else {
+            MemoBytes::from_bytes(unsafe { slice::from_raw_parts(memo, 512) })
+                .map_err(|e| anyhow!("Invalid MemoBytes: {}", e))?
+        };
+
+        let shielding_threshold = NonNegativeAmount::from_u64(shielding_threshold)
+            .map_err(|()| anyhow!("Invalid amount, out of range"))?;
+
+        let spend_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        shield_funds(
+            db_path,
+            network,
+            &usk,
+            None,
+            &memo_bytes,
+            shielding_threshold,
+            spend_params,
+            output_params,
+            min_confirmations,
+            use_zip317_fees,
+        )
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Shields the transparent UTXOs of the account of the spending key handle `key`.
+///
+/// This behaves as [`piratelc_shield_funds`], with the key held by the handle.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `key` must be non-null, must have been returned by [`piratelc_open_spending_key`] and not
+///   yet closed, and must not be closed for the duration of the function call.
+/// - `memo` must either be null (indicating an empty memo) or point to a 512-byte array.
+/// - `shielding_threshold` a non-negative shielding threshold amount in zatoshi
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling output proving parameters.
+/// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
+/// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_shield_funds_with_key(
+    db_data: *const u8,
+    db_data_len: usize,
+    key: *const FFISpendingKey,
+    memo: *const u8,
+    shielding_threshold: u64,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+) -> i64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        // Shielding spends only transparent outputs, so the strategy is only validated.
+        parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+
+        let key = unsafe { key.as_ref() }.ok_or_else(|| anyhow!("Spending key handle is null"))?;
+        let account = key.account(db_path, network)?;
+        let usk = key.decode()?;
+
+        let memo_bytes = if memo.is_null() {
+            MemoBytes::empty()
+        } else {
+            MemoBytes::from_bytes(unsafe { slice::from_raw_parts(memo, 512) })
+                .map_err(|e| anyhow!("Invalid MemoBytes: {}", e))?
+        };
+
+        let shielding_threshold = NonNegativeAmount::from_u64(shielding_threshold)
+            .map_err(|()| anyhow!("Invalid amount, out of range"))?;
+
+        let spend_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = Path::new(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        shield_funds(
+            db_path,
+            network,
+            &usk,
+            Some(account),
+            &memo_bytes,
+            shielding_threshold,
+            spend_params,
+            output_params,
+            min_confirmations,
+            use_zip317_fees,
+        )
+    });
+    unwrap_exc_or(res, -1)
+}
+
+/// Shields the transparent UTXOs of several accounts, creating one transaction per account that
+/// sends its funds to an address associated with its spending key.
+///
+/// `usks` holds unified spending keys, encoded as returned from the `piratelc_create_account`
+/// or `piratelc_derive_spending_key` functions, back to back, each preceded by its length in
+/// bytes as a little-endian `u32`. The transactions are built in parallel on the proving
+/// thread pool (see [`piratelc_set_proving_parallelism`]), each with its own connections to
+/// the data database, sharing the proving parameters, and the derived tables are refreshed
+/// once at the end.
+///
+/// `id_txs_len` must equal the number of keys. For each key, in the order of `usks`, one of
+/// the following is copied into `id_txs`:
+/// - the row index of the created transaction in the `transactions` table;
+/// - `-1` if the account's confirmed transparent balance is below `shielding_threshold`;
+/// - `-2` if shielding the funds of the account failed.
+///
+/// Returns the number of created transactions. A failure for one account does not stop the
+/// others from being shielded; if any account failed, -1 is returned instead, with an error
+/// that gives the position of each failed key in `usks` and the reason. The transactions
+/// created for the other accounts have been stored and copied into `id_txs` all the same, and
+/// the caller must still broadcast them.
+///
+/// # Safety
+///
+/// - `db_data` must be non-null and valid for reads for `db_data_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be a string representing a valid system path in the
+///   operating system's preferred representation.
+/// - The memory referenced by `db_data` must not be mutated for the duration of the function call.
+/// - The total size `db_data_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `usks` must be non-null and valid for reads for `usks_len` bytes, and it must have an
+///   alignment of `1`.
+/// - The memory referenced by `usks` must not be mutated for the duration of the function call.
+/// - The total size `usks_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `memo` must either be null (indicating an empty memo) or point to a 512-byte array.
+/// - `shielding_threshold` a non-negative shielding threshold amount in zatoshi
+/// - `spend_params` must be non-null and valid for reads for `spend_params_len` bytes, and it must have an
+///   alignment of `1`. Its contents must be the Sapling spend proving parameters.
+/// - The memory referenced by `spend_params` must not be mutated for the duration of the function call.
+/// - The total size `spend_params_len` must be no larger than `isize::MAX`. See the safety
+///   documentation of pointer::offset.
+/// - `output_params` must be non-null and valid for reads for `output_params_len` bytes, and it must have an
 ///   alignment of `1`. Its contents must be the Sapling output proving parameters.
 /// - The memory referenced by `output_params` must not be mutated for the duration of the function call.
 /// - The total size `output_params_len` must be no larger than `isize::MAX`. See the safety
 ///   documentation of pointer::offset.
+/// - `id_txs` must be non-null and valid for writes for `id_txs_len * mem::size_of::<i64>()`
+///   bytes, and it must be properly aligned.
+/// - The total size `id_txs_len * mem::size_of::<i64>()` must be no larger than `isize::MAX`.
+///   See the safety documentation of pointer::offset.
 #[no_mangle]
-pub unsafe extern "C" fn piratelc_shield_funds(
+pub unsafe extern "C" fn piratelc_shield_funds_for_accounts(
     db_data: *const u8,
     db_data_len: usize,
-    usk_ptr: *const u8,
-    usk_len: usize,
+    usks: *const u8,
+    usks_len: usize,
     memo: *const u8,
     shielding_threshold: u64,
     spend_params: *const u8,
@@ -2437,16 +4915,30 @@ pub unsafe extern "C" fn piratelc_shield_funds(
     output_params_len: usize,
     network_id: u32,
     min_confirmations: u32,
+    strategy: u32,
     use_zip317_fees: bool,
+    id_txs: *mut i64,
+    id_txs_len: usize,
 ) -> i64 {
     let res = catch_panic(|| {
         let network = parse_network(network_id)?;
-        let db_data = unsafe { wallet_db(db_data, db_data_len, network)? };
-        let mut update_ops = db_data
-            .get_update_ops()
-            .map_err(|e| anyhow!("Could not obtain a writable database connection: {}", e))?;
+        // Shielding spends only transparent outputs, so the strategy is only validated.
+        parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) };
+        let id_txs_ret = unsafe { slice::from_raw_parts_mut(id_txs, id_txs_len) };
 
-        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+        let usks = split_length_prefixed(unsafe { slice::from_raw_parts(usks, usks_len) })?
+            .into_iter()
+            .map(|usk| unsafe { decode_usk(usk.as_ptr(), usk.len()) })
+            .collect::<anyhow::Result<Vec<_>>>()?;
+        if usks.len() != id_txs_ret.len() {
+            return Err(anyhow!(
+                "Expected {} spending keys, got {}",
+                id_txs_ret.len(),
+                usks.len()
+            ));
+        }
+        id_txs_ret.fill(-1);
 
         let memo_bytes = if memo.is_null() {
             MemoBytes::empty()
@@ -2465,74 +4957,476 @@ pub unsafe extern "C" fn piratelc_shield_funds(
             slice::from_raw_parts(output_params, output_params_len)
         }));
 
-        let account = db_data
-            .get_account_for_ufvk(&usk.to_unified_full_viewing_key())?
-            .ok_or_else(|| anyhow!("Spending key not recognized."))?;
+        // The accounts are shielded in parallel on the proving thread pool, each with its own
+        // connections to the data database, and share the proving parameters.
+        let prover = LocalTxProver::new(spend_params, output_params);
+        let results = proving::install(|| {
+            usks.par_iter()
+                .map(|usk| -> anyhow::Result<Option<i64>> {
+                    let db_data = WalletDb::for_path(db_path, network)
+                        .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?;
+                    let mut update_ops = db_data.get_update_ops().map_err(|e| {
+                        anyhow!("Could not obtain a writable database connection: {}", e)
+                    })?;
+                    let account = db_data
+                        .get_account_for_ufvk(&usk.to_unified_full_viewing_key())?
+                        .ok_or_else(|| anyhow!("Spending key not recognized."))?;
+
+                    let balance = transparent_balances(&db_data, account, min_confirmations)?
+                        .values()
+                        .try_fold(Amount::zero(), |total, value| total + *value)
+                        .ok_or_else(|| anyhow!("Transparent balance out of range"))?;
+                    if balance < Amount::from(shielding_threshold) {
+                        return Ok(None);
+                    }
+
+                    shield_account(
+                        &db_data,
+                        &mut update_ops,
+                        network,
+                        &prover,
+                        usk,
+                        account,
+                        &memo_bytes,
+                        shielding_threshold,
+                        min_confirmations,
+                        use_zip317_fees,
+                    )
+                    .map(Some)
+                })
+                .collect::<Vec<_>>()
+        })
+        .map_err(|e| anyhow!("Error while creating the proving thread pool: {}", e))?;
+
+        let conn = wallet_ext::open(db_path)
+            .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?;
+        refresh_derived_tables(&conn, &[])?;
+
+        let mut created = 0;
+        let mut failures = vec![];
+        for (i, (slot, result)) in id_txs_ret.iter_mut().zip(results).enumerate() {
+            match result {
+                Ok(Some(id_tx)) => {
+                    *slot = id_tx;
+                    created += 1;
+                }
+                Ok(None) => *slot = -1,
+                Err(e) => {
+                    *slot = -2;
+                    failures.push(format!("spending key {}: {}", i, e));
+                }
+            }
+        }
+        if failures.is_empty() {
+            Ok(created)
+        } else {
+            Err(anyhow!(
+                "Error while shielding funds for {}",
+                failures.join("; ")
+            ))
+        }
+    });
+    unwrap_exc_or(res, -1)
+}
 
-        let taddrs: Vec<TransparentAddress> = db_data
-            .get_target_and_anchor_heights(0u32)
-            .map_err(|e| anyhow!("Error while fetching anchor height: {}", e))
-            .and_then(|opt_anchor| {
-                opt_anchor
-                    .map(|(_, a)| a)
-                    .ok_or_else(|| anyhow!("height not available; scan required."))
-            })
-            .and_then(|anchor| {
-                db_data
-                    .get_transparent_balances(account, anchor)
-                    .map_err(|e| {
-                        anyhow!(
-                            "Error while fetching transparent balances for {:?}: {}",
-                            account,
-                            e,
-                        )
-                    })
-            })?
-            .keys()
-            .cloned()
-            .collect();
+/// Builds, proves and stores a transaction that shields the transparent funds of the account
+/// of `usk`, and returns its row index in the `transactions` table.
+///
+/// `account` is the account of `usk`, if it is already known; otherwise it is looked up.
+///
+/// The transaction is built on the proving thread pool (see
+/// [`piratelc_set_proving_parallelism`]), using its own connections to the data database.
+#[allow(clippy::too_many_arguments)]
+fn shield_funds(
+    db_path: &Path,
+    network: Network,
+    usk: &UnifiedSpendingKey,
+    account: Option<AccountId>,
+    memo_bytes: &MemoBytes,
+    shielding_threshold: NonNegativeAmount,
+    spend_params: &Path,
+    output_params: &Path,
+    min_confirmations: u32,
+    use_zip317_fees: bool,
+) -> anyhow::Result<i64> {
+    proving::install(|| -> anyhow::Result<i64> {
+        let conn = wallet_ext::open(db_path)
+            .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?;
+        let db_data = WalletDb::for_path(db_path, network)
+            .map_err(|e| anyhow!("Error opening wallet database connection: {}", e))?;
+        let mut update_ops = db_data
+            .get_update_ops()
+            .map_err(|e| anyhow!("Could not obtain a writable database connection: {}", e))?;
 
-        if use_zip317_fees {
-            let input_selector = GreedyInputSelector::new(
-                zip317::SingleOutputChangeStrategy::new(Zip317FeeRule::standard()),
-                DustOutputPolicy::default(),
-            );
+        let account = match account {
+            Some(account) => account,
+            None => db_data
+                .get_account_for_ufvk(&usk.to_unified_full_viewing_key())?
+                .ok_or_else(|| anyhow!("Spending key not recognized."))?,
+        };
+        let prover = LocalTxProver::new(spend_params, output_params);
 
-            shield_transparent_funds(
-                &mut update_ops,
-                &network,
-                LocalTxProver::new(spend_params, output_params),
-                &input_selector,
-                shielding_threshold,
-                &usk,
-                &taddrs,
-                &memo_bytes,
-                min_confirmations,
-            )
-            .map_err(|e| anyhow!("Error while shielding transaction: {}", e))
+        let id_tx = shield_account(
+            &db_data,
+            &mut update_ops,
+            network,
+            &prover,
+            usk,
+            account,
+            memo_bytes,
+            shielding_threshold,
+            min_confirmations,
+            use_zip317_fees,
+        )?;
+        refresh_derived_tables(&conn, &[])?;
+        Ok(id_tx)
+    })
+    .map_err(|e| anyhow!("Error while creating the proving thread pool: {}", e))?
+}
+
+/// Returns the transparent balances of the addresses of `account` at the anchor height for
+/// `min_confirmations`.
+fn transparent_balances(
+    db_data: &WalletDb<Network>,
+    account: AccountId,
+    min_confirmations: u32,
+) -> anyhow::Result<HashMap<TransparentAddress, Amount>> {
+    db_data
+        .get_target_and_anchor_heights(min_confirmations)
+        .map_err(|e| anyhow!("Error while fetching anchor height: {}", e))
+        .and_then(|opt_anchor| {
+            opt_anchor
+                .map(|(_, a)| a)
+                .ok_or_else(|| anyhow!("height not available; scan required."))
+        })
+        .and_then(|anchor| {
+            db_data
+                .get_transparent_balances(account, anchor)
+                .map_err(|e| {
+                    anyhow!(
+                        "Error while fetching transparent balances for {:?}: {}",
+                        account,
+                        e,
+                    )
+                })
+        })
+}
+
+/// Builds, proves with `prover` and stores a transaction that shields the transparent funds of
+/// `account`, whose spending key is `usk`, using the given connections to the data database,
+/// and returns its row index in the `transactions` table.
+#[allow(clippy::too_many_arguments)]
+fn shield_account(
+    db_data: &WalletDb<Network>,
+    update_ops: &mut DataConnStmtCache<'_, Network>,
+    network: Network,
+    prover: &LocalTxProver,
+    usk: &UnifiedSpendingKey,
+    account: AccountId,
+    memo_bytes: &MemoBytes,
+    shielding_threshold: NonNegativeAmount,
+    min_confirmations: u32,
+    use_zip317_fees: bool,
+) -> anyhow::Result<i64> {
+    let taddrs: Vec<TransparentAddress> = transparent_balances(db_data, account, 0)?
+        .keys()
+        .cloned()
+        .collect();
+
+    let id_tx = if use_zip317_fees {
+        let input_selector = GreedyInputSelector::new(
+            zip317::SingleOutputChangeStrategy::new(Zip317FeeRule::standard()),
+            DustOutputPolicy::default(),
+        );
+
+        shield_transparent_funds(
+            update_ops,
+            &network,
+            proving::SharedTxProver(prover),
+            &input_selector,
+            shielding_threshold,
+            usk,
+            &taddrs,
+            memo_bytes,
+            min_confirmations,
+        )
+        .map_err(|e| anyhow!("Error while shielding transaction: {}", e))
+    } else {
+        let input_selector = GreedyInputSelector::new(
+            fixed::SingleOutputChangeStrategy::new(FixedFeeRule::standard()),
+            DustOutputPolicy::default(),
+        );
+
+        shield_transparent_funds(
+            update_ops,
+            &network,
+            proving::SharedTxProver(prover),
+            &input_selector,
+            shielding_threshold,
+            usk,
+            &taddrs,
+            memo_bytes,
+            min_confirmations,
+        )
+        .map_err(|e| anyhow!("Error while shielding transaction: {}", e))
+    }?;
+    Ok(id_tx)
+}
+
+//
+// Background jobs
+//
+
+/// A function that is called when a background job completes, with the job's ID, the row
+/// index of the created transaction (or `-1` if the job failed), the job's error message (or
+/// null if it succeeded), and the context pointer that was passed when the job was started.
+///
+/// The function is called on the job worker thread. `error` is only valid for the duration of
+/// the call.
+pub type FFIJobCallback =
+    unsafe extern "C" fn(job_id: u64, id_tx: i64, error: *const c_char, context: *mut c_void);
+
+/// A context pointer that the host has promised can be used from the job worker thread.
+struct FFIJobContext(*mut c_void);
+
+unsafe impl Send for FFIJobContext {}
+
+fn job_completion(
+    callback: Option<FFIJobCallback>,
+    context: *mut c_void,
+) -> Option<jobs::Completion> {
+    let context = FFIJobContext(context);
+    callback.map(|callback| -> jobs::Completion {
+        Box::new(move |job_id, status| {
+            let context = context;
+            match status {
+                jobs::Status::Succeeded(id_tx) => unsafe {
+                    callback(job_id, *id_tx, std::ptr::null(), context.0)
+                },
+                jobs::Status::Failed(error) => {
+                    let error = CString::new(error.replace('\0', " ")).unwrap();
+                    unsafe { callback(job_id, -1, error.as_ptr(), context.0) }
+                }
+                jobs::Status::Queued | jobs::Status::Running => unreachable!(),
+            }
+        })
+    })
+}
+
+/// Starts building a transaction paying the specified address from the given account, and
+/// returns at once.
+///
+/// This performs the same work as [`piratelc_create_to_address`] on a background worker
+/// thread. Jobs started by this function and [`piratelc_shield_funds_async`] run one at a
+/// time, in the order in which they were started, so they never double-spend each other's
+/// notes; do not run [`piratelc_create_to_address`] or [`piratelc_shield_funds`] while jobs
+/// are pending.
+///
+/// If `callback` is non-null, it is called with `context` when the job completes. Otherwise,
+/// the outcome can be read with [`piratelc_get_job_status`] and [`piratelc_get_job_error`],
+/// and must be discarded with [`piratelc_release_job`].
+///
+/// Returns the ID of the job, or `0` if the arguments were invalid.
+///
+/// # Safety
+///
+/// - See the safety documentation of [`piratelc_create_to_address`] for all arguments except
+///   `callback` and `context`. The memory they reference only needs to be valid for the
+///   duration of this function call.
+/// - If `callback` is non-null, it must be safe to call from any thread, and `context` must be
+///   valid for use by `callback` from any thread until the job completes.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_create_to_address_async(
+    db_data: *const u8,
+    db_data_len: usize,
+    usk_ptr: *const u8,
+    usk_len: usize,
+    to: *const c_char,
+    value: i64,
+    memo: *const u8,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+    callback: Option<FFIJobCallback>,
+    context: *mut c_void,
+) -> u64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        let strategy = parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) }.to_path_buf();
+
+        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+        let payment = unsafe { decode_payment(&network, to, value, memo) }?;
+        let spend_params = PathBuf::from(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = PathBuf::from(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        let req = TransactionRequest::new(vec![payment])
+            .map_err(|e| anyhow!("Error creating transaction request: {:?}", e))?;
+
+        Ok(jobs::submit(
+            move || {
+                spend_request(
+                    &db_path,
+                    network,
+                    &usk,
+                    req,
+                    &LocalTxProver::new(&spend_params, &output_params),
+                    min_confirmations,
+                    use_zip317_fees,
+                    strategy,
+                    None,
+                )
+            },
+            job_completion(callback, context),
+        ))
+    });
+    unwrap_exc_or(res, 0)
+}
+
+/// Starts shielding transparent UTXOs, and returns at once.
+///
+/// This performs the same work as [`piratelc_shield_funds`] on a background worker thread. See
+/// [`piratelc_create_to_address_async`] for how jobs are run and how their outcome is reported.
+///
+/// Returns the ID of the job, or `0` if the arguments were invalid.
+///
+/// # Safety
+///
+/// - See the safety documentation of [`piratelc_shield_funds`] for all arguments except
+///   `callback` and `context`. The memory they reference only needs to be valid for the
+///   duration of this function call.
+/// - If `callback` is non-null, it must be safe to call from any thread, and `context` must be
+///   valid for use by `callback` from any thread until the job completes.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_shield_funds_async(
+    db_data: *const u8,
+    db_data_len: usize,
+    usk_ptr: *const u8,
+    usk_len: usize,
+    memo: *const u8,
+    shielding_threshold: u64,
+    spend_params: *const u8,
+    spend_params_len: usize,
+    output_params: *const u8,
+    output_params_len: usize,
+    network_id: u32,
+    min_confirmations: u32,
+    strategy: u32,
+    use_zip317_fees: bool,
+    callback: Option<FFIJobCallback>,
+    context: *mut c_void,
+) -> u64 {
+    let res = catch_panic(|| {
+        let network = parse_network(network_id)?;
+        // Shielding spends only transparent outputs, so the strategy is only validated.
+        parse_strategy(strategy)?;
+        let db_path = unsafe { wallet_path(db_data, db_data_len) }.to_path_buf();
+
+        let usk = unsafe { decode_usk(usk_ptr, usk_len) }?;
+
+        let memo_bytes = if memo.is_null() {
+            MemoBytes::empty()
         } else {
-            let input_selector = GreedyInputSelector::new(
-                fixed::SingleOutputChangeStrategy::new(FixedFeeRule::standard()),
-                DustOutputPolicy::default(),
-            );
+            MemoBytes::from_bytes(unsafe { slice::from_raw_parts(memo, 512) })
+                .map_err(|e| anyhow!("Invalid MemoBytes: {}", e))?
+        };
 
-            shield_transparent_funds(
-                &mut update_ops,
-                &network,
-                LocalTxProver::new(spend_params, output_params),
-                &input_selector,
-                shielding_threshold,
-                &usk,
-                &taddrs,
-                &memo_bytes,
-                min_confirmations,
-            )
-            .map_err(|e| anyhow!("Error while shielding transaction: {}", e))
-        }
+        let shielding_threshold = NonNegativeAmount::from_u64(shielding_threshold)
+            .map_err(|()| anyhow!("Invalid amount, out of range"))?;
+
+        let spend_params = PathBuf::from(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(spend_params, spend_params_len)
+        }));
+        let output_params = PathBuf::from(OsStr::from_bytes(unsafe {
+            slice::from_raw_parts(output_params, output_params_len)
+        }));
+
+        Ok(jobs::submit(
+            move || {
+                shield_funds(
+                    &db_path,
+                    network,
+                    &usk,
+                    None,
+                    &memo_bytes,
+                    shielding_threshold,
+                    &spend_params,
+                    &output_params,
+                    min_confirmations,
+                    use_zip317_fees,
+                )
+            },
+            job_completion(callback, context),
+        ))
+    });
+    unwrap_exc_or(res, 0)
+}
+
+/// Returns the status of a background job that was started without a callback:
+/// - `0` if it is queued;
+/// - `1` if it is running;
+/// - `2` if it succeeded, in which case the row index of the created transaction is written to
+///   `id_tx_ret`;
+/// - `3` if it failed (see [`piratelc_get_job_error`]);
+/// - `-1` if the job is unknown or has been released.
+///
+/// # Safety
+///
+/// - `id_tx_ret` must be non-null and valid for writes of an `i64`, and it must be properly
+///   aligned.
+#[no_mangle]
+pub unsafe extern "C" fn piratelc_get_job_status(job_id: u64, id_tx_ret: *mut i64) -> i32 {
+    let res = catch_panic(|| {
+        Ok(match jobs::status(job_id) {
+            Some(jobs::Status::Queued) => 0,
+            Some(jobs::Status::Running) => 1,
+            Some(jobs::Status::Succeeded(id_tx)) => {
+                unsafe { *id_tx_ret = id_tx };
+                2
+            }
+            Some(jobs::Status::Failed(_)) => 3,
+            None => -1,
+        })
     });
     unwrap_exc_or(res, -1)
 }
 
+/// Returns the error message of a failed background job that was started without a callback,
+/// or null if the job has not failed.
+///
+/// # Safety
+///
+/// - Call [`piratelc_string_free`] to free the memory associated with the returned pointer
+///   when done using it.
+#[no_mangle]
+pub extern "C" fn piratelc_get_job_error(job_id: u64) -> *mut c_char {
+    let res = catch_panic(|| match jobs::status(job_id) {
+        Some(jobs::Status::Failed(error)) => {
+            Ok(CString::new(error.replace('\0', " ")).unwrap().into_raw())
+        }
+        _ => Err(anyhow!("Job {} has not failed", job_id)),
+    });
+    unwrap_exc_or_null(res)
+}
+
+/// Discards the outcome of a completed background job that was started without a callback.
+///
+/// Returns `false` if the job is still queued or running, or is unknown.
+#[no_mangle]
+pub extern "C" fn piratelc_release_job(job_id: u64) -> bool {
+    let res = catch_panic(|| Ok(jobs::release(job_id)));
+    unwrap_exc_or(res, false)
+}
+
 //
 // Utility functions
 //
@@ -2544,3 +5438,32 @@ fn parse_network(value: u32) -> anyhow::Result<Network> {
         _ => Err(anyhow!("Invalid network type: {}. Expected either 0 or 1 for Testnet or Mainnet, respectively.", value))
     }
 }
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn spending_key_handle_keeps_the_key_and_its_viewing_key() {
+        let usk =
+            UnifiedSpendingKey::from_seed(&TestNetwork, &[7; 32], AccountId::from(0)).unwrap();
+        let encoded = usk.to_bytes(Era::Orchard);
+
+        let key = unsafe { piratelc_open_spending_key(encoded.as_ptr(), encoded.len()) };
+        assert!(!key.is_null());
+        let decoded = unsafe { &*key }.decode().unwrap();
+        assert_eq!(decoded.to_bytes(Era::Orchard), encoded);
+        let ufvk = usk.to_unified_full_viewing_key();
+        assert_eq!(
+            unsafe { &*key }.ufvk.sapling().map(|k| k.to_bytes()),
+            ufvk.sapling().map(|k| k.to_bytes())
+        );
+        assert!(unsafe { &*key }.account.get().is_none());
+        unsafe { piratelc_close_spending_key(key) };
+
+        let truncated = &encoded[..encoded.len() - 1];
+        assert!(
+            unsafe { piratelc_open_spending_key(truncated.as_ptr(), truncated.len()) }.is_null()
+        );
+    }
+}
@@ -0,0 +1,184 @@
+//! Compaction of the data database.
+//!
+//! Witnesses are stored for every unspent note at every scanned height, so wallets that
+//! receive many notes accumulate a large `sapling_witnesses` table. Only the witnesses
+//! within the reorg window are ever read again; the functions in this module delete the
+//! rest and return the freed pages to the filesystem in bounded increments.
+//!
+//! `zcash_client_sqlite` already deletes the witnesses more than [`PRUNING_HEIGHT`] blocks
+//! below the tip as each block is scanned, and stops storing witnesses for a note once it is
+//! spent, so [`prune_witnesses`] only finds rows in databases that were scanned without that
+//! pruning. Spent notes themselves are not pruned: the `received_notes` rows of spent notes
+//! are summed by the upstream `v_transactions` and `v_tx_outputs` views, so deleting them
+//! would change the amounts reported in the transaction history, and once their witnesses are
+//! gone they hold no other data that grows with the chain.
+
+use std::time::{Duration, Instant};
+
+use anyhow::anyhow;
+use rusqlite::{named_params, Connection};
+
+use crate::checkpoints::PRUNING_HEIGHT;
+
+/// The number of free pages released by each `incremental_vacuum` step. This is kept
+/// small so that a single step does not overrun the caller's time budget by much.
+const VACUUM_STEP_PAGES: u32 = 256;
+
+/// The value of `PRAGMA auto_vacuum` for a database in incremental vacuum mode.
+const AUTO_VACUUM_INCREMENTAL: i64 = 2;
+
+/// Deletes witnesses that are more than `reorg_window` blocks below the wallet's chain
+/// tip.
+///
+/// `reorg_window` must be at least [`PRUNING_HEIGHT`], the depth within which
+/// `zcash_client_sqlite` rewinds and selects anchors, so that no witness that a rewind or a
+/// spend could read is deleted.
+///
+/// Returns the number of deleted witness rows.
+pub(crate) fn prune_witnesses(conn: &Connection, reorg_window: u32) -> anyhow::Result<usize> {
+    if reorg_window < PRUNING_HEIGHT {
+        return Err(anyhow!(
+            "The reorg window must be at least {} blocks, but {} was given",
+            PRUNING_HEIGHT,
+            reorg_window
+        ));
+    }
+
+    let tip: Option<u32> =
+        conn.query_row("SELECT MAX(height) FROM blocks", [], |row| row.get(0))?;
+    let prune_below = match tip.and_then(|tip| tip.checked_sub(reorg_window)) {
+        Some(height) => height,
+        None => return Ok(0),
+    };
+
+    Ok(conn.execute(
+        "DELETE FROM sapling_witnesses WHERE block < :prune_below",
+        named_params! {":prune_below": prune_below},
+    )?)
+}
+
+fn pragma(conn: &Connection, name: &str) -> rusqlite::Result<i64> {
+    conn.query_row(&format!("PRAGMA {}", name), [], |row| row.get(0))
+}
+
+/// Switches the database to `auto_vacuum = INCREMENTAL`, if it was created without it.
+///
+/// The conversion requires a full `VACUUM`, which rewrites the whole database file and takes
+/// time proportional to its size. Returns true if the database was converted.
+pub(crate) fn enable_incremental_vacuum(conn: &Connection) -> rusqlite::Result<bool> {
+    if pragma(conn, "auto_vacuum")? == AUTO_VACUUM_INCREMENTAL {
+        return Ok(false);
+    }
+    conn.execute_batch("PRAGMA auto_vacuum = INCREMENTAL; VACUUM;")?;
+    Ok(true)
+}
+
+/// Returns free pages to the filesystem until either none are left or `budget` has
+/// elapsed.
+///
+/// This does nothing for databases that have not been switched to incremental vacuuming
+/// with [`enable_incremental_vacuum`].
+///
+/// Returns the number of pages by which the database file shrank.
+pub(crate) fn incremental_vacuum(conn: &Connection, budget: Duration) -> rusqlite::Result<i64> {
+    let start = Instant::now();
+
+    if pragma(conn, "auto_vacuum")? != AUTO_VACUUM_INCREMENTAL {
+        return Ok(0);
+    }
+
+    let initial_page_count: i64 = pragma(conn, "page_count")?;
+
+    let mut freelist_count: i64 = pragma(conn, "freelist_count")?;
+    while freelist_count > 0 && start.elapsed() < budget {
+        conn.execute_batch(&format!("PRAGMA incremental_vacuum({})", VACUUM_STEP_PAGES))?;
+        freelist_count = pragma(conn, "freelist_count")?;
+    }
+
+    let page_count: i64 = pragma(conn, "page_count")?;
+    Ok(initial_page_count - page_count)
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use rusqlite::Connection;
+
+    use super::*;
+
+    fn wallet(tip: u32) -> Connection {
+        let conn = Connection::open_in_memory().unwrap();
+        conn.execute_batch(
+            "CREATE TABLE blocks (height INTEGER PRIMARY KEY);
+            CREATE TABLE sapling_witnesses (
+                id_witness INTEGER PRIMARY KEY,
+                note INTEGER NOT NULL,
+                block INTEGER NOT NULL,
+                witness BLOB NOT NULL
+            );",
+        )
+        .unwrap();
+        conn.execute("INSERT INTO blocks (height) VALUES (?)", [tip])
+            .unwrap();
+        conn
+    }
+
+    fn witness_heights(conn: &Connection) -> Vec<u32> {
+        conn.prepare("SELECT block FROM sapling_witnesses ORDER BY block")
+            .unwrap()
+            .query_map([], |row| row.get(0))
+            .unwrap()
+            .collect::<rusqlite::Result<_>>()
+            .unwrap()
+    }
+
+    #[test]
+    fn prune_witnesses_keeps_reorg_window() {
+        let conn = wallet(1000);
+        for height in [800, 899, 900, 1000] {
+            conn.execute(
+                "INSERT INTO sapling_witnesses (note, block, witness) VALUES (1, ?, x'00')",
+                [height],
+            )
+            .unwrap();
+        }
+
+        assert_eq!(prune_witnesses(&conn, PRUNING_HEIGHT).unwrap(), 2);
+        assert_eq!(witness_heights(&conn), vec![900, 1000]);
+    }
+
+    #[test]
+    fn prune_witnesses_rejects_short_reorg_window() {
+        let conn = wallet(1000);
+        conn.execute(
+            "INSERT INTO sapling_witnesses (note, block, witness) VALUES (1, 995, x'00')",
+            [],
+        )
+        .unwrap();
+
+        assert!(prune_witnesses(&conn, PRUNING_HEIGHT - 1).is_err());
+        assert_eq!(witness_heights(&conn), vec![995]);
+    }
+
+    #[test]
+    fn incremental_vacuum_requires_conversion() {
+        let conn = wallet(1000);
+        assert_eq!(
+            incremental_vacuum(&conn, Duration::from_secs(1)).unwrap(),
+            0
+        );
+        assert_ne!(
+            pragma(&conn, "auto_vacuum").unwrap(),
+            AUTO_VACUUM_INCREMENTAL
+        );
+
+        assert!(enable_incremental_vacuum(&conn).unwrap());
+        assert!(!enable_incremental_vacuum(&conn).unwrap());
+        assert_eq!(
+            pragma(&conn, "auto_vacuum").unwrap(),
+            AUTO_VACUUM_INCREMENTAL
+        );
+        incremental_vacuum(&conn, Duration::from_secs(1)).unwrap();
+    }
+}
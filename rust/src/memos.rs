@@ -0,0 +1,122 @@
+//! Bulk reads of note memos.
+
+use anyhow::anyhow;
+use rusqlite::{Connection, OptionalExtension};
+use std::convert::TryFrom;
+
+use zcash_primitives::memo::{Memo, MemoBytes};
+
+/// Returns the memos of the given received notes (rows of `received_notes`) or, if `sent`
+/// is set, of the given sent notes (rows of `sent_notes`), in the same order.
+///
+/// Notes that do not have a memo are returned with an empty memo. It is an error for a note
+/// to not exist.
+pub(crate) fn get(
+    conn: &Connection,
+    note_ids: &[i64],
+    sent: bool,
+) -> anyhow::Result<Vec<MemoBytes>> {
+    let mut stmt = conn.prepare(if sent {
+        "SELECT memo FROM sent_notes WHERE id_note = ?"
+    } else {
+        "SELECT memo FROM received_notes WHERE id_note = ?"
+    })?;
+
+    note_ids
+        .iter()
+        .map(|id_note| {
+            let memo: Option<Vec<u8>> = stmt
+                .query_row([id_note], |row| row.get(0))
+                .optional()?
+                .ok_or_else(|| anyhow!("Note {} not found", id_note))?;
+            match memo {
+                Some(bytes) => MemoBytes::from_bytes(&bytes)
+                    .map_err(|e| anyhow!("Invalid memo for note {}: {}", id_note, e)),
+                None => Ok(MemoBytes::empty()),
+            }
+        })
+        .collect()
+}
+
+/// Returns the text of the memos of the given notes, identified as in [`get`], in the same
+/// order. Memos that are empty or do not contain UTF-8 text are returned as empty strings.
+pub(crate) fn texts(
+    conn: &Connection,
+    note_ids: &[i64],
+    sent: bool,
+) -> anyhow::Result<Vec<String>> {
+    Ok(get(conn, note_ids, sent)?
+        .into_iter()
+        .map(|memo| match Memo::try_from(memo) {
+            Ok(Memo::Text(text)) => text.into(),
+            _ => String::new(),
+        })
+        .collect())
+}
+
+#[cfg(test)]
+mod tests {
+    use std::str::FromStr;
+
+    use rusqlite::{named_params, Connection};
+    use zcash_primitives::memo::{Memo, MemoBytes};
+
+    use super::{get, texts};
+    use crate::wallet_ext::test_wallet;
+
+    fn memo_bytes(prefix: &[u8]) -> Vec<u8> {
+        let mut bytes = prefix.to_vec();
+        bytes.resize(512, 0);
+        bytes
+    }
+
+    fn wallet() -> Connection {
+        let conn = test_wallet();
+        let text = Memo::from_str("hello").unwrap().encode();
+        let memos: [Option<Vec<u8>>; 5] = [
+            Some(text.as_array().to_vec()),
+            None,
+            Some(MemoBytes::empty().as_array().to_vec()),
+            // An arbitrary-data memo.
+            Some(memo_bytes(&[0xff, 1, 2, 3])),
+            // A text memo that is not valid UTF-8.
+            Some(memo_bytes(&[0xc3, 0x28])),
+        ];
+        for (id_note, memo) in (1..).zip(memos.iter()) {
+            conn.execute(
+                "INSERT INTO received_notes (id_note, tx, account, value, memo)
+                VALUES (:id_note, 1, 0, 1, :memo)",
+                named_params! {":id_note": id_note, ":memo": memo},
+            )
+            .unwrap();
+        }
+        conn.execute(
+            "INSERT INTO sent_notes (id_note, tx, from_account, value, memo)
+            VALUES (1, 1, 0, 1, :memo)",
+            named_params! {":memo": &Memo::from_str("sent").unwrap().encode().as_array()[..]},
+        )
+        .unwrap();
+        conn
+    }
+
+    #[test]
+    fn get_returns_memos_in_order() {
+        let conn = wallet();
+        let memos = get(&conn, &[2, 1, 4], false).unwrap();
+        assert_eq!(memos[0], MemoBytes::empty());
+        assert_eq!(memos[1], Memo::from_str("hello").unwrap().encode());
+        assert_eq!(memos[2].as_array()[..4], [0xff, 1, 2, 3]);
+        assert!(get(&conn, &[1, 6], false).is_err());
+    }
+
+    #[test]
+    fn texts_are_empty_for_non_text_memos() {
+        let conn = wallet();
+        assert_eq!(
+            texts(&conn, &[1, 2, 3, 4, 5, 1], false).unwrap(),
+            vec!["hello", "", "", "", "", "hello"]
+        );
+        assert_eq!(texts(&conn, &[1], true).unwrap(), vec!["sent"]);
+        assert!(texts(&conn, &[2], true).is_err());
+    }
+}
@@ -0,0 +1,311 @@
+//! Trial decryption of unmined transactions, with the matches kept in memory instead of
+//! being written to the data database.
+//!
+//! Each wallet (identified by the path of its data database) has a bounded cache of the
+//! pending transactions that paid to, or were sent from, one of its accounts. Entries are
+//! dropped once the transaction is seen in a scanned block, once it has expired, or when the
+//! cache is full.
+
+use std::collections::{HashMap, VecDeque};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+
+use once_cell::sync::Lazy;
+use zcash_client_backend::{
+    data_api::WalletRead, decrypt_transaction, keys::UnifiedFullViewingKey, TransferType,
+};
+use zcash_primitives::{
+    consensus::{self, BlockHeight},
+    transaction::{Transaction, TxId},
+    zip32::AccountId,
+};
+
+/// The maximum number of pending transactions retained per wallet. When it is exceeded,
+/// the transactions that were received first are dropped.
+const MAX_PENDING_TRANSACTIONS: usize = 256;
+
+/// The caches of each wallet. The lock is only held while a cache is read or updated, and
+/// never while a wallet is opened or a transaction is decrypted.
+static MEMPOOLS: Lazy<Mutex<HashMap<PathBuf, Mempool>>> = Lazy::new(Default::default);
+
+/// A shielded output of a pending transaction that could be decrypted by the wallet.
+pub(crate) struct PendingOutput {
+    pub(crate) txid: TxId,
+    pub(crate) account: AccountId,
+    pub(crate) output_index: usize,
+    pub(crate) value: u64,
+    pub(crate) transfer_type: TransferType,
+    pub(crate) memo: [u8; 512],
+}
+
+struct PendingTransaction {
+    txid: TxId,
+    /// The height above which the transaction can no longer be mined, or `None` if it does not
+    /// expire.
+    expiry_height: Option<BlockHeight>,
+    outputs: Vec<PendingOutput>,
+}
+
+impl PendingTransaction {
+    /// Returns true if the transaction can no longer be mined at `target_height`.
+    fn is_expired(&self, target_height: BlockHeight) -> bool {
+        matches!(self.expiry_height, Some(expiry_height) if expiry_height < target_height)
+    }
+}
+
+type ViewingKeys = Arc<HashMap<AccountId, UnifiedFullViewingKey>>;
+
+struct Mempool {
+    /// The viewing keys of the wallet's accounts, or `None` if they need to be reloaded.
+    ufvks: Option<ViewingKeys>,
+    /// The height at which pending transactions are expected to be mined.
+    target_height: BlockHeight,
+    pending: VecDeque<PendingTransaction>,
+}
+
+impl Mempool {
+    fn new(ufvks: ViewingKeys, target_height: BlockHeight) -> Self {
+        Mempool {
+            ufvks: Some(ufvks),
+            target_height,
+            pending: VecDeque::new(),
+        }
+    }
+
+    fn get(&self, txid: TxId) -> Option<&PendingTransaction> {
+        self.pending.iter().find(|tx| tx.txid == txid)
+    }
+
+    /// Caches a decrypted transaction, unless it is already cached or has expired.
+    fn insert(&mut self, tx: PendingTransaction) {
+        if self.get(tx.txid).is_some() || tx.is_expired(self.target_height) {
+            return;
+        }
+        if self.pending.len() == MAX_PENDING_TRANSACTIONS {
+            self.pending.pop_front();
+        }
+        self.pending.push_back(tx);
+    }
+
+    /// Updates the target height, and drops the transactions that can no longer be mined at
+    /// it.
+    fn set_target_height(&mut self, target_height: BlockHeight) {
+        self.target_height = target_height;
+        self.pending.retain(|tx| !tx.is_expired(target_height));
+    }
+}
+
+/// Trial-decrypts `tx` with the viewing keys of the wallet at `db_path`, and caches its
+/// outputs if any could be decrypted.
+///
+/// The viewing keys are read from `wallet` the first time a wallet is seen, and after
+/// [`invalidate_keys`] has been called.
+///
+/// Returns the number of decrypted outputs.
+pub(crate) fn ingest<P: consensus::Parameters, W: WalletRead>(
+    params: &P,
+    db_path: &Path,
+    wallet: impl FnOnce() -> Result<W, anyhow::Error>,
+    tx: &Transaction,
+) -> anyhow::Result<usize>
+where
+    W::Error: std::fmt::Display,
+{
+    let txid = tx.txid();
+    let cached = MEMPOOLS.lock().unwrap().get(db_path).and_then(|mempool| {
+        if let Some(pending) = mempool.get(txid) {
+            return Some(Err(pending.outputs.len()));
+        }
+        let ufvks = mempool.ufvks.clone()?;
+        Some(Ok((ufvks, mempool.target_height)))
+    });
+    let (ufvks, target_height, loaded) = match cached {
+        Some(Err(decrypted)) => return Ok(decrypted),
+        Some(Ok((ufvks, target_height))) => (ufvks, target_height, false),
+        None => {
+            let wallet = wallet()?;
+            let ufvks = wallet
+                .get_unified_full_viewing_keys()
+                .map_err(|e| anyhow::anyhow!("Error while fetching viewing keys: {}", e))?;
+            (Arc::new(ufvks), target_height(params, &wallet)?, true)
+        }
+    };
+
+    let outputs: Vec<_> = decrypt_transaction(params, target_height, tx, &ufvks)
+        .into_iter()
+        .map(|output| PendingOutput {
+            txid,
+            account: output.account,
+            output_index: output.index,
+            value: output.note.value().inner(),
+            transfer_type: output.transfer_type,
+            memo: *output.memo.as_array(),
+        })
+        .collect();
+    let decrypted = outputs.len();
+
+    let mut mempools = MEMPOOLS.lock().unwrap();
+    let mempool = mempools
+        .entry(db_path.to_path_buf())
+        .or_insert_with(|| Mempool::new(ufvks.clone(), target_height));
+    if loaded && mempool.ufvks.is_none() {
+        mempool.ufvks = Some(ufvks);
+        mempool.set_target_height(target_height);
+    }
+    if decrypted > 0 {
+        mempool.insert(PendingTransaction {
+            txid,
+            expiry_height: Some(tx.expiry_height()).filter(|h| u32::from(*h) != 0),
+            outputs,
+        });
+    }
+    Ok(decrypted)
+}
+
+/// Calls `f` with each cached output of the wallet at `db_path`, in the order in which
+/// their transactions were received.
+pub(crate) fn with_pending_outputs(db_path: &Path, mut f: impl FnMut(&PendingOutput)) {
+    if let Some(mempool) = MEMPOOLS.lock().unwrap().get(db_path) {
+        for output in mempool.pending.iter().flat_map(|tx| &tx.outputs) {
+            f(output);
+        }
+    }
+}
+
+/// Drops the cached transactions of the wallet at `db_path` that have been mined or have
+/// expired, after `wallet` has been scanned.
+pub(crate) fn reconcile<P: consensus::Parameters, W: WalletRead>(
+    params: &P,
+    db_path: &Path,
+    wallet: &W,
+) -> anyhow::Result<()>
+where
+    W::Error: std::fmt::Display,
+{
+    let txids: Vec<TxId> = match MEMPOOLS.lock().unwrap().get(db_path) {
+        Some(mempool) => mempool.pending.iter().map(|tx| tx.txid).collect(),
+        None => return Ok(()),
+    };
+
+    let target_height = target_height(params, wallet)?;
+    let mut mined = Vec::new();
+    for txid in txids {
+        if wallet
+            .get_tx_height(txid)
+            .map_err(|e| anyhow::anyhow!("Error while fetching transaction height: {}", e))?
+            .is_some()
+        {
+            mined.push(txid);
+        }
+    }
+
+    if let Some(mempool) = MEMPOOLS.lock().unwrap().get_mut(db_path) {
+        mempool.pending.retain(|tx| !mined.contains(&tx.txid));
+        mempool.set_target_height(target_height);
+    }
+    Ok(())
+}
+
+/// Forces the viewing keys of the wallet at `db_path` to be reloaded, after an account has
+/// been added. The outputs that are already cached are kept.
+pub(crate) fn invalidate_keys(db_path: &Path) {
+    if let Some(mempool) = MEMPOOLS.lock().unwrap().get_mut(db_path) {
+        mempool.ufvks = None;
+    }
+}
+
+fn target_height<P: consensus::Parameters, W: WalletRead>(
+    params: &P,
+    wallet: &W,
+) -> anyhow::Result<BlockHeight>
+where
+    W::Error: std::fmt::Display,
+{
+    wallet
+        .block_height_extrema()
+        .map_err(|e| anyhow::anyhow!("Error while fetching max block height: {}", e))?
+        .map(|(_, max_height)| max_height + 1)
+        .or_else(|| params.activation_height(consensus::NetworkUpgrade::Sapling))
+        .ok_or_else(|| anyhow::anyhow!("Sapling activation height must be known."))
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashMap;
+    use std::sync::Arc;
+
+    use zcash_client_backend::TransferType;
+    use zcash_primitives::{
+        consensus::BlockHeight, memo::MemoBytes, transaction::TxId, zip32::AccountId,
+    };
+
+    use super::{Mempool, PendingOutput, PendingTransaction, MAX_PENDING_TRANSACTIONS};
+
+    fn txid(id: u16) -> TxId {
+        let mut bytes = [0; 32];
+        bytes[..2].copy_from_slice(&id.to_le_bytes());
+        TxId::from_bytes(bytes)
+    }
+
+    fn pending(id: u16, expiry_height: Option<u32>) -> PendingTransaction {
+        let txid = txid(id);
+        PendingTransaction {
+            txid,
+            expiry_height: expiry_height.map(BlockHeight::from_u32),
+            outputs: vec![PendingOutput {
+                txid,
+                account: AccountId::from(0),
+                output_index: 0,
+                value: 1000,
+                transfer_type: TransferType::Incoming,
+                memo: *MemoBytes::empty().as_array(),
+            }],
+        }
+    }
+
+    fn mempool(target_height: u32) -> Mempool {
+        Mempool::new(
+            Arc::new(HashMap::new()),
+            BlockHeight::from_u32(target_height),
+        )
+    }
+
+    fn txids(mempool: &Mempool) -> Vec<TxId> {
+        mempool.pending.iter().map(|tx| tx.txid).collect()
+    }
+
+    #[test]
+    fn insert_skips_duplicates_and_expired() {
+        let mut mempool = mempool(100);
+        mempool.insert(pending(1, Some(120)));
+        mempool.insert(pending(1, Some(120)));
+        mempool.insert(pending(2, Some(99)));
+        mempool.insert(pending(3, None));
+        assert_eq!(txids(&mempool), vec![txid(1), txid(3)]);
+    }
+
+    #[test]
+    fn insert_drops_oldest_when_full() {
+        let mut mempool = mempool(100);
+        for id in 0..=MAX_PENDING_TRANSACTIONS {
+            mempool.insert(pending(id as u16, None));
+        }
+        assert_eq!(mempool.pending.len(), MAX_PENDING_TRANSACTIONS);
+        assert!(mempool.get(txid(0)).is_none());
+        assert!(mempool.get(txid(1)).is_some());
+    }
+
+    #[test]
+    fn target_height_evicts_expired() {
+        let mut mempool = mempool(100);
+        mempool.insert(pending(1, Some(110)));
+        mempool.insert(pending(2, Some(120)));
+        mempool.insert(pending(3, None));
+
+        mempool.set_target_height(BlockHeight::from_u32(110));
+        assert_eq!(txids(&mempool).len(), 3);
+
+        mempool.set_target_height(BlockHeight::from_u32(111));
+        assert_eq!(txids(&mempool), vec![txid(2), txid(3)]);
+    }
+}
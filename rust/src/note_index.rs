@@ -0,0 +1,1073 @@
+//! An in-memory index of the wallet's spendable notes, for note selection.
+//!
+//! The index holds every unspent note in a mined transaction that has witnesses, sorted by
+//! value, for each wallet (identified by the path of its data database). It is built once by
+//! reading all of the wallet's unspent notes, and is then kept up to date from the wallet
+//! events recorded since (see [`crate::events`]): the notes named by the events are read
+//! again, one by one, and the witness ranges of the other notes follow the scanned tip and the
+//! pruning of old witnesses. It is only rebuilt after a rewind, or when too many events have
+//! been recorded since it was last updated.
+//!
+//! [`select`] plans a selection from the index, and [`IndexedWallet`] makes the upstream
+//! input selector of the create calls choose its notes from the index, loading only the
+//! selected notes from the data database.
+
+use std::collections::{HashMap, HashSet};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+
+use once_cell::sync::Lazy;
+use rusqlite::{named_params, types::Type, Connection, OptionalExtension, Row};
+use secrecy::SecretVec;
+use zcash_client_backend::{
+    address::{AddressMetadata, UnifiedAddress},
+    data_api::{DecryptedTransaction, PrunedBlock, SentTransaction, WalletRead, WalletWrite},
+    keys::{UnifiedFullViewingKey, UnifiedSpendingKey},
+    wallet::{ReceivedSaplingNote, WalletTransparentOutput},
+};
+use zcash_client_sqlite::NoteId;
+use zcash_primitives::{
+    block::BlockHash,
+    consensus::BlockHeight,
+    legacy::TransparentAddress,
+    memo::Memo,
+    merkle_tree::{CommitmentTree, IncrementalWitness},
+    sapling::{Diversifier, Node, Nullifier, Rseed},
+    transaction::{
+        components::{Amount, OutPoint},
+        fees::{fixed::FeeRule as FixedFeeRule, zip317::FeeRule as Zip317FeeRule},
+        Transaction, TxId,
+    },
+    zip32::{AccountId, ExtendedFullViewingKey},
+};
+
+use crate::{balances, events};
+
+static NOTE_INDEXES: Lazy<Mutex<HashMap<PathBuf, Arc<NoteIndex>>>> = Lazy::new(Default::default);
+
+#[derive(Clone, Copy)]
+pub(crate) struct SpendableNote {
+    pub(crate) id_note: i64,
+    pub(crate) value: u64,
+    pub(crate) mined_height: u32,
+    /// The lowest and highest heights at which the wallet has a witness for the note. As
+    /// witnesses are stored for every scanned block from the one the note was mined in, and
+    /// only pruned from the bottom, the note has a witness at every height in this range.
+    pub(crate) witnessed: (u32, u32),
+}
+
+/// The number of events from which [`get`] updates an index; if more events have been
+/// recorded since the index was last updated, it is rebuilt instead.
+const MAX_INCREMENTAL_EVENTS: i64 = 1000;
+
+#[derive(Clone)]
+pub(crate) struct NoteIndex {
+    /// The state of the wallet when the index was last brought up to date.
+    state: WalletState,
+    /// The spendable notes of each account, in decreasing order of value.
+    notes: HashMap<u32, Vec<SpendableNote>>,
+}
+
+#[derive(Clone, Copy, PartialEq, Eq)]
+struct WalletState {
+    /// The latest wallet event sequence number.
+    last_event: i64,
+    /// The lowest and highest scanned heights.
+    scanned_range: Option<(u32, u32)>,
+    /// The lowest height at which any note has a witness.
+    min_witness: Option<u32>,
+}
+
+impl WalletState {
+    fn read(conn: &Connection) -> rusqlite::Result<Self> {
+        Ok(WalletState {
+            last_event: conn.query_row(
+                "SELECT IFNULL(MAX(seq), 0) FROM wallet_events",
+                [],
+                |row| row.get(0),
+            )?,
+            scanned_range: balances::scanned_range(conn)?,
+            min_witness: conn.query_row("SELECT MIN(block) FROM sapling_witnesses", [], |row| {
+                row.get(0)
+            })?,
+        })
+    }
+}
+
+/// The spendable notes, with the account that received them and the heights of their first and
+/// last witnesses.
+const SPENDABLE_NOTES: &str = "SELECT received_notes.account, received_notes.id_note,
+        received_notes.value, transactions.block,
+        MIN(sapling_witnesses.block), MAX(sapling_witnesses.block)
+    FROM received_notes
+    JOIN transactions ON transactions.id_tx = received_notes.tx
+    JOIN sapling_witnesses ON sapling_witnesses.note = received_notes.id_note
+    WHERE received_notes.spent IS NULL
+    AND transactions.block IS NOT NULL";
+
+fn read_note(row: &Row) -> rusqlite::Result<(u32, SpendableNote)> {
+    Ok((
+        row.get(0)?,
+        SpendableNote {
+            id_note: row.get(1)?,
+            value: row.get::<_, i64>(2)? as u64,
+            mined_height: row.get(3)?,
+            witnessed: (row.get(4)?, row.get(5)?),
+        },
+    ))
+}
+
+impl NoteIndex {
+    /// Returns the anchor height for `min_confirmations`, as computed by the upstream
+    /// `get_target_and_anchor_heights`, or `None` if no blocks have been scanned.
+    pub(crate) fn anchor_height(&self, min_confirmations: u32) -> Option<u32> {
+        self.state
+            .scanned_range
+            .map(|(min_height, tip)| balances::anchor_height(min_height, tip, min_confirmations))
+    }
+
+    /// Returns the notes of `account` that were mined at or below `anchor_height` and have a
+    /// witness at it, in decreasing order of value. These are the notes that the upstream
+    /// wallet database can spend at that anchor.
+    pub(crate) fn spendable_notes(
+        &self,
+        account: u32,
+        anchor_height: u32,
+    ) -> impl DoubleEndedIterator<Item = &SpendableNote> {
+        self.notes
+            .get(&account)
+            .into_iter()
+            .flatten()
+            .filter(move |note| {
+                let (first_witness, last_witness) = note.witnessed;
+                note.mined_height <= anchor_height
+                    && first_witness <= anchor_height
+                    && anchor_height <= last_witness
+            })
+    }
+
+    /// Takes the spendable notes of `account` at `anchor_height` that are not in `excluded`,
+    /// in the order of `strategy`, until they are worth at least `target`, and returns their
+    /// IDs. If the notes are worth less than `target`, all of them are returned, as the
+    /// upstream wallet database does.
+    pub(crate) fn selected_notes(
+        &self,
+        account: u32,
+        anchor_height: u32,
+        target: u64,
+        strategy: Strategy,
+        excluded: &HashSet<i64>,
+    ) -> Vec<i64> {
+        let candidates = self
+            .spendable_notes(account, anchor_height)
+            .filter(|note| !excluded.contains(&note.id_note));
+
+        let mut total = 0;
+        strategy
+            .order(candidates)
+            .take_while(|note| {
+                let take = total < target;
+                total += note.value;
+                take
+            })
+            .map(|note| note.id_note)
+            .collect()
+    }
+
+    /// Reads the spendable notes of the wallet in `state` from `conn`.
+    fn build(conn: &Connection, state: WalletState) -> rusqlite::Result<Self> {
+        let mut index = NoteIndex {
+            state,
+            notes: HashMap::new(),
+        };
+        let mut stmt = conn.prepare(&format!(
+            "{} GROUP BY received_notes.id_note
+            ORDER BY received_notes.value DESC, received_notes.id_note",
+            SPENDABLE_NOTES
+        ))?;
+        let mut rows = stmt.query([])?;
+        while let Some(row) = rows.next()? {
+            let (account, note) = read_note(row)?;
+            index.notes.entry(account).or_default().push(note);
+        }
+        Ok(index)
+    }
+
+    /// Brings the index up to date with the wallet in `state`, from the events recorded since
+    /// it was last updated. Returns `false` if the index has to be rebuilt instead: after a
+    /// rewind, if more than [`MAX_INCREMENTAL_EVENTS`] events have been recorded, or if some
+    /// of them have been trimmed.
+    fn update(&mut self, conn: &Connection, state: WalletState) -> rusqlite::Result<bool> {
+        let (last_tip, tip, min_witness) = match (
+            self.state.scanned_range,
+            state.scanned_range,
+            state.min_witness,
+        ) {
+            (Some((_, last_tip)), Some((_, tip)), Some(min_witness)) if last_tip <= tip => {
+                (last_tip, tip, min_witness)
+            }
+            _ => return Ok(false),
+        };
+        let pending = state.last_event - self.state.last_event;
+        if !(0..=MAX_INCREMENTAL_EVENTS).contains(&pending) {
+            return Ok(false);
+        }
+        let events = events::get_since(conn, self.state.last_event, pending as u32)?;
+        if events.len() as i64 != pending
+            || events.iter().any(|event| event.kind == events::KIND_REWIND)
+        {
+            return Ok(false);
+        }
+
+        // The notes that have been received, spent or unspent, or whose transactions have been
+        // mined, are read again.
+        let mut changed = HashSet::new();
+        let mut tx_notes =
+            conn.prepare_cached("SELECT id_note FROM received_notes WHERE tx = ?")?;
+        for event in &events {
+            match (event.kind, event.id_tx, event.id_note) {
+                (events::KIND_TX_MINED, Some(id_tx), _) => {
+                    for id_note in tx_notes.query_map([id_tx], |row| row.get(0))? {
+                        changed.insert(id_note?);
+                    }
+                }
+                (_, _, Some(id_note)) => {
+                    changed.insert(id_note);
+                }
+                _ => (),
+            }
+        }
+
+        // Scanning adds a witness at every new block for each note that was witnessed at the
+        // previous tip, and prunes the witnesses below a height for all notes at once.
+        for notes in self.notes.values_mut() {
+            for note in notes.iter_mut() {
+                if note.witnessed.1 == last_tip {
+                    note.witnessed.1 = tip;
+                }
+                note.witnessed.0 = note.witnessed.0.max(min_witness);
+            }
+            notes.retain(|note| {
+                !changed.contains(&note.id_note) && note.witnessed.0 <= note.witnessed.1
+            });
+        }
+
+        let mut read = conn.prepare_cached(&format!(
+            "{} AND received_notes.id_note = ? GROUP BY received_notes.id_note",
+            SPENDABLE_NOTES
+        ))?;
+        for id_note in changed {
+            if let Some((account, note)) = read.query_row([id_note], read_note).optional()? {
+                self.insert(account, note);
+            }
+        }
+
+        self.state = state;
+        Ok(true)
+    }
+
+    /// Inserts `note` among the notes of `account`, keeping them in decreasing order of value.
+    fn insert(&mut self, account: u32, note: SpendableNote) {
+        let notes = self.notes.entry(account).or_default();
+        let position = notes.partition_point(|other| {
+            other.value > note.value || (other.value == note.value && other.id_note < note.id_note)
+        });
+        notes.insert(position, note);
+    }
+}
+
+/// Returns the note index of the wallet at `db_path`, bringing it up to date from `conn` if
+/// the wallet has changed since it was last updated.
+pub(crate) fn get(conn: &Connection, db_path: &Path) -> rusqlite::Result<Arc<NoteIndex>> {
+    let state = WalletState::read(conn)?;
+    let cached = {
+        let mut indexes = NOTE_INDEXES.lock().unwrap();
+        if let Some(index) = indexes.get(db_path) {
+            if index.state == state {
+                return Ok(index.clone());
+            }
+        }
+        indexes.remove(db_path)
+    };
+
+    let index = match cached {
+        Some(index) => {
+            // The index is only copied if a selection is still using it.
+            let mut index = Arc::try_unwrap(index).unwrap_or_else(|index| (*index).clone());
+            if index.update(conn, state)? {
+                index
+            } else {
+                NoteIndex::build(conn, state)?
+            }
+        }
+        None => NoteIndex::build(conn, state)?,
+    };
+    let index = Arc::new(index);
+    NOTE_INDEXES
+        .lock()
+        .unwrap()
+        .insert(db_path.to_path_buf(), index.clone());
+    Ok(index)
+}
+
+/// Reads the notes in `note_ids` that are unspent and have a witness at `anchor_height`, in
+/// the form in which the upstream wallet database returns them to its input selector.
+fn read_spendable_notes(
+    conn: &Connection,
+    note_ids: &[i64],
+    anchor_height: u32,
+) -> rusqlite::Result<Vec<ReceivedSaplingNote<NoteId>>> {
+    let mut stmt = conn.prepare_cached(
+        "SELECT received_notes.diversifier, received_notes.value, received_notes.rcm,
+            sapling_witnesses.witness
+        FROM received_notes
+        JOIN sapling_witnesses ON sapling_witnesses.note = received_notes.id_note
+        WHERE received_notes.id_note = :id_note
+        AND received_notes.spent IS NULL
+        AND sapling_witnesses.block = :anchor_height",
+    )?;
+    let corrupt = |column: usize, column_type: Type, message: &str| {
+        rusqlite::Error::FromSqlConversionFailure(column, column_type, message.into())
+    };
+
+    let mut notes = Vec::with_capacity(note_ids.len());
+    for id_note in note_ids {
+        let note = stmt
+            .query_row(
+                named_params! {":id_note": id_note, ":anchor_height": anchor_height},
+                |row| {
+                    let diversifier = row
+                        .get::<_, Vec<u8>>(0)?
+                        .try_into()
+                        .map(Diversifier)
+                        .map_err(|_| corrupt(0, Type::Blob, "Invalid diversifier length"))?;
+                    let note_value = Amount::from_i64(row.get(1)?)
+                        .map_err(|()| corrupt(1, Type::Integer, "Invalid note value"))?;
+                    // As upstream does, the note is spent as a pre-ZIP 212 note, from its rcm.
+                    let rcm: [u8; 32] = row
+                        .get::<_, Vec<u8>>(2)?
+                        .try_into()
+                        .map_err(|_| corrupt(2, Type::Blob, "Invalid rcm length"))?;
+                    let rcm = Option::from(jubjub::Fr::from_bytes(&rcm))
+                        .ok_or_else(|| corrupt(2, Type::Blob, "Invalid rcm"))?;
+                    let witness = IncrementalWitness::<Node>::read(&row.get::<_, Vec<u8>>(3)?[..])
+                        .map_err(|e| {
+                            rusqlite::Error::FromSqlConversionFailure(3, Type::Blob, Box::new(e))
+                        })?;
+                    Ok(ReceivedSaplingNote {
+                        note_id: NoteId::ReceivedNoteId(*id_note),
+                        diversifier,
+                        note_value,
+                        rseed: Rseed::BeforeZip212(rcm),
+                        witness,
+                    })
+                },
+            )
+            .optional()?;
+        notes.extend(note);
+    }
+    Ok(notes)
+}
+
+/// The order in which notes are considered for selection.
+#[derive(Clone, Copy)]
+pub(crate) enum Strategy {
+    /// The largest notes first, which minimises the number of inputs and therefore the fee
+    /// under ZIP 317 and the proving time.
+    LargestFirst,
+    /// The smallest notes first, which consolidates small notes. Notes worth at most
+    /// `min_value` are skipped.
+    SmallestFirst { min_value: u64 },
+    /// The notes in the order they were received, which is the order in which the upstream
+    /// wallet database offers them to its input selector.
+    OldestFirst,
+}
+
+impl Strategy {
+    /// Orders `notes`, which are in decreasing order of value, leaving out the notes that the
+    /// strategy skips.
+    pub(crate) fn order<'a>(
+        self,
+        notes: impl DoubleEndedIterator<Item = &'a SpendableNote> + 'a,
+    ) -> Box<dyn Iterator<Item = &'a SpendableNote> + 'a> {
+        match self {
+            Strategy::LargestFirst => Box::new(notes),
+            Strategy::SmallestFirst { min_value } => {
+                Box::new(notes.rev().filter(move |note| note.value > min_value))
+            }
+            Strategy::OldestFirst => {
+                let mut notes = notes.collect::<Vec<_>>();
+                notes.sort_unstable_by_key(|note| note.id_note);
+                Box::new(notes.into_iter())
+            }
+        }
+    }
+}
+
+/// How the fee of a transaction is computed from its number of inputs and outputs.
+#[derive(Clone, Copy)]
+pub(crate) enum FeeModel {
+    Fixed(u64),
+    /// [ZIP 317], for a transaction with Sapling inputs and P2PKH outputs.
+    ///
+    /// [ZIP 317]: https://zips.z.cash/zip-0317
+    Zip317 {
+        marginal_fee: u64,
+        grace_actions: usize,
+    },
+}
+
+impl FeeModel {
+    /// Returns the model of the fee rule used by the create and shield calls.
+    pub(crate) fn standard(use_zip317_fees: bool) -> Self {
+        let zats = |amount: Amount| i64::from(amount) as u64;
+        if use_zip317_fees {
+            let rule = Zip317FeeRule::standard();
+            FeeModel::Zip317 {
+                marginal_fee: zats(rule.marginal_fee()),
+                grace_actions: rule.grace_actions(),
+            }
+        } else {
+            FeeModel::Fixed(zats(FixedFeeRule::standard().fixed_fee()))
+        }
+    }
+
+    /// Returns the amount by which one more input can raise the fee. Under ZIP 317, a note worth
+    /// no more than this may not pay for its own spend.
+    pub(crate) fn marginal_fee(&self) -> u64 {
+        match self {
+            FeeModel::Fixed(_) => 0,
+            FeeModel::Zip317 { marginal_fee, .. } => *marginal_fee,
+        }
+    }
+
+    pub(crate) fn fee(&self, inputs: usize, outputs: Outputs) -> u64 {
+        match self {
+            FeeModel::Fixed(fee) => *fee,
+            FeeModel::Zip317 {
+                marginal_fee,
+                grace_actions,
+            } => {
+                let logical_actions = inputs.max(outputs.sapling) + outputs.transparent;
+                marginal_fee * logical_actions.max(*grace_actions) as u64
+            }
+        }
+    }
+}
+
+/// The number of outputs paying the recipients of a transaction.
+#[derive(Clone, Copy)]
+pub(crate) struct Outputs {
+    pub(crate) sapling: usize,
+    pub(crate) transparent: usize,
+}
+
+impl Outputs {
+    fn with_change(self) -> Self {
+        Outputs {
+            sapling: self.sapling + 1,
+            ..self
+        }
+    }
+}
+
+pub(crate) struct Selection {
+    pub(crate) note_ids: Vec<i64>,
+    pub(crate) fee: u64,
+    pub(crate) change: u64,
+}
+
+/// Selects notes from `notes` (in decreasing order of value) to pay `amount` to `outputs`,
+/// adding a Sapling change output if needed.
+///
+/// Returns `None` if the notes are insufficient.
+pub(crate) fn select<'a>(
+    notes: impl DoubleEndedIterator<Item = &'a SpendableNote> + 'a,
+    amount: u64,
+    outputs: Outputs,
+    fee_model: FeeModel,
+    strategy: Strategy,
+) -> Option<Selection> {
+    let mut note_ids = vec![];
+    let mut total = 0;
+    for note in strategy.order(notes) {
+        note_ids.push(note.id_note);
+        total += note.value;
+
+        let fee = fee_model.fee(note_ids.len(), outputs);
+        if total == amount + fee {
+            return Some(Selection {
+                note_ids,
+                fee,
+                change: 0,
+            });
+        }
+        let fee = fee_model.fee(note_ids.len(), outputs.with_change());
+        if total >= amount + fee {
+            return Some(Selection {
+                note_ids,
+                fee,
+                change: total - amount - fee,
+            });
+        }
+    }
+    None
+}
+
+/// A wallet database whose spendable notes are selected from a [`NoteIndex`] with a
+/// [`Strategy`], and which otherwise behaves as the wrapped database.
+///
+/// The upstream greedy input selector repeatedly asks the wallet for notes worth at least the
+/// amount it still needs, and recomputes the fee with them. Each time, this wrapper takes
+/// notes from the index in the order of the strategy until the amount is covered, and reads
+/// only those notes, with their witnesses at the anchor height, from the data database
+/// through `conn`. A note that is no longer spendable is left out, so a stale index can only
+/// make the selection worse, never invalid.
+///
+/// When the account of the spending key is already known (see [`IndexedWallet::with_account`]),
+/// the upstream lookup of the account of its viewing key is answered without a query.
+pub(crate) struct IndexedWallet<'a, W> {
+    inner: &'a mut W,
+    conn: &'a Connection,
+    index: Arc<NoteIndex>,
+    strategy: Strategy,
+    known_account: Option<(&'a UnifiedFullViewingKey, AccountId)>,
+}
+
+impl<'a, W> IndexedWallet<'a, W> {
+    pub(crate) fn new(
+        inner: &'a mut W,
+        conn: &'a Connection,
+        index: Arc<NoteIndex>,
+        strategy: Strategy,
+    ) -> Self {
+        IndexedWallet {
+            inner,
+            conn,
+            index,
+            strategy,
+            known_account: None,
+        }
+    }
+
+    /// Records that `ufvk` is the viewing key of `account`.
+    pub(crate) fn with_account(
+        mut self,
+        known_account: Option<(&'a UnifiedFullViewingKey, AccountId)>,
+    ) -> Self {
+        self.known_account = known_account;
+        self
+    }
+}
+
+/// Returns whether two unified full viewing keys have the same components.
+fn same_ufvk(a: &UnifiedFullViewingKey, b: &UnifiedFullViewingKey) -> bool {
+    a.sapling().map(|k| k.to_bytes()) == b.sapling().map(|k| k.to_bytes())
+        && a.transparent().map(|k| k.serialize()) == b.transparent().map(|k| k.serialize())
+}
+
+impl<'a, W: WalletRead<NoteRef = NoteId>> WalletRead for IndexedWallet<'a, W>
+where
+    W::Error: From<rusqlite::Error>,
+{
+    type Error = W::Error;
+    type NoteRef = NoteId;
+    type TxRef = W::TxRef;
+
+    fn block_height_extrema(&self) -> Result<Option<(BlockHeight, BlockHeight)>, Self::Error> {
+        self.inner.block_height_extrema()
+    }
+
+    fn get_min_unspent_height(&self) -> Result<Option<BlockHeight>, Self::Error> {
+        self.inner.get_min_unspent_height()
+    }
+
+    fn get_block_hash(&self, block_height: BlockHeight) -> Result<Option<BlockHash>, Self::Error> {
+        self.inner.get_block_hash(block_height)
+    }
+
+    fn get_tx_height(&self, txid: TxId) -> Result<Option<BlockHeight>, Self::Error> {
+        self.inner.get_tx_height(txid)
+    }
+
+    fn get_current_address(
+        &self,
+        account: AccountId,
+    ) -> Result<Option<UnifiedAddress>, Self::Error> {
+        self.inner.get_current_address(account)
+    }
+
+    fn get_unified_full_viewing_keys(
+        &self,
+    ) -> Result<HashMap<AccountId, UnifiedFullViewingKey>, Self::Error> {
+        self.inner.get_unified_full_viewing_keys()
+    }
+
+    fn get_account_for_ufvk(
+        &self,
+        ufvk: &UnifiedFullViewingKey,
+    ) -> Result<Option<AccountId>, Self::Error> {
+        match self.known_account {
+            Some((known, account)) if same_ufvk(known, ufvk) => Ok(Some(account)),
+            _ => self.inner.get_account_for_ufvk(ufvk),
+        }
+    }
+
+    fn is_valid_account_extfvk(
+        &self,
+        account: AccountId,
+        extfvk: &ExtendedFullViewingKey,
+    ) -> Result<bool, Self::Error> {
+        self.inner.is_valid_account_extfvk(account, extfvk)
+    }
+
+    fn get_balance_at(
+        &self,
+        account: AccountId,
+        anchor_height: BlockHeight,
+    ) -> Result<Amount, Self::Error> {
+        self.inner.get_balance_at(account, anchor_height)
+    }
+
+    fn get_transaction(&self, id_tx: Self::TxRef) -> Result<Transaction, Self::Error> {
+        self.inner.get_transaction(id_tx)
+    }
+
+    fn get_memo(&self, id_note: Self::NoteRef) -> Result<Memo, Self::Error> {
+        self.inner.get_memo(id_note)
+    }
+
+    fn get_commitment_tree(
+        &self,
+        block_height: BlockHeight,
+    ) -> Result<Option<CommitmentTree<Node>>, Self::Error> {
+        self.inner.get_commitment_tree(block_height)
+    }
+
+    #[allow(clippy::type_complexity)]
+    fn get_witnesses(
+        &self,
+        block_height: BlockHeight,
+    ) -> Result<Vec<(Self::NoteRef, IncrementalWitness<Node>)>, Self::Error> {
+        self.inner.get_witnesses(block_height)
+    }
+
+    fn get_nullifiers(&self) -> Result<Vec<(AccountId, Nullifier)>, Self::Error> {
+        self.inner.get_nullifiers()
+    }
+
+    fn get_all_nullifiers(&self) -> Result<Vec<(AccountId, Nullifier)>, Self::Error> {
+        self.inner.get_all_nullifiers()
+    }
+
+    fn get_spendable_sapling_notes(
+        &self,
+        account: AccountId,
+        anchor_height: BlockHeight,
+        exclude: &[Self::NoteRef],
+    ) -> Result<Vec<ReceivedSaplingNote<Self::NoteRef>>, Self::Error> {
+        self.inner
+            .get_spendable_sapling_notes(account, anchor_height, exclude)
+    }
+
+    fn select_spendable_sapling_notes(
+        &self,
+        account: AccountId,
+        target_value: Amount,
+        anchor_height: BlockHeight,
+        exclude: &[Self::NoteRef],
+    ) -> Result<Vec<ReceivedSaplingNote<Self::NoteRef>>, Self::Error> {
+        let excluded: HashSet<i64> = exclude
+            .iter()
+            .filter_map(|note_ref| match note_ref {
+                NoteId::ReceivedNoteId(id_note) => Some(*id_note),
+                NoteId::SentNoteId(_) => None,
+            })
+            .collect();
+        let selected = self.index.selected_notes(
+            u32::from(account),
+            u32::from(anchor_height),
+            u64::try_from(i64::from(target_value)).unwrap_or(0),
+            self.strategy,
+            &excluded,
+        );
+
+        Ok(read_spendable_notes(
+            self.conn,
+            &selected,
+            u32::from(anchor_height),
+        )?)
+    }
+
+    fn get_transparent_receivers(
+        &self,
+        account: AccountId,
+    ) -> Result<HashMap<TransparentAddress, AddressMetadata>, Self::Error> {
+        self.inner.get_transparent_receivers(account)
+    }
+
+    fn get_unspent_transparent_outputs(
+        &self,
+        address: &TransparentAddress,
+        max_height: BlockHeight,
+        exclude: &[OutPoint],
+    ) -> Result<Vec<WalletTransparentOutput>, Self::Error> {
+        self.inner
+            .get_unspent_transparent_outputs(address, max_height, exclude)
+    }
+
+    fn get_transparent_balances(
+        &self,
+        account: AccountId,
+        max_height: BlockHeight,
+    ) -> Result<HashMap<TransparentAddress, Amount>, Self::Error> {
+        self.inner.get_transparent_balances(account, max_height)
+    }
+}
+
+impl<'a, W: WalletWrite<NoteRef = NoteId>> WalletWrite for IndexedWallet<'a, W>
+where
+    W::Error: From<rusqlite::Error>,
+{
+    type UtxoRef = W::UtxoRef;
+
+    fn create_account(
+        &mut self,
+        seed: &SecretVec<u8>,
+    ) -> Result<(AccountId, UnifiedSpendingKey), Self::Error> {
+        self.inner.create_account(seed)
+    }
+
+    fn get_next_available_address(
+        &mut self,
+        account: AccountId,
+    ) -> Result<Option<UnifiedAddress>, Self::Error> {
+        self.inner.get_next_available_address(account)
+    }
+
+    #[allow(clippy::type_complexity)]
+    fn advance_by_block(
+        &mut self,
+        block: &PrunedBlock,
+        updated_witnesses: &[(Self::NoteRef, IncrementalWitness<Node>)],
+    ) -> Result<Vec<(Self::NoteRef, IncrementalWitness<Node>)>, Self::Error> {
+        self.inner.advance_by_block(block, updated_witnesses)
+    }
+
+    fn store_decrypted_tx(
+        &mut self,
+        received_tx: &DecryptedTransaction,
+    ) -> Result<Self::TxRef, Self::Error> {
+        self.inner.store_decrypted_tx(received_tx)
+    }
+
+    fn store_sent_tx(&mut self, sent_tx: &SentTransaction) -> Result<Self::TxRef, Self::Error> {
+        self.inner.store_sent_tx(sent_tx)
+    }
+
+    fn truncate_to_height(&mut self, block_height: BlockHeight) -> Result<(), Self::Error> {
+        self.inner.truncate_to_height(block_height)
+    }
+
+    fn put_received_transparent_utxo(
+        &mut self,
+        output: &WalletTransparentOutput,
+    ) -> Result<Self::UtxoRef, Self::Error> {
+        self.inner.put_received_transparent_utxo(output)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use std::collections::HashSet;
+    use std::path::Path;
+
+    use rusqlite::{named_params, Connection};
+
+    use super::*;
+    use crate::wallet_ext::test_wallet;
+
+    /// Adds a note of `value` mined at `block`, with witnesses from `block` to `tip`.
+    fn add_note(conn: &Connection, id_note: i64, value: i64, block: u32, tip: u32) {
+        conn.execute(
+            "INSERT INTO transactions (id_tx, txid, block) VALUES (:id, :txid, :block)",
+            named_params! {":id": id_note, ":txid": &id_note.to_le_bytes()[..], ":block": block},
+        )
+        .unwrap();
+        conn.execute(
+            "INSERT INTO received_notes (id_note, tx, account, value)
+            VALUES (:id, :id, 0, :value)",
+            named_params! {":id": id_note, ":value": value},
+        )
+        .unwrap();
+        for height in block..=tip {
+            conn.execute(
+                "INSERT INTO sapling_witnesses (note, block, witness) VALUES (?, ?, x'00')",
+                [id_note, i64::from(height)],
+            )
+            .unwrap();
+        }
+    }
+
+    fn wallet() -> Connection {
+        let conn = test_wallet();
+        for height in 100..=110 {
+            conn.execute("INSERT INTO blocks (height) VALUES (?)", [height])
+                .unwrap();
+        }
+        add_note(&conn, 1, 10_000, 100, 110);
+        add_note(&conn, 2, 30_000, 101, 110);
+        add_note(&conn, 3, 20_000, 102, 110);
+        add_note(&conn, 4, 5_000, 110, 110);
+        conn
+    }
+
+    fn ids<'a>(notes: impl Iterator<Item = &'a SpendableNote>) -> Vec<i64> {
+        notes.map(|note| note.id_note).collect()
+    }
+
+    #[test]
+    fn index_requires_witness_at_anchor() {
+        let conn = wallet();
+        // Note 3 has lost its witnesses below 105.
+        conn.execute(
+            "DELETE FROM sapling_witnesses WHERE note = 3 AND block < 105",
+            [],
+        )
+        .unwrap();
+        // Note 1 is spent, note 5 has no witness at all.
+        conn.execute("UPDATE received_notes SET spent = 4 WHERE id_note = 1", [])
+            .unwrap();
+        conn.execute_batch(
+            "INSERT INTO transactions (id_tx, txid, block) VALUES (5, x'05', 100);
+            INSERT INTO received_notes (id_note, tx, account, value) VALUES (5, 5, 0, 1);",
+        )
+        .unwrap();
+
+        let index = get(&conn, Path::new("/note_index/witness")).unwrap();
+        assert_eq!(index.anchor_height(1), Some(110));
+        assert_eq!(ids(index.spendable_notes(0, 110)), vec![2, 3, 4]);
+        assert_eq!(ids(index.spendable_notes(0, 104)), vec![2]);
+        assert!(index.spendable_notes(1, 110).next().is_none());
+    }
+
+    /// Scans `block` as upstream does: every note witnessed at the previous block gets a
+    /// witness at it.
+    fn scan(conn: &Connection, block: u32) {
+        conn.execute_batch(&format!(
+            "INSERT INTO blocks (height) VALUES ({block});
+            INSERT INTO sapling_witnesses (note, block, witness)
+                SELECT note, {block}, witness FROM sapling_witnesses WHERE block = {block} - 1;",
+            block = block
+        ))
+        .unwrap();
+    }
+
+    fn witnessed(index: &NoteIndex) -> Vec<(i64, (u32, u32))> {
+        index.notes[&0]
+            .iter()
+            .map(|note| (note.id_note, note.witnessed))
+            .collect()
+    }
+
+    #[test]
+    fn index_is_updated_after_changes() {
+        let conn = wallet();
+        let path = Path::new("/note_index/update");
+        let index = get(&conn, path).unwrap();
+        assert!(Arc::ptr_eq(&index, &get(&conn, path).unwrap()));
+
+        conn.execute("UPDATE received_notes SET spent = 4 WHERE id_note = 2", [])
+            .unwrap();
+        let index = get(&conn, path).unwrap();
+        assert_eq!(ids(index.spendable_notes(0, 110)), vec![3, 1, 4]);
+
+        // Scan two blocks, receiving a note in the second, then prune the witnesses below 102.
+        scan(&conn, 111);
+        scan(&conn, 112);
+        add_note(&conn, 6, 20_000, 112, 112);
+        conn.execute("DELETE FROM sapling_witnesses WHERE block < 102", [])
+            .unwrap();
+        drop(index);
+        let updated = get(&conn, path).unwrap();
+        assert_eq!(
+            witnessed(&updated),
+            vec![
+                (3, (102, 112)),
+                (6, (112, 112)),
+                (1, (102, 112)),
+                (4, (110, 112))
+            ]
+        );
+
+        // The updated index matches one built from scratch.
+        let rebuilt = get(&conn, Path::new("/note_index/update/rebuilt")).unwrap();
+        assert_eq!(witnessed(&updated), witnessed(&rebuilt));
+
+        // A rewind rebuilds the index.
+        conn.execute_batch(
+            "DELETE FROM sapling_witnesses WHERE block > 111;
+            DELETE FROM received_notes WHERE id_note = 6;
+            DELETE FROM blocks WHERE height > 111;",
+        )
+        .unwrap();
+        crate::events::record_rewind(&conn, 111).unwrap();
+        let index = get(&conn, path).unwrap();
+        assert_eq!(
+            witnessed(&index),
+            vec![(3, (102, 111)), (1, (102, 111)), (4, (110, 111))]
+        );
+    }
+
+    #[test]
+    fn select_follows_strategy() {
+        let conn = wallet();
+        let index = get(&conn, Path::new("/note_index/select")).unwrap();
+        let outputs = Outputs {
+            sapling: 1,
+            transparent: 0,
+        };
+        let fixed = FeeModel::Fixed(10_000);
+
+        let selection = select(
+            index.spendable_notes(0, 110),
+            15_000,
+            outputs,
+            fixed,
+            Strategy::LargestFirst,
+        )
+        .unwrap();
+        assert_eq!(
+            (selection.note_ids, selection.fee, selection.change),
+            (vec![2], 10_000, 5_000)
+        );
+
+        let selection = select(
+            index.spendable_notes(0, 110),
+            15_000,
+            outputs,
+            fixed,
+            Strategy::SmallestFirst { min_value: 0 },
+        )
+        .unwrap();
+        assert_eq!(selection.note_ids, vec![4, 1, 3]);
+        assert_eq!(selection.change, 10_000);
+
+        let selection = select(
+            index.spendable_notes(0, 110),
+            30_000,
+            outputs,
+            fixed,
+            Strategy::OldestFirst,
+        )
+        .unwrap();
+        assert_eq!((selection.note_ids, selection.change), (vec![1, 2], 0));
+
+        assert!(select(
+            index.spendable_notes(0, 110),
+            60_000,
+            outputs,
+            fixed,
+            Strategy::LargestFirst,
+        )
+        .is_none());
+    }
+
+    #[test]
+    fn zip317_fee_counts_logical_actions() {
+        let zip317 = FeeModel::Zip317 {
+            marginal_fee: 5_000,
+            grace_actions: 2,
+        };
+        let outputs = Outputs {
+            sapling: 1,
+            transparent: 1,
+        };
+        assert_eq!(zip317.fee(1, outputs), 10_000);
+        assert_eq!(zip317.fee(3, outputs), 20_000);
+        assert_eq!(zip317.fee(2, outputs.with_change()), 15_000);
+    }
+
+    #[test]
+    fn selected_notes_follow_strategy() {
+        let conn = wallet();
+        let index = get(&conn, Path::new("/note_index/selected")).unwrap();
+        let none = HashSet::new();
+
+        assert_eq!(
+            index.selected_notes(0, 110, 25_000, Strategy::LargestFirst, &none),
+            vec![2]
+        );
+        assert_eq!(
+            index.selected_notes(
+                0,
+                110,
+                25_000,
+                Strategy::SmallestFirst { min_value: 0 },
+                &none
+            ),
+            vec![4, 1, 3]
+        );
+        assert_eq!(
+            index.selected_notes(0, 110, 25_000, Strategy::LargestFirst, &[2].into()),
+            vec![3, 1]
+        );
+        assert_eq!(
+            index.selected_notes(0, 110, 100_000, Strategy::LargestFirst, &none),
+            vec![2, 3, 1, 4]
+        );
+    }
+
+    #[test]
+    fn read_spendable_notes_requires_unspent_note_with_witness() {
+        let conn = wallet();
+        conn.execute("UPDATE received_notes SET spent = 4 WHERE id_note = 1", [])
+            .unwrap();
+        // Note 1 is spent, and note 4 has no witness at 105.
+        assert!(read_spendable_notes(&conn, &[1, 4], 105)
+            .unwrap()
+            .is_empty());
+
+        // A diversifier of the wrong length is reported as corrupt data.
+        conn.execute(
+            "UPDATE received_notes SET diversifier = x'00' WHERE id_note = 2",
+            [],
+        )
+        .unwrap();
+        assert!(matches!(
+            read_spendable_notes(&conn, &[2], 105),
+            Err(rusqlite::Error::FromSqlConversionFailure(0, _, _))
+        ));
+    }
+
+    #[test]
+    fn smallest_first_skips_notes_below_marginal_fee() {
+        let conn = wallet();
+        let index = get(&conn, Path::new("/note_index/consolidate")).unwrap();
+        let zip317 = FeeModel::standard(true);
+        let strategy = Strategy::SmallestFirst {
+            min_value: zip317.marginal_fee(),
+        };
+        assert_eq!(zip317.marginal_fee(), 5_000);
+        assert_eq!(
+            ids(strategy.order(index.spendable_notes(0, 110))),
+            vec![1, 3, 2]
+        );
+
+        // A consolidation of the three notes pays 60000 - 15000 to the account. Whatever the
+        // upstream selector asks for on the way to that, the skipped note is never offered.
+        let none = HashSet::new();
+        assert_eq!(
+            index.selected_notes(0, 110, 55_000, strategy, &none),
+            vec![1, 3, 2]
+        );
+        assert_eq!(
+            index.selected_notes(0, 110, 60_000, strategy, &none),
+            vec![1, 3, 2]
+        );
+        assert_eq!(
+            index.selected_notes(0, 110, 25_000, strategy, &none),
+            vec![1, 3]
+        );
+    }
+}
@@ -0,0 +1,206 @@
+//! The thread pool on which transactions are built and proven.
+//!
+//! Groth16 proving in `bellman` splits each proof's multi-exponentiations and FFTs across the
+//! Rayon thread pool that it is run on. Running the transaction builder on a dedicated pool
+//! keeps proving from competing with the parallel trial decryption that runs on the global
+//! pool, and lets the host bound the number of threads used for proving.
+
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+
+use once_cell::sync::Lazy;
+use rayon::{ThreadPool, ThreadPoolBuildError, ThreadPoolBuilder};
+use zcash_primitives::{
+    merkle_tree::MerklePath,
+    sapling::{
+        prover::TxProver,
+        redjubjub::{PublicKey, Signature},
+        Diversifier, Node, PaymentAddress, ProofGenerationKey, Rseed,
+    },
+    transaction::components::{Amount, GROTH_PROOF_SIZE},
+};
+use zcash_proofs::prover::LocalTxProver;
+
+/// The default time, in milliseconds, that [`estimate_time`] assumes for one Sapling spend
+/// proof on one thread.
+///
+/// This is a planning figure rather than a measurement: it errs on the slow side of the
+/// order of a second that a spend proof (a circuit of 98,777 constraints) takes on a single
+/// core of a mid-range phone. Hosts that time proving on their devices should pass their own
+/// figures to [`set_proof_times`].
+const DEFAULT_SPEND_PROOF_MS: u64 = 1500;
+
+/// The default time, in milliseconds, that [`estimate_time`] assumes for one Sapling output
+/// proof on one thread.
+///
+/// The output circuit (7,827 constraints) is about a twelfth of the size of the spend circuit,
+/// so a third of [`DEFAULT_SPEND_PROOF_MS`] also errs on the slow side.
+const DEFAULT_OUTPUT_PROOF_MS: u64 = 500;
+
+static SPEND_PROOF_MS: AtomicU64 = AtomicU64::new(DEFAULT_SPEND_PROOF_MS);
+static OUTPUT_PROOF_MS: AtomicU64 = AtomicU64::new(DEFAULT_OUTPUT_PROOF_MS);
+
+/// The number of Sapling outputs that the transaction builder pads a Sapling bundle to.
+const MIN_SAPLING_OUTPUTS: usize = 2;
+
+static PROVING_POOL: Lazy<Mutex<Option<Arc<ThreadPool>>>> = Lazy::new(Default::default);
+
+fn build_pool(max_threads: usize) -> Result<ThreadPool, ThreadPoolBuildError> {
+    ThreadPoolBuilder::new()
+        .num_threads(max_threads)
+        .thread_name(|i| format!("piratelc-proving-{}", i))
+        .build()
+}
+
+/// Replaces the proving thread pool with one of `max_threads` threads, or one thread per CPU
+/// if `max_threads` is `0`. Transactions that are being built keep using the previous pool.
+pub(crate) fn set_max_threads(max_threads: usize) -> Result<(), ThreadPoolBuildError> {
+    let pool = build_pool(max_threads)?;
+    *PROVING_POOL.lock().unwrap() = Some(Arc::new(pool));
+    Ok(())
+}
+
+/// Runs `op` on the proving thread pool, creating it with one thread per CPU if
+/// [`set_max_threads`] has not been called.
+pub(crate) fn install<OP, R>(op: OP) -> Result<R, ThreadPoolBuildError>
+where
+    OP: FnOnce() -> R + Send,
+    R: Send,
+{
+    let pool = {
+        let mut pool = PROVING_POOL.lock().unwrap();
+        match pool.as_ref() {
+            Some(pool) => pool.clone(),
+            None => pool.insert(Arc::new(build_pool(0)?)).clone(),
+        }
+    };
+    Ok(pool.install(op))
+}
+
+/// A prover that borrows a [`LocalTxProver`], so that several transactions can be proven with
+/// parameters that were loaded once. The upstream transaction functions take their prover by
+/// value.
+pub(crate) struct SharedTxProver<'a>(pub(crate) &'a LocalTxProver);
+
+impl TxProver for SharedTxProver<'_> {
+    type SaplingProvingContext = <LocalTxProver as TxProver>::SaplingProvingContext;
+
+    fn new_sapling_proving_context(&self) -> Self::SaplingProvingContext {
+        self.0.new_sapling_proving_context()
+    }
+
+    fn spend_proof(
+        &self,
+        ctx: &mut Self::SaplingProvingContext,
+        proof_generation_key: ProofGenerationKey,
+        diversifier: Diversifier,
+        rseed: Rseed,
+        ar: jubjub::Fr,
+        value: u64,
+        anchor: bls12_381::Scalar,
+        merkle_path: MerklePath<Node>,
+    ) -> Result<([u8; GROTH_PROOF_SIZE], jubjub::ExtendedPoint, PublicKey), ()> {
+        self.0.spend_proof(
+            ctx,
+            proof_generation_key,
+            diversifier,
+            rseed,
+            ar,
+            value,
+            anchor,
+            merkle_path,
+        )
+    }
+
+    fn output_proof(
+        &self,
+        ctx: &mut Self::SaplingProvingContext,
+        esk: jubjub::Fr,
+        payment_address: PaymentAddress,
+        rcm: jubjub::Fr,
+        value: u64,
+    ) -> ([u8; GROTH_PROOF_SIZE], jubjub::ExtendedPoint) {
+        self.0.output_proof(ctx, esk, payment_address, rcm, value)
+    }
+
+    fn binding_sig(
+        &self,
+        ctx: &mut Self::SaplingProvingContext,
+        value_balance: Amount,
+        sighash: &[u8; 32],
+    ) -> Result<Signature, ()> {
+        self.0.binding_sig(ctx, value_balance, sighash)
+    }
+}
+
+/// Sets the single-threaded proof times that [`estimate_time`] assumes, in milliseconds.
+/// Passing `0` for either restores its default.
+pub(crate) fn set_proof_times(spend_proof_ms: u64, output_proof_ms: u64) {
+    let or_default = |ms, default| if ms == 0 { default } else { ms };
+    SPEND_PROOF_MS.store(
+        or_default(spend_proof_ms, DEFAULT_SPEND_PROOF_MS),
+        Ordering::Relaxed,
+    );
+    OUTPUT_PROOF_MS.store(
+        or_default(output_proof_ms, DEFAULT_OUTPUT_PROOF_MS),
+        Ordering::Relaxed,
+    );
+}
+
+/// Estimates how long proving a transaction with `spends` Sapling spends and `outputs` Sapling
+/// outputs takes on the proving thread pool.
+///
+/// The estimate assumes that proving scales linearly with the number of threads, so it is
+/// optimistic on pools of many threads.
+pub(crate) fn estimate_time(spends: usize, outputs: usize) -> Duration {
+    let threads = match PROVING_POOL.lock().unwrap().as_ref() {
+        Some(pool) => pool.current_num_threads(),
+        None => std::thread::available_parallelism().map_or(1, |n| n.get()),
+    };
+    estimate(
+        spends,
+        outputs,
+        threads,
+        Duration::from_millis(SPEND_PROOF_MS.load(Ordering::Relaxed)),
+        Duration::from_millis(OUTPUT_PROOF_MS.load(Ordering::Relaxed)),
+    )
+}
+
+fn estimate(
+    spends: usize,
+    outputs: usize,
+    threads: usize,
+    spend_proof_time: Duration,
+    output_proof_time: Duration,
+) -> Duration {
+    let outputs = if spends > 0 {
+        outputs.max(MIN_SAPLING_OUTPUTS)
+    } else {
+        outputs
+    };
+    (spend_proof_time * spends as u32 + output_proof_time * outputs as u32) / threads.max(1) as u32
+}
+
+#[cfg(test)]
+mod tests {
+    use std::time::Duration;
+
+    use super::estimate;
+
+    #[test]
+    fn estimate_pads_outputs_and_divides_by_threads() {
+        let spend = Duration::from_millis(1500);
+        let output = Duration::from_millis(500);
+        assert_eq!(
+            estimate(1, 1, 1, spend, output),
+            Duration::from_millis(2500)
+        );
+        assert_eq!(
+            estimate(2, 3, 2, spend, output),
+            Duration::from_millis(2250)
+        );
+        assert_eq!(estimate(0, 1, 1, spend, output), output);
+        assert_eq!(estimate(0, 0, 0, spend, output), Duration::ZERO);
+    }
+}
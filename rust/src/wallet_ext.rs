@@ -0,0 +1,324 @@
+//! Direct access to the data database, for the bookkeeping that this library performs
+//! alongside the schema managed by `zcash_client_sqlite`.
+
+use std::path::Path;
+use std::time::Duration;
+
+use rusqlite::Connection;
+
+/// How long a connection opened by this module waits for a lock held by another
+/// connection (for example the one owned by a `WalletDb`) before giving up.
+const BUSY_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// The tables, indexes and triggers that [`init`] creates.
+const OBJECTS: &[&str] = &[
+    "sapling_witnesses_block",
+    "scan_checkpoints",
+    "scan_checkpoint_witnesses",
+    "received_notes_account",
+    "utxos_account_height",
+    "account_balances",
+    "account_balances_state",
+    "transactions_block",
+    "tx_history",
+    "tx_history_id_tx",
+    "tx_history_state",
+    "wallet_events",
+    "wallet_events_note_received",
+    "wallet_events_note_spent",
+    "wallet_events_note_unspent",
+    "wallet_events_tx_mined",
+    "wallet_events_mined_tx_added",
+];
+
+/// Opens a connection to the data database at `path`.
+///
+/// If the database has been initialized by `zcash_client_sqlite` but lacks any of the objects
+/// that [`init`] creates, for example because it was created by an older version of this
+/// library, or because an upstream migration rebuilt a table and dropped its triggers, they are
+/// created.
+pub(crate) fn open<P: AsRef<Path>>(path: P) -> rusqlite::Result<Connection> {
+    let conn = Connection::open(path)?;
+    conn.busy_timeout(BUSY_TIMEOUT)?;
+
+    let (has_wallet, present): (bool, usize) = conn.query_row(
+        &format!(
+            "SELECT
+                EXISTS (SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'received_notes'),
+                (SELECT COUNT(*) FROM sqlite_master WHERE name IN ({}))",
+            OBJECTS
+                .iter()
+                .map(|name| format!("'{}'", name))
+                .collect::<Vec<_>>()
+                .join(", ")
+        ),
+        [],
+        |row| Ok((row.get(0)?, row.get(1)?)),
+    )?;
+    if has_wallet && present < OBJECTS.len() {
+        init(&conn)?;
+    }
+
+    Ok(conn)
+}
+
+/// Creates the tables that this library maintains in the data database, if they do not
+/// exist yet.
+pub(crate) fn init(conn: &Connection) -> rusqlite::Result<()> {
+    conn.execute_batch(
+        "CREATE INDEX IF NOT EXISTS sapling_witnesses_block ON sapling_witnesses (block);
+        CREATE TABLE IF NOT EXISTS scan_checkpoints (
+            height INTEGER PRIMARY KEY
+        );
+        CREATE TABLE IF NOT EXISTS scan_checkpoint_witnesses (
+            height INTEGER NOT NULL,
+            note INTEGER NOT NULL,
+            witness BLOB NOT NULL,
+            PRIMARY KEY (height, note)
+        );
+        CREATE INDEX IF NOT EXISTS received_notes_account ON received_notes (account);
+        CREATE INDEX IF NOT EXISTS utxos_account_height ON utxos (received_by_account, height);
+        CREATE TABLE IF NOT EXISTS account_balances (
+            account INTEGER NOT NULL,
+            min_confirmations INTEGER NOT NULL,
+            tip_height INTEGER NOT NULL,
+            balance INTEGER NOT NULL,
+            PRIMARY KEY (account, min_confirmations)
+        );
+        CREATE TABLE IF NOT EXISTS account_balances_state (
+            id INTEGER PRIMARY KEY CHECK (id = 0),
+            last_seq INTEGER,
+            min_height INTEGER,
+            tip_height INTEGER
+        );
+        INSERT OR IGNORE INTO account_balances_state (id) VALUES (0);
+        CREATE INDEX IF NOT EXISTS transactions_block ON transactions (block);
+        CREATE TABLE IF NOT EXISTS tx_history (
+            account_id INTEGER NOT NULL,
+            id_tx INTEGER NOT NULL,
+            mined_height INTEGER,
+            tx_index INTEGER,
+            txid BLOB NOT NULL,
+            expiry_height INTEGER,
+            raw BLOB,
+            account_balance_delta INTEGER NOT NULL,
+            fee_paid INTEGER,
+            has_change INTEGER NOT NULL,
+            sent_note_count INTEGER NOT NULL,
+            received_note_count INTEGER NOT NULL,
+            memo_count INTEGER NOT NULL,
+            block_time INTEGER,
+            expired_unmined INTEGER,
+            PRIMARY KEY (account_id, id_tx)
+        ) WITHOUT ROWID;
+        CREATE INDEX IF NOT EXISTS tx_history_id_tx ON tx_history (id_tx DESC, account_id);
+        CREATE TABLE IF NOT EXISTS tx_history_state (
+            id INTEGER PRIMARY KEY CHECK (id = 0),
+            last_id_tx INTEGER NOT NULL
+        );
+        INSERT OR IGNORE INTO tx_history_state (id, last_id_tx) VALUES (0, 0);
+        CREATE TABLE IF NOT EXISTS wallet_events (
+            seq INTEGER PRIMARY KEY AUTOINCREMENT,
+            kind INTEGER NOT NULL,
+            height INTEGER,
+            id_tx INTEGER,
+            id_note INTEGER,
+            account INTEGER,
+            value INTEGER
+        );
+        CREATE TRIGGER IF NOT EXISTS wallet_events_note_received
+        AFTER INSERT ON received_notes
+        BEGIN
+            INSERT INTO wallet_events (kind, height, id_tx, id_note, account, value)
+            SELECT 0, block, NEW.tx, NEW.id_note, NEW.account, NEW.value
+            FROM transactions WHERE id_tx = NEW.tx;
+        END;
+        CREATE TRIGGER IF NOT EXISTS wallet_events_note_spent
+        AFTER UPDATE OF spent ON received_notes
+        WHEN OLD.spent IS NULL AND NEW.spent IS NOT NULL
+        BEGIN
+            INSERT INTO wallet_events (kind, height, id_tx, id_note, account, value)
+            SELECT 1, block, NEW.spent, NEW.id_note, NEW.account, NEW.value
+            FROM transactions WHERE id_tx = NEW.spent;
+        END;
+        CREATE TRIGGER IF NOT EXISTS wallet_events_note_unspent
+        AFTER UPDATE OF spent ON received_notes
+        WHEN OLD.spent IS NOT NULL AND NEW.spent IS NULL
+        BEGIN
+            INSERT INTO wallet_events (kind, height, id_tx, id_note, account, value)
+            VALUES (4, NULL, OLD.spent, NEW.id_note, NEW.account, NEW.value);
+        END;
+        CREATE TRIGGER IF NOT EXISTS wallet_events_tx_mined
+        AFTER UPDATE OF block ON transactions
+        WHEN OLD.block IS NULL AND NEW.block IS NOT NULL
+        BEGIN
+            INSERT INTO wallet_events (kind, height, id_tx) VALUES (2, NEW.block, NEW.id_tx);
+        END;
+        CREATE TRIGGER IF NOT EXISTS wallet_events_mined_tx_added
+        AFTER INSERT ON transactions
+        WHEN NEW.block IS NOT NULL
+        BEGIN
+            INSERT INTO wallet_events (kind, height, id_tx) VALUES (2, NEW.block, NEW.id_tx);
+        END;",
+    )
+}
+
+/// Returns an in-memory data database with the subset of the `zcash_client_sqlite` schema
+/// that this library reads, on which [`init`] has been run.
+///
+/// `v_transactions` only aggregates received notes.
+#[cfg(test)]
+pub(crate) fn test_wallet() -> Connection {
+    let conn = Connection::open_in_memory().unwrap();
+    conn.execute_batch(
+        "CREATE TABLE accounts (account INTEGER PRIMARY KEY, ufvk TEXT);
+        CREATE TABLE blocks (
+            height INTEGER PRIMARY KEY,
+            hash BLOB,
+            time INTEGER,
+            sapling_tree BLOB
+        );
+        CREATE TABLE transactions (
+            id_tx INTEGER PRIMARY KEY,
+            txid BLOB NOT NULL UNIQUE,
+            created TEXT,
+            block INTEGER,
+            tx_index INTEGER,
+            expiry_height INTEGER,
+            raw BLOB,
+            fee INTEGER
+        );
+        CREATE TABLE received_notes (
+            id_note INTEGER PRIMARY KEY,
+            tx INTEGER NOT NULL,
+            output_index INTEGER NOT NULL DEFAULT 0,
+            account INTEGER NOT NULL,
+            diversifier BLOB,
+            value INTEGER NOT NULL,
+            rcm BLOB,
+            nf BLOB UNIQUE,
+            is_change BOOLEAN NOT NULL DEFAULT 0,
+            memo BLOB,
+            spent INTEGER
+        );
+        CREATE TABLE sent_notes (
+            id_note INTEGER PRIMARY KEY,
+            tx INTEGER NOT NULL,
+            from_account INTEGER NOT NULL,
+            value INTEGER NOT NULL,
+            memo BLOB
+        );
+        CREATE TABLE sapling_witnesses (
+            id_witness INTEGER PRIMARY KEY,
+            note INTEGER NOT NULL,
+            block INTEGER NOT NULL,
+            witness BLOB NOT NULL,
+            UNIQUE (note, block)
+        );
+        CREATE TABLE utxos (
+            id_utxo INTEGER PRIMARY KEY,
+            received_by_account INTEGER NOT NULL,
+            address TEXT,
+            prevout_txid BLOB,
+            prevout_idx INTEGER,
+            script BLOB,
+            value_zat INTEGER NOT NULL,
+            height INTEGER NOT NULL,
+            spent_in_tx INTEGER
+        );
+        CREATE TABLE addresses (
+            account INTEGER NOT NULL,
+            diversifier_index_be BLOB NOT NULL,
+            address TEXT NOT NULL,
+            cached_transparent_receiver_address TEXT,
+            UNIQUE (account, diversifier_index_be)
+        );
+        CREATE VIEW v_transactions AS
+        SELECT
+            received_notes.account AS account_id,
+            transactions.id_tx,
+            transactions.block AS mined_height,
+            transactions.tx_index,
+            transactions.txid,
+            transactions.expiry_height,
+            transactions.raw,
+            SUM(received_notes.value) AS account_balance_delta,
+            transactions.fee AS fee_paid,
+            0 AS has_change,
+            0 AS sent_note_count,
+            COUNT(received_notes.id_note) AS received_note_count,
+            0 AS memo_count,
+            blocks.time AS block_time,
+            (
+                transactions.block IS NULL
+                AND transactions.expiry_height BETWEEN 1 AND (SELECT MAX(height) FROM blocks)
+            ) AS expired_unmined
+        FROM transactions
+        JOIN received_notes ON received_notes.tx = transactions.id_tx
+        LEFT JOIN blocks ON blocks.height = transactions.block
+        GROUP BY received_notes.account, transactions.id_tx;",
+    )
+    .unwrap();
+    init(&conn).unwrap();
+    conn
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn missing_objects(conn: &Connection) -> usize {
+        OBJECTS
+            .iter()
+            .filter(|name| {
+                conn.query_row(
+                    "SELECT COUNT(*) FROM sqlite_master WHERE name = ?",
+                    [name],
+                    |row| row.get::<_, i64>(0),
+                )
+                .unwrap()
+                    == 0
+            })
+            .count()
+    }
+
+    #[test]
+    fn init_creates_every_object() {
+        let conn = test_wallet();
+        assert_eq!(missing_objects(&conn), 0);
+        init(&conn).unwrap();
+    }
+
+    #[test]
+    fn open_recreates_missing_objects() {
+        let path = std::env::temp_dir().join(format!("wallet_ext_open_{}.db", std::process::id()));
+        let _ = std::fs::remove_file(&path);
+
+        // A database that has not been initialized by zcash_client_sqlite is left alone.
+        assert_eq!(missing_objects(&open(&path).unwrap()), OBJECTS.len());
+
+        let conn = Connection::open(&path).unwrap();
+        conn.execute_batch(
+            "CREATE TABLE received_notes (id_note INTEGER PRIMARY KEY, tx INTEGER, account INTEGER,
+                value INTEGER, spent INTEGER);
+            CREATE TABLE transactions (id_tx INTEGER PRIMARY KEY, block INTEGER);
+            CREATE TABLE sapling_witnesses (note INTEGER, block INTEGER);
+            CREATE TABLE utxos (received_by_account INTEGER, height INTEGER);",
+        )
+        .unwrap();
+        assert_eq!(missing_objects(&open(&path).unwrap()), 0);
+
+        // An upstream migration that rebuilds a table drops its triggers.
+        conn.execute_batch(
+            "ALTER TABLE received_notes RENAME TO received_notes_old;
+            CREATE TABLE received_notes AS SELECT * FROM received_notes_old;
+            DROP TABLE received_notes_old;",
+        )
+        .unwrap();
+        assert!(missing_objects(&conn) > 0);
+        assert_eq!(missing_objects(&open(&path).unwrap()), 0);
+
+        drop(conn);
+        std::fs::remove_file(&path).unwrap();
+    }
+}